@@ -1,5 +1,6 @@
 #include "prot/elf_loader.hh"
 
+#include <algorithm>
 #include <ranges>
 
 #include <elfio/elfio.hpp>
@@ -47,6 +48,70 @@ ElfLoader::ElfLoader(const std::filesystem::path &filename)
 
 isa::Addr ElfLoader::getEntryPoint() const { return m_elf->get_entry(); }
 
+std::vector<AddrRange> ElfLoader::getCodeRanges() const {
+  std::vector<AddrRange> ranges;
+  for (const auto &seg :
+       m_elf->segments | std::views::filter([](const auto &seg) {
+         return seg->get_type() == ELFIO::PT_LOAD &&
+                (seg->get_flags() & ELFIO::PF_X) != 0;
+       })) {
+    ranges.push_back(AddrRange{
+        .start = static_cast<isa::Addr>(seg->get_virtual_address()),
+        .size = seg->get_file_size()});
+  }
+
+  return ranges;
+}
+
+std::vector<AddrRange> ElfLoader::getReadOnlyRanges() const {
+  std::vector<AddrRange> ranges;
+  for (const auto &seg :
+       m_elf->segments | std::views::filter([](const auto &seg) {
+         return seg->get_type() == ELFIO::PT_LOAD &&
+                (seg->get_flags() & ELFIO::PF_W) == 0;
+       })) {
+    ranges.push_back(AddrRange{
+        .start = static_cast<isa::Addr>(seg->get_virtual_address()),
+        .size = seg->get_memory_size()});
+  }
+
+  return ranges;
+}
+
+std::vector<FuncSymbol> ElfLoader::getFunctions() const {
+  std::vector<FuncSymbol> funcs;
+  for (const auto &sec :
+       m_elf->sections | std::views::filter([](const auto &sec) {
+         return sec->get_type() == ELFIO::SHT_SYMTAB;
+       })) {
+    const ELFIO::symbol_section_accessor symbols{*m_elf, sec.get()};
+    for (ELFIO::Elf_Xword idx = 0; idx < symbols.get_symbols_num(); ++idx) {
+      std::string name;
+      ELFIO::Elf64_Addr value{};
+      ELFIO::Elf_Xword size{};
+      unsigned char bind{};
+      unsigned char type{};
+      ELFIO::Elf_Half secIdx{};
+      unsigned char other{};
+      symbols.get_symbol(idx, name, value, size, bind, type, secIdx, other);
+
+      if (type == ELFIO::STT_FUNC && size != 0) {
+        funcs.push_back(FuncSymbol{
+            .name = std::move(name),
+            .range = {.start = static_cast<isa::Addr>(value), .size = size}});
+      }
+    }
+  }
+
+  // Aliases share the same code
+  const auto getStart = [](const auto &func) { return func.range.start; };
+  std::ranges::sort(funcs, {}, getStart);
+  const auto [first, last] = std::ranges::unique(funcs, {}, getStart);
+  funcs.erase(first, last);
+
+  return funcs;
+}
+
 void ElfLoader::loadMemory(Memory &mem) const {
   for (const auto &seg :
        m_elf->segments | std::views::filter([](const auto &seg) {
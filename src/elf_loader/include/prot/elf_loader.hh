@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <istream>
 #include <memory>
+#include <vector>
 
 #include "prot/memory.hh"
 
@@ -26,6 +27,12 @@ public:
 
   void loadMemory(Memory &mem) const;
   [[nodiscard]] isa::Addr getEntryPoint() const;
+  // Ranges of executable segments
+  [[nodiscard]] std::vector<AddrRange> getCodeRanges() const;
+  // Ranges of loaded segments w/out write permission
+  [[nodiscard]] std::vector<AddrRange> getReadOnlyRanges() const;
+  // Sized function symbols sorted by address
+  [[nodiscard]] std::vector<FuncSymbol> getFunctions() const;
 
   ~ElfLoader();
 
@@ -5,12 +5,23 @@
 #include "prot/isa.hh"
 #include "prot/memory.hh"
 
+#include <span>
+
 namespace prot {
 struct ExecEngine {
   virtual ~ExecEngine() = default;
 
   virtual void execute(CPUState &cpu, const isa::Instruction &insn) = 0;
   virtual void step(CPUState &cpu);
+  // Called once code range is loaded into memory
+  virtual void preDecode(CPUState & /*cpu*/, const AddrRange & /*range*/) {}
+  // Called once all program functions are loaded into memory
+  virtual void preTranslate(CPUState & /*cpu*/,
+                            std::span<const FuncSymbol> /*funcs*/) {}
+  // Called for loaded ranges which are protected from writes till the end
+  virtual void setReadOnly(CPUState & /*cpu*/, const AddrRange & /*range*/) {}
+  // Called once guest stack is set up, sp starts at the end of range
+  virtual void setStack(CPUState & /*cpu*/, const AddrRange & /*range*/) {}
 };
 } // namespace prot
 
@@ -1,18 +1,146 @@
 #include "prot/hart.hh"
 
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <optional>
+#include <span>
+#include <vector>
+
+extern "C" {
+#include <signal.h>
+#include <unistd.h>
+}
+
 namespace prot {
+namespace {
+// Hart run by this thread, looked up by SIGSEGV handler
+struct RunningHart final {
+  const CPUState *cpu{};
+  std::uintptr_t hostBase{};
+  std::span<const AddrRange> readOnly;
+  // Handler installed before ours, gets faults which are not guest ones
+  struct sigaction prev {};
+};
+thread_local RunningHart tRunning;
+
+void onSegv(int sig, siginfo_t *info, void *ctx) {
+  const auto &running = tRunning;
+  const auto host = reinterpret_cast<std::uintptr_t>(info->si_addr);
+  const auto offset = host - running.hostBase;
+  if (running.cpu != nullptr &&
+      offset <= std::numeric_limits<isa::Addr>::max()) {
+    const auto addr = static_cast<isa::Addr>(offset);
+    if (std::ranges::any_of(running.readOnly, [addr](const auto &range) {
+          return range.contains(addr);
+        })) {
+      // Only async signal safe calls here, formatting ints does not allocate
+      std::array<char, 128> buf{};
+      const auto res = fmt::format_to_n(
+          buf.data(), buf.size(),
+          "Guest write to read-only addr {:#x} at pc {:#x}\n", addr,
+          running.cpu->getPC());
+      [[maybe_unused]] const auto written =
+          ::write(STDERR_FILENO, buf.data(), std::min(res.size, buf.size()));
+      ::_exit(EXIT_FAILURE);
+    }
+  }
+
+  // Not a guest fault: previous handler takes it, e.g. sanitizer one. W/out
+  // such handler faulting insn is retried w/ default action
+  const auto &prev = running.prev;
+  if ((prev.sa_flags & SA_SIGINFO) != 0 && prev.sa_sigaction != nullptr) {
+    prev.sa_sigaction(sig, info, ctx);
+    return;
+  }
+  if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+    prev.sa_handler(sig);
+    return;
+  }
+  ::signal(sig, SIG_DFL);
+}
+
+// Installs onSegv for hart lifetime in run & restores previous handler.
+// Handler runs on its own stack, so faults on exhausted host stack, e.g.
+// after deep guest recursion, still reach it
+class SegvGuard final {
+public:
+  static constexpr std::size_t kMinStackSize = std::size_t{64} << 10;
+
+  explicit SegvGuard(const RunningHart &running)
+      : m_stack(std::max<std::size_t>(SIGSTKSZ, kMinStackSize)) {
+    stack_t altStack{};
+    altStack.ss_sp = m_stack.data();
+    altStack.ss_size = m_stack.size();
+    ::sigaltstack(&altStack, &m_prevStack);
+
+    tRunning = running;
+    struct sigaction act {};
+    act.sa_sigaction = onSegv;
+    act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&act.sa_mask);
+    ::sigaction(SIGSEGV, &act, &tRunning.prev);
+  }
+  SegvGuard(const SegvGuard &) = delete;
+  SegvGuard &operator=(const SegvGuard &) = delete;
+  SegvGuard(SegvGuard &&) = delete;
+  SegvGuard &operator=(SegvGuard &&) = delete;
+  ~SegvGuard() {
+    ::sigaction(SIGSEGV, &tRunning.prev, nullptr);
+    ::sigaltstack(&m_prevStack, nullptr);
+    tRunning = {};
+  }
+
+private:
+  std::vector<std::byte> m_stack;
+  stack_t m_prevStack{};
+};
+} // namespace
+
 Hart::Hart(std::unique_ptr<Memory> mem, std::unique_ptr<ExecEngine> engine)
     : m_mem(std::move(mem)), m_cpu(std::make_unique<CPUState>(m_mem.get())),
       m_engine(std::move(engine)) {}
 
 void Hart::load(const ElfLoader &loader) {
   loader.loadMemory(*m_mem);
+  for (const auto &range : loader.getReadOnlyRanges()) {
+    if (const auto prot = m_mem->protect(range); prot.size != 0) {
+      m_readOnly.push_back(prot);
+      m_engine->setReadOnly(*m_cpu, prot);
+    }
+  }
+  for (const auto &range : loader.getCodeRanges()) {
+    m_engine->preDecode(*m_cpu, range);
+  }
+  m_engine->preTranslate(*m_cpu, loader.getFunctions());
   setPC(loader.getEntryPoint());
 }
 
+void Hart::run() {
+  // Protected pages fault on host, whichever engine path does the store
+  std::optional<SegvGuard> guard;
+  if (!m_readOnly.empty()) {
+    guard.emplace(RunningHart{
+        .cpu = m_cpu.get(),
+        .hostBase = reinterpret_cast<std::uintptr_t>(m_mem->getHostBase()),
+        .readOnly = m_readOnly});
+  }
+  while (!m_cpu->finished) {
+    m_engine->step(*m_cpu);
+  }
+}
+
 void Hart::dump(std::ostream &ost) const { m_cpu->dump(ost); }
 
-void Hart::setSP(isa::Addr addr) { m_cpu->setReg(2, addr); }
+void Hart::setSP(isa::Addr addr, std::size_t size) {
+  m_cpu->setReg(2, addr);
+  const auto start = addr > size ? static_cast<isa::Addr>(addr - size) : 0;
+  m_engine->setStack(*m_cpu, AddrRange{.start = start, .size = addr - start});
+}
 
 void Hart::setPC(isa::Addr addr) { m_cpu->setPC(addr); }
 } // namespace prot
@@ -2,6 +2,7 @@
 #define PROT_HART_HH_INCLUDED
 
 #include <memory>
+#include <vector>
 
 #include "prot/cpu_state.hh"
 #include "prot/elf_loader.hh"
@@ -11,9 +12,12 @@
 namespace prot {
 class Hart {
 public:
+  static constexpr std::size_t kDefaultStackSize = 8U << 20U;
+
   Hart(std::unique_ptr<Memory> mem, std::unique_ptr<ExecEngine> engine);
 
-  void setSP(isa::Addr addr);
+  // Stack occupies size bytes below addr
+  void setSP(isa::Addr addr, std::size_t size = kDefaultStackSize);
 
   void load(const ElfLoader &loader);
 
@@ -21,11 +25,9 @@ public:
 
   void setPC(isa::Addr addr);
 
-  void run() {
-    while (!m_cpu->finished) {
-      m_engine->step(*m_cpu);
-    }
-  }
+  // Guest store into range made read-only by load ends run w/ error naming
+  // address & pc (pc of block being run for JIT)
+  void run();
 
   auto getExitCode() { return m_cpu->getExitCode(); }
 
@@ -35,6 +37,8 @@ private:
   std::unique_ptr<Memory> m_mem;
   std::unique_ptr<CPUState> m_cpu;
   std::unique_ptr<ExecEngine> m_engine;
+  // Guest ranges protected by memory, see Memory::protect
+  std::vector<AddrRange> m_readOnly;
 };
 } // namespace prot
 
@@ -2,13 +2,98 @@
 #define PROT_INTERPRETER_HH_INCLUDED
 
 #include <array>
+#include <optional>
+#include <span>
+#include <vector>
 
 #include "prot/exec_engine.hh"
 
 namespace prot::engine {
+// Code ranges decoded ahead of execution in a single batch
+class PreDecoded final {
+public:
+  void add(isa::Addr start, std::span<const isa::Word> words);
+  // nullopt if pc was not pre-decoded
+  [[nodiscard]] std::optional<isa::Instruction> lookup(isa::Addr pc) const;
+  // Drops insns covering [addr, addr + size)
+  void invalidate(isa::Addr addr, std::size_t size);
+
+private:
+  struct Segment final {
+    isa::Addr start{};
+    std::vector<std::optional<isa::Instruction>> insns;
+  };
+
+  std::vector<Segment> m_segments;
+};
+
 class Interpreter : public ExecEngine {
 public:
   void execute(CPUState &cpu, const isa::Instruction &insn) override;
+  // Runs insns till the end of BB
+  void step(CPUState &cpu) override;
+  void preDecode(CPUState &cpu, const AddrRange &range) override;
+
+protected:
+  [[nodiscard]] const PreDecoded &getPreDecoded() const {
+    return m_preDecoded;
+  }
+
+private:
+  // Direct-mapped cache of decoded insns keyed by PC
+  class DecodeCache final {
+  public:
+    static constexpr isa::Addr kInvalidAddr{1};
+    static constexpr std::size_t kSizeLog2{15};
+    static constexpr std::size_t kSize{1ULL << kSizeLog2};
+
+    // Takes pre-decoded insn or decodes it on miss
+    [[nodiscard]] isa::Instruction get(const CPUState &cpu,
+                                       const PreDecoded &preDecoded);
+    // Drops entries covering [addr, addr + size)
+    void invalidate(isa::Addr addr, std::size_t size);
+
+  private:
+    struct Entry final {
+      isa::Addr pc{kInvalidAddr};
+      isa::Instruction insn{isa::Opcode::kNumOpcodes};
+    };
+
+    [[nodiscard]] static constexpr std::size_t getHash(isa::Addr pc) {
+      return (pc / isa::kWordSize) & (kSize - 1);
+    }
+
+    std::vector<Entry> m_entries = std::vector<Entry>(kSize);
+  };
+
+  DecodeCache m_decodeCache;
+  PreDecoded m_preDecoded;
+};
+
+// Direct-threaded form of a straight-line instruction sequence.
+// Every instruction is pre-decoded into its handler, handlers tail-call each
+// other and guest PC is kept in an argument, so it is written back once per
+// block (or right before an instruction which needs it)
+class ThreadedCode final {
+public:
+  struct Insn;
+  using Handler = void (*)(const Insn *tinsn, CPUState &cpu, isa::Addr pc);
+
+  struct Insn final {
+    Handler handler{};
+    isa::Instruction insn;
+  };
+
+  ThreadedCode() : ThreadedCode(std::span<const isa::Instruction>{}) {}
+  explicit ThreadedCode(std::span<const isa::Instruction> insns);
+
+  void operator()(CPUState &cpu) const {
+    const auto *entry = m_code.data();
+    entry->handler(entry, cpu, cpu.getPC());
+  }
+
+private:
+  std::vector<Insn> m_code;
 };
 } // namespace prot::engine
 
@@ -1,8 +1,20 @@
 #include "prot/interpreter.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <concepts>
 #include <functional>
+#include <utility>
+
+#include <fmt/core.h>
+
+#if defined(__has_cpp_attribute) && __has_cpp_attribute(clang::musttail)
+#define PROT_MUSTTAIL [[clang::musttail]]
+#elif defined(__has_cpp_attribute) && __has_cpp_attribute(gnu::musttail)
+#define PROT_MUSTTAIL [[gnu::musttail]]
+#else
+#define PROT_MUSTTAIL
+#endif
 
 namespace prot::engine {
 namespace {
@@ -220,6 +232,35 @@ void doXORI(const isa::Instruction &inst, CPUState &state) {
   executeRegisterImmOp(inst, state, std::bit_xor<>{});
 }
 
+void doLI(const isa::Instruction &inst, CPUState &state) {
+  state.setReg(inst.rd(), inst.imm());
+}
+
+void doLA(const isa::Instruction &inst, CPUState &state) {
+  state.setReg(inst.rd(), state.getPC() + inst.imm());
+}
+
+void doLWPC(const isa::Instruction &inst, CPUState &state) {
+  state.setReg(inst.rd(),
+               state.memory->read<isa::Word>(state.getPC() + inst.imm()));
+}
+
+void doCALL(const isa::Instruction &inst, CPUState &state) {
+  auto retAddr = state.getPC() + inst.size();
+  auto target = state.getPC() + inst.imm();
+
+  target >>= 1;
+  target <<= 1;
+  state.setPC(target);
+
+  state.setReg(inst.rd(), retAddr);
+}
+
+void doSHADD(const isa::Instruction &inst, CPUState &state) {
+  auto shifted = sllHelper(state.getReg(inst.rs1()), inst.imm());
+  state.setReg(inst.rd(), shifted + state.getReg(inst.rs2()));
+}
+
 struct ExecHandlersMap final {
   using Handler = void (*)(const isa::Instruction &, CPUState &);
 
@@ -269,10 +310,16 @@ struct ExecHandlersMap final {
     PROT_SET_HANDLER(SW)
     PROT_SET_HANDLER(XOR)
     PROT_SET_HANDLER(XORI)
+
+    PROT_SET_HANDLER(LI)
+    PROT_SET_HANDLER(LA)
+    PROT_SET_HANDLER(LWPC)
+    PROT_SET_HANDLER(CALL)
+    PROT_SET_HANDLER(SHADD)
 #undef PROT_SET_HANDLER
   }
 
-  [[nodiscard]] Handler get(isa::Opcode opcode) const {
+  [[nodiscard]] constexpr Handler get(isa::Opcode opcode) const {
     assert(toUnderlying(opcode) < m_handlers.size());
     auto toRet = m_handlers[toUnderlying(opcode)];
     assert(toRet != nullptr);
@@ -284,8 +331,177 @@ private:
 };
 
 constexpr ExecHandlersMap kExecHandlers{};
+
+using ThreadedInsn = ThreadedCode::Insn;
+
+#define PROT_DISPATCH(tinsn, cpu, pc)                                          \
+  PROT_MUSTTAIL return (tinsn)->handler((tinsn), (cpu), (pc))
+
+template <ExecHandlersMap::Handler Handler>
+void threadedOp(const ThreadedInsn *tinsn, CPUState &cpu, isa::Addr pc) {
+  Handler(tinsn->insn, cpu);
+  PROT_DISPATCH(tinsn + 1, cpu, pc + tinsn->insn.size());
+}
+
+// Handler reads guest PC or may leave the block, so sync PC beforehand
+template <ExecHandlersMap::Handler Handler>
+void threadedSyncPCOp(const ThreadedInsn *tinsn, CPUState &cpu, isa::Addr pc) {
+  cpu.setPC(pc);
+  Handler(tinsn->insn, cpu);
+  PROT_DISPATCH(tinsn + 1, cpu, pc + tinsn->insn.size());
+}
+
+// Handler sets PC on its own, block execution ends here
+template <ExecHandlersMap::Handler Handler>
+void threadedBranch(const ThreadedInsn *tinsn, CPUState &cpu, isa::Addr pc) {
+  cpu.setPC(pc);
+  Handler(tinsn->insn, cpu);
+}
+
+void threadedExit(const ThreadedInsn * /*unused*/, CPUState &cpu,
+                  isa::Addr pc) {
+  cpu.setPC(pc);
+}
+
+#undef PROT_DISPATCH
+
+template <isa::Opcode Opc> consteval ThreadedCode::Handler threadedHandler() {
+  using enum isa::Opcode;
+  constexpr auto handler = kExecHandlers.get(Opc);
+  if constexpr (isa::changesPC(Opc)) {
+    return &threadedBranch<handler>;
+  } else if constexpr (Opc == kAUIPC || Opc == kLA || Opc == kLWPC ||
+                       isa::isTerminator(Opc)) {
+    return &threadedSyncPCOp<handler>;
+  } else {
+    return &threadedOp<handler>;
+  }
+}
+
+template <std::size_t... Idx>
+consteval auto makeThreadedHandlers(std::index_sequence<Idx...> /*unused*/) {
+  return std::array{threadedHandler<static_cast<isa::Opcode>(Idx)>()...};
+}
+
+constexpr auto kThreadedHandlers = makeThreadedHandlers(
+    std::make_index_sequence<toUnderlying(isa::Opcode::kNumOpcodes)>{});
 } // namespace
 
+void PreDecoded::add(isa::Addr start, std::span<const isa::Word> words) {
+  Segment seg{.start = start, .insns = {}};
+  seg.insns.resize(words.size(), std::nullopt);
+  isa::Instruction::decodeBatch(words, seg.insns);
+
+  m_segments.push_back(std::move(seg));
+}
+
+std::optional<isa::Instruction> PreDecoded::lookup(isa::Addr pc) const {
+  for (const auto &seg : m_segments) {
+    const auto offset = pc - seg.start;
+    if (offset % isa::kWordSize != 0) {
+      continue;
+    }
+    if (const auto idx = offset / isa::kWordSize; idx < seg.insns.size()) {
+      return seg.insns[idx];
+    }
+  }
+
+  return std::nullopt;
+}
+
+void PreDecoded::invalidate(isa::Addr addr, std::size_t size) {
+  for (auto &seg : m_segments) {
+    const auto segSize = seg.insns.size() * isa::kWordSize;
+    if (addr + size <= seg.start || addr >= seg.start + segSize) {
+      continue;
+    }
+    const auto first = (std::max(addr, seg.start) - seg.start) / isa::kWordSize;
+    const auto last =
+        std::min<std::size_t>((addr + size - 1 - seg.start) / isa::kWordSize,
+                              seg.insns.size() - 1);
+    for (auto idx = first; idx <= last; ++idx) {
+      seg.insns[idx].reset();
+    }
+  }
+}
+
+void Interpreter::preDecode(CPUState &cpu, const AddrRange &range) {
+  std::vector<isa::Word> words(range.size / isa::kWordSize);
+  cpu.memory->readBlock(range.start, std::as_writable_bytes(std::span{words}));
+  m_preDecoded.add(range.start, words);
+}
+
+isa::Instruction
+Interpreter::DecodeCache::get(const CPUState &cpu,
+                              const PreDecoded &preDecoded) {
+  const auto pc = cpu.getPC();
+  auto &entry = m_entries[getHash(pc)];
+  if (entry.pc == pc) [[likely]] {
+    return entry.insn;
+  }
+
+  if (const auto insn = preDecoded.lookup(pc)) {
+    entry = Entry{.pc = pc, .insn = *insn};
+    return entry.insn;
+  }
+
+  if (pc % isa::kWordSize != 0) {
+    throw std::runtime_error{fmt::format("Misaligned PC detected: {:#x}", pc)};
+  }
+
+  const auto bytes = cpu.memory->read<isa::Word>(pc);
+  const auto insn = isa::Instruction::decode(bytes);
+  if (!insn.has_value()) {
+    throw std::runtime_error{
+        fmt::format("Undefined instruction on decode: {:#x}", bytes)};
+  }
+
+  entry = Entry{.pc = pc, .insn = *insn};
+  return entry.insn;
+}
+
+void Interpreter::DecodeCache::invalidate(isa::Addr addr, std::size_t size) {
+  const auto first = addr / isa::kWordSize;
+  const auto last = (addr + size - 1) / isa::kWordSize;
+  for (auto word = first; word <= last; ++word) {
+    auto &entry = m_entries[getHash(word * isa::kWordSize)];
+    if (entry.pc == word * isa::kWordSize) {
+      entry.pc = kInvalidAddr;
+    }
+  }
+}
+
+void Interpreter::step(CPUState &cpu) {
+  while (true) {
+    const auto insn = m_decodeCache.get(cpu, m_preDecoded);
+    Interpreter::execute(cpu, insn);
+    ++cpu.icount;
+
+    const auto opc = insn.opcode();
+    if (isa::isStore(opc)) {
+      // Guest may overwrite its own code
+      const auto addr = cpu.getReg(insn.rs1()) + insn.imm();
+      m_decodeCache.invalidate(addr, isa::accessSize(opc));
+      m_preDecoded.invalidate(addr, isa::accessSize(opc));
+    }
+    if (isa::isTerminator(opc)) {
+      break;
+    }
+  }
+}
+
+ThreadedCode::ThreadedCode(std::span<const isa::Instruction> insns) {
+  m_code.reserve(insns.size() + 1);
+  for (const auto &insn : insns) {
+    assert(toUnderlying(insn.opcode()) < kThreadedHandlers.size());
+    m_code.push_back(
+        Insn{.handler = kThreadedHandlers[toUnderlying(insn.opcode())],
+             .insn = insn});
+  }
+  m_code.push_back(Insn{.handler = &threadedExit,
+                        .insn = isa::Instruction{isa::Opcode::kNumOpcodes}});
+}
+
 void Interpreter::execute(CPUState &cpu, const isa::Instruction &insn) {
   const auto handler = kExecHandlers.get(insn.opcode());
 
@@ -294,7 +510,7 @@ void Interpreter::execute(CPUState &cpu, const isa::Instruction &insn) {
   handler(insn, cpu);
 
   if (!isa::changesPC(insn.opcode())) {
-    cpu.setPC(oldPC + isa::kWordSize);
+    cpu.setPC(oldPC + insn.size());
   }
 }
 } // namespace prot::engine
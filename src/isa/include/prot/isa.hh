@@ -6,6 +6,7 @@
 
 #include <bit>
 #include <optional>
+#include <span>
 #include <stdexcept>
 #include <string_view>
 
@@ -137,6 +138,13 @@ enum class Opcode : uint16_t {
   kXOR,
   kXORI,
 
+  // Fused pseudo insns, see Instruction::fuse
+  kLI,    // LUI + ADDI: rd = imm
+  kLA,    // AUIPC + ADDI: rd = pc + imm
+  kLWPC,  // AUIPC + LW: rd = mem[pc + imm]
+  kCALL,  // AUIPC + JALR: rd = pc + 8, pc = (pc + imm) & ~1
+  kSHADD, // SLLI + ADD: rd = (rs1 << imm) + rs2
+
   kNumOpcodes,
 };
 
@@ -158,6 +166,7 @@ constexpr bool isTerminator(Opcode opc) {
   case Opcode::kFENCE:
   case Opcode::kJAL:
   case Opcode::kJALR:
+  case Opcode::kCALL:
     return true;
   default:
     break;
@@ -178,12 +187,158 @@ constexpr bool changesPC(Opcode opc) {
   case Opcode::kBNE:
   case Opcode::kJAL:
   case Opcode::kJALR:
+  case Opcode::kCALL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+constexpr bool isFused(Opcode opc) {
+  return toUnderlying(opc) >= toUnderlying(Opcode::kLI) &&
+         toUnderlying(opc) < toUnderlying(Opcode::kNumOpcodes);
+}
+
+constexpr bool isLoad(Opcode opc) {
+  switch (opc) {
+  case Opcode::kLB:
+  case Opcode::kLBU:
+  case Opcode::kLH:
+  case Opcode::kLHU:
+  case Opcode::kLW:
+    return true;
+  default:
+    return false;
+  }
+}
+
+constexpr bool isStore(Opcode opc) {
+  switch (opc) {
+  case Opcode::kSB:
+  case Opcode::kSH:
+  case Opcode::kSW:
     return true;
   default:
     return false;
   }
 }
 
+// Insn only computes rd from its operands and pc
+constexpr bool isArith(Opcode opc) {
+  switch (opc) {
+  case Opcode::kADD:
+  case Opcode::kADDI:
+  case Opcode::kAND:
+  case Opcode::kANDI:
+  case Opcode::kAUIPC:
+  case Opcode::kLUI:
+  case Opcode::kOR:
+  case Opcode::kORI:
+  case Opcode::kSLL:
+  case Opcode::kSLLI:
+  case Opcode::kSLT:
+  case Opcode::kSLTI:
+  case Opcode::kSLTIU:
+  case Opcode::kSLTU:
+  case Opcode::kSRA:
+  case Opcode::kSRAI:
+  case Opcode::kSRL:
+  case Opcode::kSRLI:
+  case Opcode::kSUB:
+  case Opcode::kXOR:
+  case Opcode::kXORI:
+  case Opcode::kLI:
+  case Opcode::kLA:
+  case Opcode::kSHADD:
+    return true;
+  default:
+    return false;
+  }
+}
+
+constexpr bool isBranch(Opcode opc) {
+  switch (opc) {
+  case Opcode::kBEQ:
+  case Opcode::kBGE:
+  case Opcode::kBGEU:
+  case Opcode::kBLT:
+  case Opcode::kBLTU:
+  case Opcode::kBNE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Register operands actually used by insn
+constexpr bool readsRs1(Opcode opc) {
+  switch (opc) {
+  case Opcode::kAUIPC:
+  case Opcode::kLUI:
+  case Opcode::kJAL:
+  case Opcode::kLI:
+  case Opcode::kLA:
+  case Opcode::kLWPC:
+  case Opcode::kCALL:
+    return false;
+  default:
+    return isArith(opc) || isLoad(opc) || isStore(opc) || isBranch(opc) ||
+           opc == Opcode::kJALR;
+  }
+}
+
+constexpr bool readsRs2(Opcode opc) {
+  switch (opc) {
+  case Opcode::kADD:
+  case Opcode::kAND:
+  case Opcode::kOR:
+  case Opcode::kSLL:
+  case Opcode::kSLT:
+  case Opcode::kSLTU:
+  case Opcode::kSRA:
+  case Opcode::kSRL:
+  case Opcode::kSUB:
+  case Opcode::kXOR:
+  case Opcode::kSHADD:
+    return true;
+  default:
+    return isStore(opc) || isBranch(opc);
+  }
+}
+
+constexpr bool writesRd(Opcode opc) {
+  switch (opc) {
+  case Opcode::kJAL:
+  case Opcode::kJALR:
+  case Opcode::kLWPC:
+  case Opcode::kCALL:
+    return true;
+  default:
+    return isArith(opc) || isLoad(opc);
+  }
+}
+
+// Size in bytes of memory accessed by load/store
+constexpr std::size_t accessSize(Opcode opc) {
+  switch (opc) {
+  case Opcode::kLB:
+  case Opcode::kLBU:
+  case Opcode::kSB:
+    return sizeof(Byte);
+  case Opcode::kLH:
+  case Opcode::kLHU:
+  case Opcode::kSH:
+    return sizeof(Half);
+  case Opcode::kLW:
+  case Opcode::kSW:
+    return sizeof(Word);
+  default:
+    throw std::invalid_argument{"Opcode does not access memory"};
+  }
+}
+
+class Decoder;
+
 struct Instruction final {
   using enum Opcode;
 
@@ -192,14 +347,38 @@ struct Instruction final {
   [[nodiscard]] auto opcode() const { return m_opc; }
 
   static std::optional<Instruction> decode(Word word);
+  // Decodes words[i] into out[i], undecodable words yield nullopt.
+  // Uses SIMD field extraction when host supports it
+  static void decodeBatch(std::span<const Word> words,
+                          std::span<std::optional<Instruction>> out);
+  // Fuses adjacent insns into single pseudo insn if they form known idiom
+  static std::optional<Instruction> fuse(const Instruction &first,
+                                         const Instruction &second);
+  // Folds x0 operands: known results become LI, register copies become
+  // ADDI rd, rs, 0 and arith insns writing x0 become PAUSE (no-op)
+  static Instruction simplify(const Instruction &insn);
+  // Folds insn located at pc w/ known values of its reg operands: arith
+  // insns become LI, JALR & branches become JAL. Result keeps insn size,
+  // nullopt if insn cannot be folded
+  static std::optional<Instruction> fold(const Instruction &insn, Addr pc,
+                                         Word rs1, Word rs2);
+  // Load w/ known loaded value (already extended) becomes LI, result keeps
+  // insn size
+  static Instruction foldLoad(const Instruction &insn, Word loaded);
+  // Same insn w/ its result discarded (written to x0)
+  static Instruction discardResult(const Instruction &insn);
 
   [[nodiscard]] Operand rd() const { return m_rd; }
   [[nodiscard]] Operand rs1() const { return m_rs1; }
   [[nodiscard]] Operand rs2() const { return m_rs2; }
   [[nodiscard]] Imm imm() const { return m_imm; }
   [[nodiscard]] std::string_view mnemonic() const { return strOpc(m_opc); }
+  // Amount of guest code bytes covered by insn
+  [[nodiscard]] Word size() const { return m_numWords * kWordSize; }
 
 private:
+  friend class Decoder;
+
   Instruction() = default;
 
   Opcode m_opc{};
@@ -207,6 +386,7 @@ private:
   Operand m_rs1{};
   Operand m_rs2{};
   Operand m_rd{};
+  std::uint8_t m_numWords{1};
 
   Imm m_imm{};
 };
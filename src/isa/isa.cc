@@ -2,11 +2,16 @@
 
 #include <algorithm>
 #include <array>
+#include <cassert>
 #include <functional>
 #include <optional>
 #include <ranges>
 #include <string_view>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace prot::isa {
 namespace {
 class Opc2StrMap final
@@ -61,6 +66,12 @@ public:
     PROT_MAKE_OPC(XOR)
     PROT_MAKE_OPC(XORI)
 
+    PROT_MAKE_OPC(LI)
+    PROT_MAKE_OPC(LA)
+    PROT_MAKE_OPC(LWPC)
+    PROT_MAKE_OPC(CALL)
+    PROT_MAKE_OPC(SHADD)
+
 #undef PROT_MAKE_OPC
   }
 
@@ -86,411 +97,583 @@ static_assert(
 
 std::string_view strOpc(Opcode opc) { return kOpc2Str.getName(opc); }
 
-// Automatically Generated Decoder
-std::optional<Instruction> Instruction::decode(Word word) {
-
-  Instruction instr{};
-  switch ((word >> 0) & 0b111000001111111) {
-  case 0b11: {
-    //! LB
-    //! xxxxxxxxxxxxxxxxx000xxxxx0000011
-    instr.m_opc = Opcode::kLB;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1000000000011: {
-    //! LH
-    //! xxxxxxxxxxxxxxxxx001xxxxx0000011
-    instr.m_opc = Opcode::kLH;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b10000000000011: {
-    //! LW
-    //! xxxxxxxxxxxxxxxxx010xxxxx0000011
-    instr.m_opc = Opcode::kLW;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b100000000000011: {
-    //! LBU
-    //! xxxxxxxxxxxxxxxxx100xxxxx0000011
-    instr.m_opc = Opcode::kLBU;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b101000000000011: {
-    //! LHU
-    //! xxxxxxxxxxxxxxxxx101xxxxx0000011
-    instr.m_opc = Opcode::kLHU;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1111: {
-    //! FENCE
-    //! xxxxxxxxxxxxxxxxx000xxxxx0001111
-    instr.m_opc = Opcode::kFENCE;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 28>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<27, 24>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<23, 20>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b10011: {
-    //! ADDI
-    //! xxxxxxxxxxxxxxxxx000xxxxx0010011
-    instr.m_opc = Opcode::kADDI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1000000010011: {
-    //! SLLI
-    //! 0000000xxxxxxxxxx001xxxxx0010011
-    instr.m_opc = Opcode::kSLLI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b10000000010011: {
-    //! SLTI
-    //! xxxxxxxxxxxxxxxxx010xxxxx0010011
-    instr.m_opc = Opcode::kSLTI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b11000000010011: {
-    //! SLTIU
-    //! xxxxxxxxxxxxxxxxx011xxxxx0010011
-    instr.m_opc = Opcode::kSLTIU;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b100000000010011: {
-    //! XORI
-    //! xxxxxxxxxxxxxxxxx100xxxxx0010011
-    instr.m_opc = Opcode::kXORI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b110000000010011: {
-    //! ORI
-    //! xxxxxxxxxxxxxxxxx110xxxxx0010011
-    instr.m_opc = Opcode::kORI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
+std::optional<Instruction> Instruction::fuse(const Instruction &first,
+                                             const Instruction &second) {
+  // Intermediate value must be dead after the pair
+  const auto tmp = first.rd();
+  if (tmp == 0 || second.rd() != tmp) {
+    return std::nullopt;
   }
-  case 0b111000000010011: {
-    //! ANDI
-    //! xxxxxxxxxxxxxxxxx111xxxxx0010011
-    instr.m_opc = Opcode::kANDI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b100011: {
-    //! SB
-    //! xxxxxxxxxxxxxxxxx000xxxxx0100011
-    instr.m_opc = Opcode::kSB;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1000000100011: {
-    //! SH
-    //! xxxxxxxxxxxxxxxxx001xxxxx0100011
-    instr.m_opc = Opcode::kSH;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b10000000100011: {
-    //! SW
-    //! xxxxxxxxxxxxxxxxx010xxxxx0100011
-    instr.m_opc = Opcode::kSW;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1100011: {
-    //! BEQ
-    //! xxxxxxxxxxxxxxxxx000xxxxx1100011
-    instr.m_opc = Opcode::kBEQ;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  case 0b1000001100011: {
-    //! BNE
-    //! xxxxxxxxxxxxxxxxx001xxxxx1100011
-    instr.m_opc = Opcode::kBNE;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  case 0b100000001100011: {
-    //! BLT
-    //! xxxxxxxxxxxxxxxxx100xxxxx1100011
-    instr.m_opc = Opcode::kBLT;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  case 0b101000001100011: {
-    //! BGE
-    //! xxxxxxxxxxxxxxxxx101xxxxx1100011
-    instr.m_opc = Opcode::kBGE;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  case 0b110000001100011: {
-    //! BLTU
-    //! xxxxxxxxxxxxxxxxx110xxxxx1100011
-    instr.m_opc = Opcode::kBLTU;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  case 0b111000001100011: {
-    //! BGEU
-    //! xxxxxxxxxxxxxxxxx111xxxxx1100011
-    instr.m_opc = Opcode::kBGEU;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-    return instr;
-  }
-  }
-  switch ((word >> 0) & 0b11111110000000000111000001111111) {
-  case 0b101000000010011: {
-    //! SRLI
-    //! 0000000xxxxxxxxxx101xxxxx0010011
-    instr.m_opc = Opcode::kSRLI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b1000000000000000101000000010011: {
-    //! SRAI
-    //! 0100000xxxxxxxxxx101xxxxx0010011
-    instr.m_opc = Opcode::kSRAI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
-  }
-  case 0b110011: {
-    //! ADD
-    //! 0000000xxxxxxxxxx000xxxxx0110011
-    instr.m_opc = Opcode::kADD;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+  Instruction fused{};
+  fused.m_rd = tmp;
+  fused.m_numWords = first.m_numWords + second.m_numWords;
+
+  switch (first.opcode()) {
+  case Opcode::kLUI:
+    if (second.opcode() != Opcode::kADDI || second.rs1() != tmp) {
+      return std::nullopt;
+    }
+    fused.m_opc = Opcode::kLI;
+    fused.m_imm = first.imm() + second.imm();
+    return fused;
+  case Opcode::kAUIPC:
+    if (second.rs1() != tmp) {
+      return std::nullopt;
+    }
+    if (second.opcode() == Opcode::kADDI) {
+      fused.m_opc = Opcode::kLA;
+    } else if (second.opcode() == Opcode::kLW) {
+      fused.m_opc = Opcode::kLWPC;
+    } else if (second.opcode() == Opcode::kJALR) {
+      fused.m_opc = Opcode::kCALL;
+    } else {
+      return std::nullopt;
+    }
+    fused.m_imm = first.imm() + second.imm();
+    return fused;
+  case Opcode::kSLLI: {
+    if (second.opcode() != Opcode::kADD) {
+      return std::nullopt;
+    }
+    // ADD is commutative, so shifted value may come from either operand
+    const bool lhs = second.rs1() == tmp;
+    const bool rhs = second.rs2() == tmp;
+    if (lhs == rhs) {
+      return std::nullopt;
+    }
+    fused.m_opc = Opcode::kSHADD;
+    fused.m_rs1 = first.rs1();
+    fused.m_rs2 = lhs ? second.rs2() : second.rs1();
+    fused.m_imm = first.imm();
+    return fused;
   }
-  case 0b1000000110011: {
-    //! SLL
-    //! 0000000xxxxxxxxxx001xxxxx0110011
-    instr.m_opc = Opcode::kSLL;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+  default:
+    return std::nullopt;
   }
-  case 0b10000000110011: {
-    //! SLT
-    //! 0000000xxxxxxxxxx010xxxxx0110011
-    instr.m_opc = Opcode::kSLT;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+}
+
+Instruction Instruction::simplify(const Instruction &insn) {
+  if (!isArith(insn.opcode())) {
+    return insn;
   }
-  case 0b11000000110011: {
-    //! SLTU
-    //! 0000000xxxxxxxxxx011xxxxx0110011
-    instr.m_opc = Opcode::kSLTU;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+  auto res = insn;
+  if (insn.rd() == 0) {
+    res.m_opc = Opcode::kPAUSE;
+    return res;
   }
-  case 0b100000000110011: {
-    //! XOR
-    //! 0000000xxxxxxxxxx100xxxxx0110011
-    instr.m_opc = Opcode::kXOR;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+  const auto makeLI = [&res](Word val) {
+    res.m_opc = Opcode::kLI;
+    res.m_rs1 = res.m_rs2 = 0;
+    res.m_imm = val;
+    return res;
+  };
+  const auto makeMove = [&](Operand src) {
+    if (src == 0) {
+      return makeLI(0);
+    }
+    res.m_opc = Opcode::kADDI;
+    res.m_rs1 = src;
+    res.m_rs2 = 0;
+    res.m_imm = 0;
+    return res;
+  };
+
+  const bool zero1 = insn.rs1() == 0;
+  const bool zero2 = insn.rs2() == 0;
+  const auto shamt = slice<4, 0>(insn.imm());
+  switch (insn.opcode()) {
+  case Opcode::kLUI:
+    return makeLI(insn.imm());
+  case Opcode::kADDI:
+  case Opcode::kORI:
+  case Opcode::kXORI:
+    if (zero1) {
+      return makeLI(insn.imm());
+    }
+    return insn.imm() == 0 ? makeMove(insn.rs1()) : insn;
+  case Opcode::kANDI:
+    return zero1 || insn.imm() == 0 ? makeLI(0) : insn;
+  case Opcode::kSLLI:
+  case Opcode::kSRLI:
+  case Opcode::kSRAI:
+    if (zero1) {
+      return makeLI(0);
+    }
+    return shamt == 0 ? makeMove(insn.rs1()) : insn;
+  case Opcode::kSLTI:
+    return zero1 ? makeLI(signedLess(0, insn.imm())) : insn;
+  case Opcode::kSLTIU:
+    return zero1 ? makeLI(insn.imm() != 0) : insn;
+  case Opcode::kADD:
+  case Opcode::kOR:
+  case Opcode::kXOR:
+    if (zero1) {
+      return makeMove(insn.rs2());
+    }
+    return zero2 ? makeMove(insn.rs1()) : insn;
+  case Opcode::kAND:
+    return zero1 || zero2 ? makeLI(0) : insn;
+  case Opcode::kSUB:
+    return zero2 ? makeMove(insn.rs1()) : insn;
+  case Opcode::kSLL:
+  case Opcode::kSRL:
+  case Opcode::kSRA:
+    if (zero1) {
+      return makeLI(0);
+    }
+    return zero2 ? makeMove(insn.rs1()) : insn;
+  case Opcode::kSLTU:
+    return zero2 ? makeLI(0) : insn;
+  case Opcode::kSHADD:
+    return zero1 ? makeMove(insn.rs2()) : insn;
+  default:
+    return insn;
   }
-  case 0b101000000110011: {
-    //! SRL
-    //! 0000000xxxxxxxxxx101xxxxx0110011
-    instr.m_opc = Opcode::kSRL;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+}
+
+std::optional<Instruction> Instruction::fold(const Instruction &insn, Addr pc,
+                                             Word rs1, Word rs2) {
+  auto res = insn;
+  const auto makeLI = [&res](Word val) {
+    res.m_opc = Opcode::kLI;
+    res.m_rs1 = res.m_rs2 = 0;
+    res.m_imm = val;
+    return res;
+  };
+  const auto makeJAL = [&res, pc](Operand rd, Addr target) {
+    res.m_opc = Opcode::kJAL;
+    res.m_rd = rd;
+    res.m_rs1 = res.m_rs2 = 0;
+    res.m_imm = target - pc;
+    return res;
+  };
+  const auto branch = [&](bool taken) {
+    return makeJAL(0, taken ? pc + insn.imm() : pc + insn.size());
+  };
+
+  const auto imm = insn.imm();
+  const auto sra = [](Word val, Word amount) {
+    return static_cast<Word>(std::bit_cast<std::int32_t>(val) >>
+                             slice<4, 0>(amount));
+  };
+  switch (insn.opcode()) {
+  case Opcode::kADD:
+    return makeLI(rs1 + rs2);
+  case Opcode::kADDI:
+    return makeLI(rs1 + imm);
+  case Opcode::kAND:
+    return makeLI(rs1 & rs2);
+  case Opcode::kANDI:
+    return makeLI(rs1 & imm);
+  case Opcode::kOR:
+    return makeLI(rs1 | rs2);
+  case Opcode::kORI:
+    return makeLI(rs1 | imm);
+  case Opcode::kXOR:
+    return makeLI(rs1 ^ rs2);
+  case Opcode::kXORI:
+    return makeLI(rs1 ^ imm);
+  case Opcode::kSUB:
+    return makeLI(rs1 - rs2);
+  case Opcode::kSLL:
+    return makeLI(rs1 << slice<4, 0>(rs2));
+  case Opcode::kSLLI:
+    return makeLI(rs1 << slice<4, 0>(imm));
+  case Opcode::kSRL:
+    return makeLI(rs1 >> slice<4, 0>(rs2));
+  case Opcode::kSRLI:
+    return makeLI(rs1 >> slice<4, 0>(imm));
+  case Opcode::kSRA:
+    return makeLI(sra(rs1, rs2));
+  case Opcode::kSRAI:
+    return makeLI(sra(rs1, imm));
+  case Opcode::kSLT:
+    return makeLI(signedLess(rs1, rs2));
+  case Opcode::kSLTI:
+    return makeLI(signedLess(rs1, imm));
+  case Opcode::kSLTU:
+    return makeLI(rs1 < rs2);
+  case Opcode::kSLTIU:
+    return makeLI(rs1 < imm);
+  case Opcode::kLUI:
+  case Opcode::kLI:
+    return makeLI(imm);
+  case Opcode::kAUIPC:
+  case Opcode::kLA:
+    return makeLI(pc + imm);
+  case Opcode::kSHADD:
+    return makeLI((rs1 << slice<4, 0>(imm)) + rs2);
+
+  case Opcode::kJALR:
+    return makeJAL(insn.rd(), (rs1 + imm) & ~Word{1});
+  case Opcode::kBEQ:
+    return branch(rs1 == rs2);
+  case Opcode::kBNE:
+    return branch(rs1 != rs2);
+  case Opcode::kBLT:
+    return branch(signedLess(rs1, rs2));
+  case Opcode::kBGE:
+    return branch(!signedLess(rs1, rs2));
+  case Opcode::kBLTU:
+    return branch(rs1 < rs2);
+  case Opcode::kBGEU:
+    return branch(rs1 >= rs2);
+  default:
+    return std::nullopt;
   }
-  case 0b110000000110011: {
-    //! OR
-    //! 0000000xxxxxxxxxx110xxxxx0110011
-    instr.m_opc = Opcode::kOR;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+}
+
+Instruction Instruction::foldLoad(const Instruction &insn, Word loaded) {
+  assert(isLoad(insn.opcode()) || insn.opcode() == Opcode::kLWPC);
+  auto res = insn;
+  res.m_opc = Opcode::kLI;
+  res.m_rs1 = res.m_rs2 = 0;
+  res.m_imm = loaded;
+  return res;
+}
+
+Instruction Instruction::discardResult(const Instruction &insn) {
+  auto res = insn;
+  res.m_rd = 0;
+  return simplify(res);
+}
+
+// Table-driven decoder: major opcode and funct3 select format descriptor,
+// whole table is built at compile time
+class Decoder final {
+public:
+  enum class Format : std::uint8_t {
+    kNone,
+    kR,
+    kI,
+    kShamt,
+    kS,
+    kB,
+    kU,
+    kJ,
+    kFence,
+    kSystem,
+  };
+
+  struct Entry final {
+    Opcode opc{Opcode::kNumOpcodes};
+    // Selected by funct7 == 0b0100000 (SUB, SRA, SRAI) or by EBREAK encoding
+    Opcode alt{Opcode::kNumOpcodes};
+    Format format{Format::kNone};
+    bool checkFunct7{false};
+  };
+
+  // All possible fields of insn, immediates are already sign extended
+  struct Fields final {
+    Word rd{};
+    Word rs1{};
+    Word rs2{};
+    Imm immI{};
+    Imm immS{};
+    Imm immB{};
+    Imm immU{};
+    Imm immJ{};
+  };
+
+  static constexpr std::size_t kTableSize = std::size_t{1} << 8;
+
+  [[nodiscard]] static constexpr std::size_t getIdx(Word word) {
+    return (slice<6, 2>(word) << 3) | slice<14, 12>(word);
   }
-  case 0b111000000110011: {
-    //! AND
-    //! 0000000xxxxxxxxxx111xxxxx0110011
-    instr.m_opc = Opcode::kAND;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+  [[nodiscard]] static constexpr Fields extract(Word word) {
+    const auto sword = std::bit_cast<std::int32_t>(word);
+    return Fields{
+        .rd = slice<11, 7>(word),
+        .rs1 = slice<19, 15>(word),
+        .rs2 = slice<24, 20>(word),
+        .immI = std::bit_cast<Imm>(sword >> 20),
+        .immS = std::bit_cast<Imm>((sword >> 25) * (1 << 5)) |
+                slice<11, 7>(word),
+        .immB = std::bit_cast<Imm>((sword >> 31) * (1 << 12)) |
+                (slice<7, 7>(word) << 11) | (slice<30, 25>(word) << 5) |
+                (slice<11, 8>(word) << 1),
+        .immU = word & getMask<Word>(31, 12),
+        .immJ = std::bit_cast<Imm>((sword >> 31) * (1 << 20)) |
+                (word & getMask<Word>(19, 12)) | (slice<20, 20>(word) << 11) |
+                (slice<30, 21>(word) << 1),
+    };
   }
-  case 0b1000000000000000000000000110011: {
-    //! SUB
-    //! 0100000xxxxxxxxxx000xxxxx0110011
-    instr.m_opc = Opcode::kSUB;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+  static std::optional<Instruction> assemble(Word word, const Fields &fields);
+};
+
+namespace {
+// Major opcodes (bits 6:2, bits 1:0 are always 0b11 for RV32I)
+enum class Major : Word {
+  kLoad = 0b00000,
+  kMiscMem = 0b00011,
+  kOpImm = 0b00100,
+  kAuipc = 0b00101,
+  kStore = 0b01000,
+  kOp = 0b01100,
+  kLui = 0b01101,
+  kBranch = 0b11000,
+  kJalr = 0b11001,
+  kJal = 0b11011,
+  kSystem = 0b11100,
+};
+
+class DecodeTable final
+    : public std::array<Decoder::Entry, Decoder::kTableSize> {
+public:
+  consteval DecodeTable() {
+    using enum Opcode;
+    using enum Major;
+    using Fmt = Decoder::Format;
+
+    set(kLoad, 0b000, kLB, Fmt::kI);
+    set(kLoad, 0b001, kLH, Fmt::kI);
+    set(kLoad, 0b010, kLW, Fmt::kI);
+    set(kLoad, 0b100, kLBU, Fmt::kI);
+    set(kLoad, 0b101, kLHU, Fmt::kI);
+
+    set(kMiscMem, 0b000, kFENCE, Fmt::kFence);
+
+    set(kOpImm, 0b000, kADDI, Fmt::kI);
+    set(kOpImm, 0b001, kSLLI, Fmt::kShamt);
+    set(kOpImm, 0b010, kSLTI, Fmt::kI);
+    set(kOpImm, 0b011, kSLTIU, Fmt::kI);
+    set(kOpImm, 0b100, kXORI, Fmt::kI);
+    set(kOpImm, 0b101, kSRLI, Fmt::kShamt, kSRAI);
+    set(kOpImm, 0b110, kORI, Fmt::kI);
+    set(kOpImm, 0b111, kANDI, Fmt::kI);
+
+    setAll(kAuipc, kAUIPC, Fmt::kU);
+
+    set(kStore, 0b000, kSB, Fmt::kS);
+    set(kStore, 0b001, kSH, Fmt::kS);
+    set(kStore, 0b010, kSW, Fmt::kS);
+
+    set(kOp, 0b000, kADD, Fmt::kR, kSUB);
+    set(kOp, 0b001, kSLL, Fmt::kR, kNumOpcodes);
+    set(kOp, 0b010, kSLT, Fmt::kR, kNumOpcodes);
+    set(kOp, 0b011, kSLTU, Fmt::kR, kNumOpcodes);
+    set(kOp, 0b100, kXOR, Fmt::kR, kNumOpcodes);
+    set(kOp, 0b101, kSRL, Fmt::kR, kSRA);
+    set(kOp, 0b110, kOR, Fmt::kR, kNumOpcodes);
+    set(kOp, 0b111, kAND, Fmt::kR, kNumOpcodes);
+
+    setAll(kLui, kLUI, Fmt::kU);
+
+    set(kBranch, 0b000, kBEQ, Fmt::kB);
+    set(kBranch, 0b001, kBNE, Fmt::kB);
+    set(kBranch, 0b100, kBLT, Fmt::kB);
+    set(kBranch, 0b101, kBGE, Fmt::kB);
+    set(kBranch, 0b110, kBLTU, Fmt::kB);
+    set(kBranch, 0b111, kBGEU, Fmt::kB);
+
+    setAll(kJalr, kJALR, Fmt::kI);
+    setAll(kJal, kJAL, Fmt::kJ);
+
+    at(getIdx(kSystem, 0b000)) = Decoder::Entry{
+        .opc = kECALL, .alt = kEBREAK, .format = Fmt::kSystem};
   }
-  case 0b1000000000000000101000000110011: {
-    //! SRA
-    //! 0100000xxxxxxxxxx101xxxxx0110011
-    instr.m_opc = Opcode::kSRA;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_rs2 = std::bit_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-    return instr;
+
+private:
+  static consteval std::size_t getIdx(Major major, Word funct3) {
+    return (toUnderlying(major) << 3) | funct3;
   }
+
+  consteval void set(Major major, Word funct3, Opcode opc,
+                     Decoder::Format format) {
+    at(getIdx(major, funct3)) = Decoder::Entry{.opc = opc, .format = format};
   }
-  switch ((word >> 0) & 0b1111111) {
-  case 0b10111: {
-    //! AUIPC
-    //! xxxxxxxxxxxxxxxxxxxxxxxxx0010111
-    instr.m_opc = Opcode::kAUIPC;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 12>(word) << 12) >> 0;
-    return instr;
+
+  // Insns with funct7 field: alt is chosen by funct7 == 0b0100000, other
+  // non-zero funct7 values are illegal
+  consteval void set(Major major, Word funct3, Opcode opc,
+                     Decoder::Format format, Opcode alt) {
+    at(getIdx(major, funct3)) = Decoder::Entry{
+        .opc = opc, .alt = alt, .format = format, .checkFunct7 = true};
   }
-  case 0b110111: {
-    //! LUI
-    //! xxxxxxxxxxxxxxxxxxxxxxxxx0110111
-    instr.m_opc = Opcode::kLUI;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 12>(word) << 12) >> 0;
-    return instr;
+
+  // funct3 is not a part of opcode
+  consteval void setAll(Major major, Opcode opc, Decoder::Format format) {
+    for (Word funct3 = 0; funct3 < 8; ++funct3) {
+      set(major, funct3, opc, format);
+    }
   }
-  case 0b1100111: {
-    //! JALR
-    //! xxxxxxxxxxxxxxxxx000xxxxx1100111
-    instr.m_opc = Opcode::kJALR;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_rs1 = std::bit_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-    return instr;
+};
+
+constexpr DecodeTable kDecodeTable;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PROT_DECODE_AVX2 1
+
+// Extracts fields of 8 words at once, insns are assembled from lanes
+__attribute__((target("avx2"))) std::size_t
+decodeBatchAVX2(std::span<const Word> words,
+                std::span<std::optional<Instruction>> out) {
+  constexpr std::size_t kLanes = sizeof(__m256i) / sizeof(Word);
+
+  std::size_t idx = 0;
+  for (; idx + kLanes <= words.size(); idx += kLanes) {
+    // NOLINTNEXTLINE
+    const auto word = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(words.data() + idx));
+    const auto mask5 = _mm256_set1_epi32(0x1f);
+    const auto sign = _mm256_srai_epi32(word, 31);
+
+    const auto rd = _mm256_and_si256(_mm256_srli_epi32(word, 7), mask5);
+    const auto rs1 = _mm256_and_si256(_mm256_srli_epi32(word, 15), mask5);
+    const auto rs2 = _mm256_and_si256(_mm256_srli_epi32(word, 20), mask5);
+
+    const auto immI = _mm256_srai_epi32(word, 20);
+    const auto immS = _mm256_or_si256(
+        _mm256_slli_epi32(_mm256_srai_epi32(word, 25), 5), rd);
+    const auto immB = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_slli_epi32(sign, 12),
+            _mm256_and_si256(_mm256_slli_epi32(word, 4),
+                             _mm256_set1_epi32(0x800))),
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(word, 20),
+                                         _mm256_set1_epi32(0x7e0)),
+                        _mm256_and_si256(_mm256_srli_epi32(word, 7),
+                                         _mm256_set1_epi32(0x1e))));
+    const auto immU =
+        _mm256_and_si256(word, _mm256_set1_epi32(getMask<Word>(31, 12)));
+    const auto immJ = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_slli_epi32(sign, 20),
+            _mm256_and_si256(word, _mm256_set1_epi32(getMask<Word>(19, 12)))),
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(word, 9),
+                                         _mm256_set1_epi32(0x800)),
+                        _mm256_and_si256(_mm256_srli_epi32(word, 20),
+                                         _mm256_set1_epi32(0x7fe))));
+
+    std::array<std::array<Word, kLanes>, 8> lanes{};
+    std::size_t field = 0;
+    for (const auto &vec : {rd, rs1, rs2, immI, immS, immB, immU, immJ}) {
+      // NOLINTNEXTLINE
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes[field++].data()),
+                          vec);
+    }
+
+    for (std::size_t lane = 0; lane < kLanes; ++lane) {
+      out[idx + lane] = Decoder::assemble(
+          words[idx + lane],
+          Decoder::Fields{.rd = lanes[0][lane],
+                          .rs1 = lanes[1][lane],
+                          .rs2 = lanes[2][lane],
+                          .immI = lanes[3][lane],
+                          .immS = lanes[4][lane],
+                          .immB = lanes[5][lane],
+                          .immU = lanes[6][lane],
+                          .immJ = lanes[7][lane]});
+    }
   }
-  case 0b1101111: {
-    //! JAL
-    //! xxxxxxxxxxxxxxxxxxxxxxxxx1101111
-    instr.m_opc = Opcode::kJAL;
-    instr.m_rd = std::bit_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<31, 31>(word) << 31) >> 11;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<30, 21>(word) << 1) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<20, 20>(word) << 11) >> 0;
-    instr.m_imm |= std::bit_cast<int32_t>(slice<19, 12>(word) << 12) >> 0;
-    return instr;
+
+  return idx;
+}
+
+bool hasAVX2() {
+  static const bool kHasAVX2 = __builtin_cpu_supports("avx2") != 0;
+  return kHasAVX2;
+}
+#endif
+} // namespace
+
+std::optional<Instruction> Decoder::assemble(Word word, const Fields &fields) {
+  if (slice<1, 0>(word) != 0b11) {
+    return std::nullopt;
   }
+
+  const auto &entry = kDecodeTable[getIdx(word)];
+  Instruction instr{entry.opc};
+
+  if (entry.checkFunct7) {
+    const auto funct7 = slice<31, 25>(word);
+    if (funct7 == 0b0100000 && entry.alt != Opcode::kNumOpcodes) {
+      instr.m_opc = entry.alt;
+    } else if (funct7 != 0) {
+      return std::nullopt;
+    }
   }
-  switch ((word >> 0) & 0b11111111111111111111111111111111) {
-  case 0b1110011: {
-    //! ECALL
-    //! 00000000000000000000000001110011
-    instr.m_opc = Opcode::kECALL;
-    return instr;
+
+  switch (entry.format) {
+  case Format::kNone:
+    return std::nullopt;
+  case Format::kR:
+    instr.m_rd = fields.rd;
+    instr.m_rs1 = fields.rs1;
+    instr.m_rs2 = fields.rs2;
+    break;
+  case Format::kI:
+    instr.m_rd = fields.rd;
+    instr.m_rs1 = fields.rs1;
+    instr.m_imm = fields.immI;
+    break;
+  case Format::kShamt:
+    instr.m_rd = fields.rd;
+    instr.m_rs1 = fields.rs1;
+    instr.m_imm = fields.rs2;
+    break;
+  case Format::kS:
+    instr.m_rs1 = fields.rs1;
+    instr.m_rs2 = fields.rs2;
+    instr.m_imm = fields.immS;
+    break;
+  case Format::kB:
+    instr.m_rs1 = fields.rs1;
+    instr.m_rs2 = fields.rs2;
+    instr.m_imm = fields.immB;
+    break;
+  case Format::kU:
+    instr.m_rd = fields.rd;
+    instr.m_imm = fields.immU;
+    break;
+  case Format::kJ:
+    instr.m_rd = fields.rd;
+    instr.m_imm = fields.immJ;
+    break;
+  case Format::kFence:
+    instr.m_rd = fields.rd;
+    instr.m_rs1 = fields.rs1;
+    instr.m_imm = slice<31, 28>(word) | slice<27, 24>(word) |
+                  slice<23, 20>(word);
+    break;
+  case Format::kSystem:
+    if (word == 0b1110011) {
+      return instr;
+    }
+    if (word == 0b100000000000001110011) {
+      instr.m_opc = entry.alt;
+      return instr;
+    }
+    return std::nullopt;
   }
-  case 0b100000000000001110011: {
-    //! EBREAK
-    //! 00000000000100000000000001110011
-    instr.m_opc = Opcode::kEBREAK;
-    return instr;
+
+  return instr;
+}
+
+std::optional<Instruction> Instruction::decode(Word word) {
+  return Decoder::assemble(word, Decoder::extract(word));
+}
+
+void Instruction::decodeBatch(std::span<const Word> words,
+                              std::span<std::optional<Instruction>> out) {
+  if (out.size() < words.size()) {
+    throw std::invalid_argument{"Output is too small for batch decode"};
   }
+
+  std::size_t done = 0;
+#ifdef PROT_DECODE_AVX2
+  if (hasAVX2()) {
+    done = decodeBatchAVX2(words, out);
   }
+#endif
 
-  return {};
+  for (; done < words.size(); ++done) {
+    out[done] = decode(words[done]);
+  }
 }
 } // namespace prot::isa
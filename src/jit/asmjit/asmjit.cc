@@ -1,137 +1,37 @@
 #include <asmjit/asmjit.h>
 
 #include "prot/jit/base.hh"
+#include "prot/jit/gir.hh"
 
 #include <cstdint>
 #include <functional>
 
 #include <cassert>
 #include <span>
+#include <vector>
 
 #include <sys/mman.h>
 
 #include <fmt/core.h>
 #include <iostream>
 
-#define PROT_ASMJIT_R_OP(OP, ASMJIT_OP)                                        \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    loadReg(rs2, insn.rs2());                                                  \
-    cc.ASMJIT_OP(rs1, rs2);                                                    \
-    setDst(insn.rd(), rs1);                                                    \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_I_OP(OP, ASMJIT_OP)                                        \
-  case k##OP##I: {                                                             \
-    loadReg(rs1, insn.rs1());                                                  \
-    cc.ASMJIT_OP(rs1, insn.imm());                                             \
-    setDst(insn.rd(), rs1);                                                    \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_ALU_OP(OP, ASMJIT_OP)                                      \
-  PROT_ASMJIT_R_OP(OP, ASMJIT_OP)                                              \
-  PROT_ASMJIT_I_OP(OP, ASMJIT_OP)
-
-#define PROT_ASMJIT_I_SHIFT_OP(OP, ASMJIT_OP)                                  \
-  case k##OP##I: {                                                             \
-    loadReg(rs1, insn.rs1());                                                  \
-    cc.ASMJIT_OP(rs1, insn.imm());                                             \
-    setDst(insn.rd(), rs1);                                                    \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_SHIFT_OP(OP, ASMJIT_OP)                                    \
-  PROT_ASMJIT_R_OP(OP, ASMJIT_OP)                                              \
-  PROT_ASMJIT_I_SHIFT_OP(OP, ASMJIT_OP)
-
-#define PROT_ASMJIT_R_CMP_OP(OP, ASMJIT_OP)                                    \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    loadReg(rs2, insn.rs2());                                                  \
-    cc.cmp(rs2, rs1);                                                          \
-    cc.ASMJIT_OP(rd);                                                          \
-    cc.movzx(rd, rd.r8());                                                     \
-    setDst(insn.rd(), rd);                                                     \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_I_CMP_OP(OP, ASMJIT_OP)                                    \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    cc.cmp(rs1, insn.imm());                                                   \
-    cc.ASMJIT_OP(rd.r8());                                                     \
-    cc.movzx(rd, rd.r8());                                                     \
-    setDst(insn.rd(), rd);                                                     \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_B_COND_OP(OP, COND)                                        \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    loadReg(rs2, insn.rs2());                                                  \
-    cc.cmp(rs1, rs2);                                                          \
-    cc.mov(rs1, isa::kWordSize);                                               \
-    cc.mov(rs2, insn.imm());                                                   \
-    cc.cmov(COND, rs1, rs2);                                                   \
-    cc.add(getPC(), rs1);                                                      \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_S_OP(OP, DATA_TYPE)                                        \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    cc.add(rs1, insn.imm());                                                   \
-    loadReg(rs2, insn.rs2());                                                  \
-    asmjit::InvokeNode *invoke{};                                              \
-    cc.invoke(&invoke, reinterpret_cast<size_t>(storeHelper<DATA_TYPE>),       \
-              asmjit::FuncSignature::build<void, CPUState &, isa::Addr,        \
-                                           DATA_TYPE>());                      \
-    invoke->setArg(0, state_ptr);                                              \
-    invoke->setArg(1, rs1);                                                    \
-    invoke->setArg(2, rs2);                                                    \
-    break;                                                                     \
-  }
-
-#define PROT_ASMJIT_L_OP(OP, DATA_TYPE)                                        \
-  case k##OP: {                                                                \
-    loadReg(rs1, insn.rs1());                                                  \
-    cc.add(rs1, insn.imm());                                                   \
-    asmjit::InvokeNode *invoke = nullptr;                                      \
-    cc.invoke(                                                                 \
-        &invoke, reinterpret_cast<size_t>(loadHelper<DATA_TYPE>),              \
-        asmjit::FuncSignature::build<DATA_TYPE, CPUState &, isa::Addr>());     \
-    invoke->setArg(0, state_ptr);                                              \
-    invoke->setArg(1, rs1);                                                    \
-    invoke->setRet(0, rd);                                                     \
-    switch (insn.opcode()) {                                                   \
-    case kLB:                                                                  \
-      cc.movsx(rd, rd.r8());                                                   \
-      break;                                                                   \
-    case kLH:                                                                  \
-      cc.movsx(rd, rd.r16());                                                  \
-      break;                                                                   \
-    default:                                                                   \
-      break;                                                                   \
-    }                                                                          \
-    setDst(insn.rd(), rd);                                                     \
-    break;                                                                     \
-  }
-
 namespace prot::engine {
 namespace {
 
 using JitFunction = void (*)(CPUState &);
 
-class AsmJit : public Translator {
+class AsmJit : public GirTranslator {
 public:
-  AsmJit() = default;
+  explicit AsmJit(const TranslatorOptions &options)
+      : GirTranslator{options},
+        m_hasBMI2(asmjit::CpuInfo::host().features().x86().hasBMI2()) {}
 
 private:
-  [[nodiscard]] JitFunction translate(const BBInfo &info) override;
+  [[nodiscard]] JitFunction lower(const gir::Block &block) override;
 
   asmjit::JitRuntime runtime;
+  // Variable shifts w/o fixed cl operand
+  bool m_hasBMI2{};
 };
 
 template <typename T> void storeHelper(CPUState &state, isa::Addr addr, T val) {
@@ -144,7 +44,50 @@ template <typename T> T loadHelper(CPUState &state, isa::Addr addr) {
 
 void syscallHelper(CPUState &state) { state.emulateSysCall(); }
 
-JitFunction AsmJit::translate(const BBInfo &info) {
+asmjit::x86::CondCode getCondCode(gir::Cond cond) {
+  switch (cond) {
+    using enum asmjit::x86::CondCode;
+  case gir::Cond::kEq:
+    return kEqual;
+  case gir::Cond::kNe:
+    return kNotEqual;
+  case gir::Cond::kLt:
+    return kSignedLT;
+  case gir::Cond::kGe:
+    return kSignedGE;
+  case gir::Cond::kLtu:
+    return kUnsignedLT;
+  case gir::Cond::kGeu:
+    return kUnsignedGE;
+  }
+  throw std::invalid_argument{"Unexpected GIR cond"};
+}
+
+asmjit::InstId getInstId(gir::Op op, bool hasBMI2) {
+  switch (op) {
+    using namespace asmjit::x86;
+  case gir::Op::kAdd:
+    return Inst::kIdAdd;
+  case gir::Op::kSub:
+    return Inst::kIdSub;
+  case gir::Op::kAnd:
+    return Inst::kIdAnd;
+  case gir::Op::kOr:
+    return Inst::kIdOr;
+  case gir::Op::kXor:
+    return Inst::kIdXor;
+  case gir::Op::kShl:
+    return hasBMI2 ? Inst::kIdShlx : Inst::kIdShl;
+  case gir::Op::kShr:
+    return hasBMI2 ? Inst::kIdShrx : Inst::kIdShr;
+  case gir::Op::kSar:
+    return hasBMI2 ? Inst::kIdSarx : Inst::kIdSar;
+  default:
+    throw std::invalid_argument{"Unexpected GIR op"};
+  }
+}
+
+JitFunction AsmJit::lower(const gir::Block &block) {
   asmjit::CodeHolder code;
   code.init(runtime.environment());
 
@@ -160,131 +103,245 @@ JitFunction AsmJit::translate(const BBInfo &info) {
                                                  isa::kWordSize * regId);
   };
 
-  auto loadReg = [&cc, getReg](auto reg, auto regId) {
-    if (regId == 0)
-      cc.mov(reg, 0);
-    else
-      cc.mov(reg, getReg(regId));
-  };
-
   auto getPC = [&state_ptr]() {
     return asmjit::x86::dword_ptr(state_ptr, offsetof(CPUState, pc));
   };
 
-  auto setDst = [&cc, getReg](auto dstId, auto dst) {
-    if (dstId != 0)
-      cc.mov(getReg(dstId), dst);
-  };
+  // Comparisons only feeding selects & guards are left in flags
+  std::vector<bool> materialize(block.insts.size());
+  for (const auto &inst : block.insts) {
+    for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+      const bool usesFlags =
+          inst.op == gir::Op::kSelect || inst.op == gir::Op::kGuard;
+      if (!usesFlags || idx != 0) {
+        materialize[inst.args[idx]] = true;
+      }
+    }
+  }
 
-  auto pc = cc.newGpd();
-  auto rs1 = cc.newGpd();
-  auto rs2 = cc.newGpd();
-  auto rd = cc.newGpd();
-
-  for (const auto &insn : info.insns) {
-    switch (insn.opcode()) {
-      using enum isa::Opcode;
-      using enum asmjit::x86::CondCode;
-      PROT_ASMJIT_ALU_OP(ADD, add)
-      PROT_ASMJIT_ALU_OP(AND, and_)
-      PROT_ASMJIT_ALU_OP(OR, or_)
-      PROT_ASMJIT_ALU_OP(XOR, xor_)
-
-      PROT_ASMJIT_SHIFT_OP(SLL, shl)
-      PROT_ASMJIT_SHIFT_OP(SRA, sar)
-      PROT_ASMJIT_SHIFT_OP(SRL, shr)
-
-      PROT_ASMJIT_R_OP(SUB, sub)
-
-      PROT_ASMJIT_R_CMP_OP(SLT, setg)
-      PROT_ASMJIT_R_CMP_OP(SLTU, seta)
-
-      PROT_ASMJIT_I_CMP_OP(SLTI, setl)
-      PROT_ASMJIT_I_CMP_OP(SLTIU, setb)
-
-      PROT_ASMJIT_B_COND_OP(BEQ, kEqual)
-      PROT_ASMJIT_B_COND_OP(BNE, kNotEqual)
-      PROT_ASMJIT_B_COND_OP(BLT, kSignedLT)
-      PROT_ASMJIT_B_COND_OP(BGE, kSignedGE)
-      PROT_ASMJIT_B_COND_OP(BLTU, kUnsignedLT)
-      PROT_ASMJIT_B_COND_OP(BGEU, kUnsignedGE)
-
-      PROT_ASMJIT_L_OP(LB, prot::isa::Byte)
-      PROT_ASMJIT_L_OP(LH, prot::isa::Half)
-      PROT_ASMJIT_L_OP(LBU, prot::isa::Byte)
-      PROT_ASMJIT_L_OP(LHU, prot::isa::Half)
-      PROT_ASMJIT_L_OP(LW, prot::isa::Word)
-
-      PROT_ASMJIT_S_OP(SB, prot::isa::Byte)
-      PROT_ASMJIT_S_OP(SH, prot::isa::Half)
-      PROT_ASMJIT_S_OP(SW, prot::isa::Word)
-
-    // PROT_ASMJIT_J_OP
-    case kJAL: {
-      cc.mov(rd, getPC());
-      cc.add(rd, isa::kWordSize);
-      setDst(insn.rd(), rd);
-      cc.mov(pc, getPC());
-      cc.add(pc, insn.imm());
-      cc.mov(getPC(), pc);
-      break;
+  // Each value gets own virtual reg, constants become immediates when
+  // insn allows them
+  std::vector<asmjit::x86::Gp> vregs(block.insts.size());
+  auto isConst = [&](gir::Value val) {
+    return block[val].op == gir::Op::kConst;
+  };
+  auto reg = [&](gir::Value val) -> asmjit::x86::Gp {
+    if (!isConst(val)) {
+      return vregs[val];
     }
-    case kJALR: {
-      cc.mov(rd, getPC());
-      cc.add(rd, isa::kWordSize);
+    auto tmp = cc.newGpd();
+    cc.mov(tmp, block[val].imm);
+    return tmp;
+  };
+  auto source = [&](gir::Value val) -> asmjit::Operand {
+    if (isConst(val)) {
+      return asmjit::Imm(block[val].imm);
+    }
+    return vregs[val];
+  };
+  auto compare = [&](const gir::Inst &cmp) {
+    cc.emit(asmjit::x86::Inst::kIdCmp, reg(cmp.args[0]), source(cmp.args[1]));
+  };
+  auto invoke = [&](auto *helper, const asmjit::FuncSignature &sign) {
+    asmjit::InvokeNode *node{};
+    cc.invoke(&node, reinterpret_cast<size_t>(helper), sign);
+    node->setArg(0, state_ptr);
+    return node;
+  };
 
-      loadReg(pc, insn.rs1());
-      cc.add(pc, insn.imm());
-      cc.and_(pc, ~0b1);
+  // Direct stack accesses index host buffer w/ zero extended guest address
+  asmjit::x86::Gp stack_base;
+  if (block.stackBase != nullptr) {
+    stack_base = cc.newUIntPtr();
+    cc.mov(stack_base,
+           asmjit::Imm(reinterpret_cast<std::uintptr_t>(block.stackBase)));
+  }
+  auto stackPtr = [&](const gir::Inst &inst) {
+    auto addr = cc.newUIntPtr();
+    cc.mov(addr.r32(), reg(inst.args[0]));
+    return asmjit::x86::ptr(stack_base, addr, 0, 0, inst.size);
+  };
 
-      setDst(insn.rd(), rd);
+  for (gir::Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    const auto &args = inst.args;
+    if (inst.hasResult() && !isConst(val)) {
+      vregs[val] = cc.newGpd();
+    }
+    const auto &dst = vregs[val];
 
-      cc.mov(getPC(), pc);
+    switch (inst.op) {
+    case gir::Op::kConst:
+    case gir::Op::kNop:
+      break;
+    case gir::Op::kGetReg:
+      cc.mov(dst, getReg(inst.reg));
+      break;
+    case gir::Op::kSetReg:
+      cc.emit(asmjit::x86::Inst::kIdMov, getReg(inst.reg), source(args[0]));
       break;
-    }
 
-    // PROT_ASMJIT_U_OP
-    case kLUI: {
-      cc.mov(rs1, insn.imm());
-      setDst(insn.rd(), rs1);
+    case gir::Op::kShl:
+    case gir::Op::kShr:
+    case gir::Op::kSar:
+      if (isConst(args[1])) {
+        cc.mov(dst, reg(args[0]));
+        cc.emit(getInstId(inst.op, false), dst,
+                asmjit::Imm(isa::slice<4, 0>(block[args[1]].imm)));
+      } else if (m_hasBMI2) {
+        cc.emit(getInstId(inst.op, true), dst, reg(args[0]), vregs[args[1]]);
+      } else {
+        cc.mov(dst, reg(args[0]));
+        cc.emit(getInstId(inst.op, false), dst, vregs[args[1]].r8());
+      }
+      break;
+    case gir::Op::kAdd:
+    case gir::Op::kSub:
+    case gir::Op::kAnd:
+    case gir::Op::kOr:
+    case gir::Op::kXor:
+      cc.emit(asmjit::x86::Inst::kIdMov, dst, source(args[0]));
+      // Register copy after peephole
+      if (inst.op != gir::Op::kAdd || !isConst(args[1]) ||
+          block[args[1]].imm != 0) {
+        cc.emit(getInstId(inst.op, false), dst, source(args[1]));
+      }
       break;
-    }
 
-    case kAUIPC: {
-      cc.mov(rs1, getPC());
-      cc.add(rs1, insn.imm());
-      setDst(insn.rd(), rs1);
+    case gir::Op::kCmp:
+      if (materialize[val]) {
+        compare(inst);
+        cc.set(getCondCode(inst.cond), dst.r8());
+        cc.movzx(dst, dst.r8());
+      }
+      break;
+    case gir::Op::kSelect: {
+      cc.emit(asmjit::x86::Inst::kIdMov, dst, source(args[2]));
+      const auto &cond = block[args[0]];
+      auto taken = reg(args[1]);
+      if (cond.op == gir::Op::kCmp) {
+        compare(cond);
+        cc.cmov(getCondCode(cond.cond), dst, taken);
+      } else {
+        auto flag = reg(args[0]);
+        cc.test(flag, flag);
+        cc.cmov(asmjit::x86::CondCode::kNotZero, dst, taken);
+      }
       break;
     }
 
-    case kECALL: {
-      asmjit::InvokeNode *invoke{};
-      cc.invoke(&invoke, reinterpret_cast<size_t>(syscallHelper),
-                asmjit::FuncSignature::build<void, CPUState &>());
-      invoke->setArg(0, state_ptr);
+    case gir::Op::kLoad: {
+      if (inst.stack) {
+        const auto mem = stackPtr(inst);
+        if (inst.size == sizeof(isa::Word)) {
+          cc.mov(dst, mem);
+        } else if (inst.sext) {
+          cc.movsx(dst, mem);
+        } else {
+          cc.movzx(dst, mem);
+        }
+        break;
+      }
+      auto addr = reg(args[0]);
+      asmjit::InvokeNode *node{};
+      switch (inst.size) {
+      case sizeof(isa::Byte):
+        node = invoke(
+            loadHelper<isa::Byte>,
+            asmjit::FuncSignature::build<isa::Byte, CPUState &, isa::Addr>());
+        break;
+      case sizeof(isa::Half):
+        node = invoke(
+            loadHelper<isa::Half>,
+            asmjit::FuncSignature::build<isa::Half, CPUState &, isa::Addr>());
+        break;
+      default:
+        node = invoke(
+            loadHelper<isa::Word>,
+            asmjit::FuncSignature::build<isa::Word, CPUState &, isa::Addr>());
+        break;
+      }
+      node->setArg(1, addr);
+      node->setRet(0, dst);
+      // Upper bits of narrow return values are not defined by ABI
+      if (inst.size != sizeof(isa::Word)) {
+        const auto narrow =
+            inst.size == sizeof(isa::Byte) ? dst.r8() : dst.r16();
+        if (inst.sext) {
+          cc.movsx(dst, narrow);
+        } else {
+          cc.movzx(dst, narrow);
+        }
+      }
       break;
     }
-
-    case kFENCE:
-    case kEBREAK:
-    case kPAUSE:
-    case kSBREAK:
-    case kSCALL: {
+    case gir::Op::kStore: {
+      if (inst.stack) {
+        const auto mem = stackPtr(inst);
+        auto value = reg(args[1]);
+        switch (inst.size) {
+        case sizeof(isa::Byte):
+          cc.mov(mem, value.r8());
+          break;
+        case sizeof(isa::Half):
+          cc.mov(mem, value.r16());
+          break;
+        default:
+          cc.mov(mem, value);
+          break;
+        }
+        break;
+      }
+      auto addr = reg(args[0]);
+      auto value = reg(args[1]);
+      asmjit::InvokeNode *node{};
+      switch (inst.size) {
+      case sizeof(isa::Byte):
+        node = invoke(storeHelper<isa::Byte>,
+                      asmjit::FuncSignature::build<void, CPUState &, isa::Addr,
+                                                   isa::Byte>());
+        break;
+      case sizeof(isa::Half):
+        node = invoke(storeHelper<isa::Half>,
+                      asmjit::FuncSignature::build<void, CPUState &, isa::Addr,
+                                                   isa::Half>());
+        break;
+      default:
+        node = invoke(storeHelper<isa::Word>,
+                      asmjit::FuncSignature::build<void, CPUState &, isa::Addr,
+                                                   isa::Word>());
+        break;
+      }
+      node->setArg(1, addr);
+      node->setArg(2, value);
       break;
     }
-
-    case kNumOpcodes:
-      throw std::invalid_argument{"Unexpected insn id"};
+    case gir::Op::kSyscall:
+      invoke(syscallHelper, asmjit::FuncSignature::build<void, CPUState &>());
+      break;
+    case gir::Op::kGuard: {
+      // Nothing is written yet, so plain return leaves state intact
+      auto pass = cc.newLabel();
+      if (const auto &cond = block[args[0]]; cond.op == gir::Op::kCmp) {
+        compare(cond);
+        cc.j(getCondCode(cond.cond), pass);
+      } else {
+        auto flag = reg(args[0]);
+        cc.test(flag, flag);
+        cc.jnz(pass);
+      }
+      cc.ret();
+      cc.bind(pass);
+      break;
     }
-
-    if (!isa::changesPC(insn.opcode())) {
-      cc.mov(pc, getPC());
-      cc.add(pc, isa::kWordSize);
-      cc.mov(getPC(), pc);
+    case gir::Op::kExit:
+      cc.emit(asmjit::x86::Inst::kIdMov, getPC(), source(args[0]));
+      break;
     }
   }
-  cc.mov(rd, info.insns.size());
-  cc.add(asmjit::x86::dword_ptr(state_ptr, offsetof(CPUState, icount)), rd);
+
+  cc.add(asmjit::x86::qword_ptr(state_ptr, offsetof(CPUState, icount)),
+         block.icount);
   cc.endFunc();
   cc.finalize();
 
@@ -297,5 +354,7 @@ JitFunction AsmJit::translate(const BBInfo &info) {
 }
 } // namespace
 
-std::unique_ptr<Translator> makeAsmJit() { return std::make_unique<AsmJit>(); }
+std::unique_ptr<Translator> makeAsmJit(const TranslatorOptions &options) {
+  return std::make_unique<AsmJit>(options);
+}
 } // namespace prot::engine
@@ -6,7 +6,8 @@
 #include "prot/jit/base.hh"
 
 namespace prot::engine {
-std::unique_ptr<Translator> makeAsmJit();
+std::unique_ptr<Translator>
+makeAsmJit(const TranslatorOptions &options = {});
 }
 
 #endif // PROT_JIT_ASMJIT_HH_INCLUDED
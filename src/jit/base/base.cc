@@ -3,14 +3,197 @@
 #include <fmt/core.h>
 #include <fmt/ostream.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <ranges>
 
 extern "C" {
 #include <sys/mman.h>
 }
 
 namespace prot::engine {
+namespace {
+// Idiom kernel is dropped after that many refusals in a row, see step
+constexpr std::size_t kMaxIdiomRefusals = 16;
+
+void fuseInsns(std::vector<isa::Instruction> &insns) {
+  std::vector<isa::Instruction> fused;
+  fused.reserve(insns.size());
+
+  for (std::size_t i = 0; i < insns.size(); ++i) {
+    if (i + 1 < insns.size()) {
+      if (auto pair = isa::Instruction::fuse(insns[i], insns[i + 1])) {
+        fused.push_back(*pair);
+        ++i;
+        continue;
+      }
+    }
+    fused.push_back(insns[i]);
+  }
+
+  insns = std::move(fused);
+}
+
+// Guest data which stays unchanged after load
+struct ReadOnlyData final {
+  const Memory &mem;
+  std::span<const AddrRange> ranges;
+
+  // Value loaded by insn from addr, nullopt unless all accessed bytes are
+  // read-only
+  [[nodiscard]] std::optional<isa::Word> load(const isa::Instruction &insn,
+                                              isa::Addr addr) const {
+    const auto opc = insn.opcode();
+    const auto size =
+        opc == isa::Opcode::kLWPC ? sizeof(isa::Word) : isa::accessSize(opc);
+    const auto covers = [addr, size](const AddrRange &range) {
+      return range.contains(addr) && addr - range.start + size <= range.size;
+    };
+    if (std::ranges::none_of(ranges, covers)) {
+      return std::nullopt;
+    }
+
+    constexpr auto kBits = sizeofBits<isa::Word>();
+    switch (opc) {
+    case isa::Opcode::kLB:
+      return isa::signExtend<kBits, sizeofBits<isa::Byte>()>(
+          isa::Word{mem.read<isa::Byte>(addr)});
+    case isa::Opcode::kLBU:
+      return mem.read<isa::Byte>(addr);
+    case isa::Opcode::kLH:
+      return isa::signExtend<kBits, sizeofBits<isa::Half>()>(
+          isa::Word{mem.read<isa::Half>(addr)});
+    case isa::Opcode::kLHU:
+      return mem.read<isa::Half>(addr);
+    default:
+      return mem.read<isa::Word>(addr);
+    }
+  }
+};
+
+// Propagates reg values known inside block: insns w/ known operands are
+// folded, AUIPC results & jump targets become constants. Loads from
+// read-only data at known addresses become constants too, so jumps through
+// such tables become direct
+void foldInsns(std::vector<isa::Instruction> &insns, isa::Addr pc,
+               const ReadOnlyData &rodata) {
+  std::array<std::optional<isa::Word>, CPUState::kNumRegs> known{};
+  known[0] = 0;
+
+  for (auto &insn : insns) {
+    insn = isa::Instruction::simplify(insn);
+    const auto opc = insn.opcode();
+    // Unused operands do not prevent folding
+    const auto rs1 = isa::readsRs1(opc) ? known[insn.rs1()] : isa::Word{};
+    const auto rs2 = isa::readsRs2(opc) ? known[insn.rs2()] : isa::Word{};
+    if (rs1.has_value() && rs2.has_value()) {
+      if (auto folded = isa::Instruction::fold(insn, pc, *rs1, *rs2)) {
+        insn = *folded;
+      }
+    }
+    if (opc == isa::Opcode::kLWPC || (isa::isLoad(opc) && rs1.has_value())) {
+      const auto base = opc == isa::Opcode::kLWPC ? pc : *rs1;
+      if (const auto loaded = rodata.load(insn, base + insn.imm())) {
+        insn = isa::Instruction::foldLoad(insn, *loaded);
+      }
+    }
+
+    if (insn.opcode() == isa::Opcode::kECALL) {
+      // Syscall may change any reg
+      known.fill(std::nullopt);
+      known[0] = 0;
+    } else if (isa::writesRd(insn.opcode()) && insn.rd() != 0) {
+      known[insn.rd()] = insn.opcode() == isa::Opcode::kLI
+                             ? std::optional{insn.imm()}
+                             : std::nullopt;
+    }
+    pc += insn.size();
+  }
+}
+
+// Drops results overwritten before being read or dead at block exit. All
+// regs are live at syscalls
+void eliminateDeadWrites(std::vector<isa::Instruction> &insns,
+                         RegMask liveOut) {
+  auto live = liveOut;
+  for (auto &insn : insns | std::views::reverse) {
+    const auto opc = insn.opcode();
+    if (opc == isa::Opcode::kECALL) {
+      live = kAllRegs;
+      continue;
+    }
+    if (isa::writesRd(opc) && insn.rd() != 0) {
+      const auto bit = regBit(insn.rd());
+      if ((live & bit) == 0) {
+        // Arith insn becomes no-op & reads nothing
+        insn = isa::Instruction::discardResult(insn);
+      } else {
+        live &= ~bit;
+      }
+    }
+    if (isa::readsRs1(insn.opcode())) {
+      live |= regBit(insn.rs1());
+    }
+    if (isa::readsRs2(insn.opcode())) {
+      live |= regBit(insn.rs2());
+    }
+  }
+}
+
+// Regs read before being written & regs always written by block
+void collectUsesDefs(BBInfo &info) {
+  for (const auto &insn : info.insns) {
+    const auto opc = insn.opcode();
+    if (opc == isa::Opcode::kECALL) {
+      // Syscall may read any reg, its writes are not guaranteed
+      info.uses |= ~info.defs;
+      continue;
+    }
+    if (isa::readsRs1(opc)) {
+      info.uses |= regBit(insn.rs1()) & ~info.defs;
+    }
+    if (isa::readsRs2(opc)) {
+      info.uses |= regBit(insn.rs2()) & ~info.defs;
+    }
+    if (isa::writesRd(opc)) {
+      info.defs |= regBit(insn.rd());
+    }
+  }
+}
+
+std::vector<isa::Addr> findSuccs(const BBInfo &info) {
+  // Block covers contiguous guest code
+  const auto &last = info.insns.back();
+  const auto pc = static_cast<isa::Addr>(
+      info.pc + isa::kWordSize * info.icount - last.size());
+  const auto opc = last.opcode();
+  if (isa::isBranch(opc)) {
+    return {pc + last.imm(), pc + last.size()};
+  }
+  switch (opc) {
+  case isa::Opcode::kJAL:
+    return {pc + last.imm()};
+  case isa::Opcode::kCALL:
+    return {(pc + last.imm()) & ~isa::Word{1}};
+  // Target is known at run time only, syscall may also end execution
+  case isa::Opcode::kJALR:
+  case isa::Opcode::kECALL:
+  case isa::Opcode::kEBREAK:
+    return {};
+  default:
+    return {pc + last.size()};
+  }
+}
+
+// Regs which may be read once execution reaches info
+RegMask liveIn(const BBInfo &info) {
+  return info.uses | (info.live_out & ~info.defs);
+}
+} // namespace
+
 void JitEngine::step(CPUState &cpu) {
   while (!cpu.finished) [[likely]] {
     if (m_config.enableDump) {
@@ -19,11 +202,15 @@ void JitEngine::step(CPUState &cpu) {
 
     // colllect bb
     const auto pc = cpu.getPC();
+    // Translated code refused to run, e.g. sp is out of mapped stack
+    bool refused = false;
     if (m_translator) {
       if (const auto found = m_tbCache.lookup(pc); found != nullptr)
           [[likely]] {
-        found(cpu);
-        continue;
+        if (run(cpu, found)) [[likely]] {
+          continue;
+        }
+        refused = true;
       }
     }
 
@@ -31,13 +218,17 @@ void JitEngine::step(CPUState &cpu) {
     if (wasNew) [[unlikely]] {
       auto curAddr = bbIt->first;
       auto &bb = bbIt->second;
+      bb.pc = curAddr;
 
       while (true) {
-        auto bytes = cpu.memory->read<isa::Word>(curAddr);
-        auto inst = isa::Instruction::decode(bytes);
+        auto inst = getPreDecoded().lookup(curAddr);
         if (!inst.has_value()) {
-          throw std::runtime_error{fmt::format(
-              "Cannot decode bytes: {:#x} on pc: {:#x}", bytes, curAddr)};
+          auto bytes = cpu.memory->read<isa::Word>(curAddr);
+          inst = isa::Instruction::decode(bytes);
+          if (!inst.has_value()) {
+            throw std::runtime_error{fmt::format(
+                "Cannot decode bytes: {:#x} on pc: {:#x}", bytes, curAddr)};
+          }
         }
 
         bb.insns.push_back(*inst);
@@ -47,31 +238,237 @@ void JitEngine::step(CPUState &cpu) {
         }
         curAddr += isa::kWordSize;
       }
+      bb.icount = bb.insns.size();
+      if (m_config.enableIdioms && !m_config.singleStep) {
+        bb.idiom = matchLoopIdiom(bb.pc, bb.insns, *cpu.memory);
+      }
+      if (m_config.enableFusion) {
+        fuseInsns(bb.insns);
+      }
+      if (m_config.enableBlockOpt) {
+        foldInsns(bb.insns, bb.pc,
+                  ReadOnlyData{.mem = *cpu.memory, .ranges = m_readOnly});
+        eliminateDeadWrites(bb.insns, kAllRegs);
+      }
+      bb.threaded = ThreadedCode{bb.insns};
+      if (m_config.enableLiveness) {
+        analyzeLiveness(bb);
+      }
+    }
+    auto &bb = bbIt->second;
+    // Idiom kernel is tried on each entry. Refused entry, e.g. copy overlaps
+    // or bound is never met, runs block code (interpreted till compiled).
+    // Such code is kept out of TB cache, so entries still come here. Once
+    // kernel keeps refusing, loop apparently never fits it & is left to
+    // its code alone
+    if (bb.idiom) {
+      if (runLoopIdiom(cpu, *bb.idiom)) {
+        bb.idiom_refusals = 0;
+        continue;
+      }
+      if (++bb.idiom_refusals >= kMaxIdiomRefusals) {
+        bb.idiom.reset();
+      }
     }
-    if (m_translator && bbIt->second.num_exec >= m_config.execThreshold)
+    if (m_translator && !refused && bb.num_exec >= m_config.execThreshold)
         [[likely]] {
-      auto code = m_translator->translate(bbIt->second);
-      if (code == nullptr) [[unlikely]] {
-        throw std::runtime_error{
-            fmt::format("Failed to translate BB on pc: {:#x}", pc)};
+      if (bb.code == nullptr && m_config.enableRegions && !bb.loop_checked) {
+        formRegion(cpu, bb);
+      }
+      if (bb.code == nullptr) {
+        enqueue(cpu, bb);
+      }
+      if (bb.code != nullptr) [[likely]] {
+        if (!bb.idiom) {
+          m_tbCache.insert(pc, bb.code);
+        }
+        if (run(cpu, bb.code)) [[likely]] {
+          continue;
+        }
       }
-
-      code(cpu);
-      m_tbCache.insert(pc, code);
-      continue;
     }
 
-    interpret(cpu, bbIt->second);
+    // Cold block, one still waiting for its batch or refused by its code
+    interpret(cpu, bb);
+    if (m_config.enableRegions) {
+      bb.recordExit(cpu.getPC());
+    }
   }
 }
 void JitEngine::interpret(CPUState &cpu, BBInfo &info) {
-  for (const auto &insn : info.insns) {
-    execute(cpu, insn);
-    cpu.icount++;
-  }
+  info.threaded(cpu);
+  cpu.icount += info.icount;
   info.num_exec++;
 }
 
+void JitEngine::enqueue(const CPUState &cpu, BBInfo &info) {
+  if (!info.queued) {
+    info.queued = true;
+    m_pending.push_back(&info);
+  }
+
+  if (m_pending.size() >= m_config.batchSize ||
+      info.num_exec >= m_config.execThreshold + m_config.batchWindow) {
+    flush(cpu);
+  }
+}
+
+void JitEngine::flush(const CPUState &cpu) {
+  for (auto *info : m_pending) {
+    pruneDeadWrites(*info);
+  }
+  const auto codes = m_translator->translateBatch(cpu, m_pending);
+  assert(codes.size() == m_pending.size());
+
+  // All entries are published at once
+  for (std::size_t idx = 0; idx < codes.size(); ++idx) {
+    auto &info = *m_pending[idx];
+    if (codes[idx] == nullptr) [[unlikely]] {
+      throw std::runtime_error{
+          fmt::format("Failed to translate BB on pc: {:#x}", info.pc)};
+    }
+    // Loop region may already be entered from this block
+    if (info.code == nullptr) {
+      info.code = codes[idx];
+      if (!info.idiom) {
+        m_tbCache.insert(info.pc, info.code);
+      }
+    }
+  }
+  m_pending.clear();
+}
+
+void JitEngine::formRegion(const CPUState &cpu, BBInfo &info) {
+  info.loop_checked = true;
+
+  // Back edge to an already known block is a natural loop candidate
+  const auto backEdge = std::ranges::find_if(info.exits, [&](const auto &exit) {
+    return exit.count != 0 && exit.pc <= info.pc && m_cacheBB.contains(exit.pc);
+  });
+  if (backEdge == info.exits.end()) {
+    return;
+  }
+  auto &header = m_cacheBB.at(backEdge->pc);
+  if (header.loop_head || header.idiom) {
+    return;
+  }
+
+  // Walk profiled exits from header staying inside loop body. Blocks w/
+  // syscalls are left out: they have to return to engine anyway
+  std::vector<const BBInfo *> blocks{&header};
+  for (std::size_t idx = 0; idx < blocks.size(); ++idx) {
+    for (const auto &exit : blocks[idx]->exits) {
+      const auto found = m_cacheBB.find(exit.pc);
+      if (exit.count == 0 || exit.pc < header.pc || exit.pc > info.pc ||
+          found == m_cacheBB.end() ||
+          found->second.insns.back().opcode() == isa::Opcode::kECALL ||
+          std::ranges::find(blocks, &found->second) != blocks.end()) {
+        continue;
+      }
+      blocks.push_back(&found->second);
+    }
+  }
+  if (std::ranges::find(blocks, &info) == blocks.end()) {
+    return;
+  }
+
+  for (const auto *block : blocks) {
+    pruneDeadWrites(m_cacheBB.at(block->pc));
+  }
+  if (auto code = m_translator->translateRegion(cpu, blocks); code != nullptr) {
+    header.code = code;
+    header.loop_head = true;
+    m_tbCache.insert(header.pc, code);
+  }
+}
+
+// Insns are translated w/ regs live at the moment. Masks only shrink later,
+// so writes dropped here stay dead
+void JitEngine::pruneDeadWrites(BBInfo &info) const {
+  if (m_config.enableBlockOpt && m_config.enableLiveness) {
+    eliminateDeadWrites(info.insns, info.live_out);
+  }
+}
+
+// Successors not discovered yet are assumed to read all regs. Discovery of
+// a block can only shrink live sets of its predecessors, so masks already
+// used by translated code stay conservative & nothing is invalidated
+void JitEngine::analyzeLiveness(BBInfo &info) {
+  collectUsesDefs(info);
+  info.succs = findSuccs(info);
+  for (const auto succ : info.succs) {
+    m_preds[succ].push_back(&info);
+  }
+
+  // Live set of a block changed, its predecessors have to be revisited
+  std::vector<BBInfo *> worklist;
+  auto revisitPreds = [&](const BBInfo &block) {
+    if (const auto found = m_preds.find(block.pc); found != m_preds.end()) {
+      worklist.insert(worklist.end(), found->second.begin(),
+                      found->second.end());
+    }
+  };
+
+  updateLiveOut(info);
+  revisitPreds(info);
+  while (!worklist.empty()) {
+    auto *const block = worklist.back();
+    worklist.pop_back();
+    if (updateLiveOut(*block)) {
+      revisitPreds(*block);
+    }
+  }
+}
+
+bool JitEngine::updateLiveOut(BBInfo &info) const {
+  if (info.succs.empty()) {
+    return false;
+  }
+
+  RegMask live{};
+  for (const auto succ : info.succs) {
+    const auto found = m_cacheBB.find(succ);
+    live |= found != m_cacheBB.end() && !found->second.insns.empty()
+                ? liveIn(found->second)
+                : kAllRegs;
+  }
+  const auto changed = live != info.live_out;
+  info.live_out = live;
+  return changed;
+}
+
+void JitEngine::preTranslate(CPUState &cpu,
+                             std::span<const FuncSymbol> funcs) {
+  if (!m_translator || !m_config.enableLifting) {
+    return;
+  }
+
+  for (const auto &[pc, code] : m_translator->liftProgram(cpu, funcs)) {
+    m_tbCache.insert(pc, code);
+  }
+}
+
+void JitEngine::setReadOnly([[maybe_unused]] CPUState &cpu,
+                            const AddrRange &range) {
+  m_readOnly.push_back(range);
+}
+
+void JitEngine::setStack(CPUState &cpu, const AddrRange &range) {
+  if (!m_translator || !m_config.enableStackPath) {
+    return;
+  }
+
+  if (auto *hostBase = cpu.memory->pin(range); hostBase != nullptr) {
+    m_translator->mapStack(StackMapping{.range = range, .hostBase = hostBase});
+  }
+}
+
+void JitEngine::dumpStats(std::ostream &ost) const {
+  if (m_translator) {
+    m_translator->dumpStats(ost);
+  }
+}
+
 auto JitEngine::getBBInfo(isa::Addr pc) const -> const BBInfo * {
   if (const auto found = m_cacheBB.find(pc); found != m_cacheBB.end()) {
     if (found->second.num_exec >= m_config.execThreshold) {
@@ -82,6 +479,54 @@ auto JitEngine::getBBInfo(isa::Addr pc) const -> const BBInfo * {
   return nullptr;
 }
 
+std::vector<JitFunction>
+Translator::translateBatch([[maybe_unused]] const CPUState &cpu,
+                           std::span<const BBInfo *const> batch) {
+  std::vector<JitFunction> res;
+  res.reserve(batch.size());
+  for (const auto *info : batch) {
+    res.push_back(translate(*info));
+  }
+  return res;
+}
+
+std::vector<isa::Instruction>
+simplifyInsns(std::span<const isa::Instruction> insns) {
+  std::vector<isa::Instruction> res;
+  res.reserve(insns.size());
+  std::ranges::transform(insns, std::back_inserter(res),
+                         isa::Instruction::simplify);
+  return res;
+}
+
+void CompileStats::add(std::string_view phase, Clock::duration time) {
+  auto found = std::ranges::find(m_phases, phase, &Phase::name);
+  if (found == m_phases.end()) {
+    found = m_phases.insert(found, Phase{.name = std::string{phase}});
+  }
+  found->time += time;
+  ++found->count;
+}
+
+void CompileStats::addSize(std::string_view name, std::ptrdiff_t bytes) {
+  auto found = std::ranges::find(m_sizes, name, &Size::name);
+  if (found == m_sizes.end()) {
+    found = m_sizes.insert(found, Size{.name = std::string{name}});
+  }
+  found->bytes += bytes;
+}
+
+void CompileStats::dump(std::ostream &ost) const {
+  using Ms = std::chrono::duration<double, std::milli>;
+  for (const auto &phase : m_phases) {
+    fmt::print(ost, "{}: {:.3f} ms in {} calls\n", phase.name,
+               Ms{phase.time}.count(), phase.count);
+  }
+  for (const auto &size : m_sizes) {
+    fmt::print(ost, "{}: {} bytes\n", size.name, size.bytes);
+  }
+}
+
 void CodeHolder::Unmap::operator()(void *ptr) const noexcept {
   [[maybe_unused]] auto res = ::munmap(ptr, m_size);
   assert(res != -1);
@@ -0,0 +1,529 @@
+#include "prot/jit/idiom.hh"
+#include "prot/jit/base.hh"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <vector>
+
+namespace prot::engine {
+namespace {
+constexpr std::uint64_t kSpace = std::uint64_t{1} << sizeofBits<isa::Addr>();
+// Bulk ops go through host buffers of this size
+constexpr std::size_t kChunkSize = std::size_t{64} << 10U;
+// Strlen scan never crosses 4 KiB boundary past the terminator, so it only
+// touches guest pages the loop itself would read
+constexpr std::size_t kScanAlign = std::size_t{4} << 10U;
+// Insns of memcmp block executed by iteration which finds mismatch
+constexpr std::size_t kMemcmpHead = 3;
+
+// Memory access of loop body
+struct Access final {
+  isa::Opcode opc{};
+  isa::Operand base{};
+  // Reg loaded or stored
+  isa::Operand data{};
+  // Offset from base value at loop entry
+  isa::Word offset{};
+};
+
+// Loop body made of accesses & pointer increments only
+struct Body final {
+  std::vector<Access> loads;
+  std::vector<Access> stores;
+  // Each load comes before all stores
+  bool loadsFirst{true};
+  // Regs incremented once per iteration & their steps
+  std::vector<std::pair<isa::Operand, isa::Word>> steps;
+  // Regs written by body
+  RegMask written{};
+
+  [[nodiscard]] std::optional<isa::Word> step(isa::Operand reg) const {
+    const auto found = std::ranges::find(
+        steps, reg, &std::pair<isa::Operand, isa::Word>::first);
+    if (found == steps.end()) {
+      return std::nullopt;
+    }
+    return found->second;
+  }
+};
+
+std::optional<Body> analyzeBody(std::span<const isa::Instruction> insns) {
+  Body body;
+  RegMask stepped{};
+  for (const auto &insn : insns) {
+    const auto opc = insn.opcode();
+    if (opc == isa::Opcode::kADDI && insn.rd() == insn.rs1() &&
+        insn.rd() != 0) {
+      if ((body.written & regBit(insn.rd())) != 0) {
+        return std::nullopt;
+      }
+      body.steps.emplace_back(insn.rd(), insn.imm());
+      body.written |= regBit(insn.rd());
+      stepped |= regBit(insn.rd());
+      continue;
+    }
+
+    const bool load = isa::isLoad(opc);
+    if (!load && !isa::isStore(opc)) {
+      return std::nullopt;
+    }
+    // Accesses after increment see pointer already advanced
+    auto offset = insn.imm();
+    if ((stepped & regBit(insn.rs1())) != 0) {
+      offset += *body.step(insn.rs1());
+    }
+    const Access access{.opc = opc,
+                        .base = insn.rs1(),
+                        .data = load ? insn.rd() : insn.rs2(),
+                        .offset = offset};
+    if (load) {
+      if (access.data == 0 || (body.written & regBit(access.data)) != 0) {
+        return std::nullopt;
+      }
+      body.loadsFirst = body.loadsFirst && body.stores.empty();
+      body.loads.push_back(access);
+      body.written |= regBit(access.data);
+    } else {
+      body.stores.push_back(access);
+    }
+  }
+  return body;
+}
+
+// Pointer advanced by one element per iteration
+bool isPointer(const Body &body, isa::Operand reg, std::size_t size) {
+  const auto step = body.step(reg);
+  return step.has_value() && *step == size;
+}
+
+bool isSigned(isa::Opcode opc) {
+  return opc == isa::Opcode::kLB || opc == isa::Opcode::kLH;
+}
+
+// Loop branch compares one of pointers w/ reg unchanged by body
+bool matchBound(const isa::Instruction &branch, const Body &body,
+                std::initializer_list<isa::Operand> pointers,
+                LoopIdiom &idiom) {
+  const auto isPtr = [pointers](isa::Operand reg) {
+    return std::ranges::find(pointers, reg) != pointers.end();
+  };
+  const auto isInvariant = [&body](isa::Operand reg) {
+    return (body.written & regBit(reg)) == 0;
+  };
+
+  const auto lhs = branch.rs1();
+  const auto rhs = branch.rs2();
+  switch (branch.opcode()) {
+  case isa::Opcode::kBNE:
+    if (isPtr(lhs) && isInvariant(rhs)) {
+      idiom.counted = lhs;
+      idiom.end = rhs;
+      return true;
+    }
+    if (isPtr(rhs) && isInvariant(lhs)) {
+      idiom.counted = rhs;
+      idiom.end = lhs;
+      return true;
+    }
+    return false;
+  case isa::Opcode::kBLTU:
+    idiom.counted = lhs;
+    idiom.end = rhs;
+    idiom.unsignedBound = true;
+    return isPtr(lhs) && isInvariant(rhs);
+  default:
+    return false;
+  }
+}
+
+// Body: store, pointer increment
+std::optional<LoopIdiom> matchMemset(const Body &body,
+                                     const isa::Instruction &branch) {
+  if (!body.loads.empty() || body.stores.size() != 1 ||
+      body.steps.size() != 1) {
+    return std::nullopt;
+  }
+  const auto &store = body.stores.front();
+  const auto size = isa::accessSize(store.opc);
+  if (!isPointer(body, store.base, size) || store.data == store.base) {
+    return std::nullopt;
+  }
+
+  LoopIdiom idiom{.kind = LoopIdiom::Kind::kMemset,
+                  .size = static_cast<std::uint8_t>(size),
+                  .dst = store.base,
+                  .dstOffset = store.offset,
+                  .val = store.data};
+  if (!matchBound(branch, body, {store.base}, idiom)) {
+    return std::nullopt;
+  }
+  return idiom;
+}
+
+// Body: load, store of loaded value, increments of both pointers
+std::optional<LoopIdiom> matchMemcpy(const Body &body,
+                                     const isa::Instruction &branch) {
+  if (body.loads.size() != 1 || body.stores.size() != 1 ||
+      body.steps.size() != 2 || !body.loadsFirst) {
+    return std::nullopt;
+  }
+  const auto &load = body.loads.front();
+  const auto &store = body.stores.front();
+  const auto size = isa::accessSize(load.opc);
+  if (isa::accessSize(store.opc) != size || load.data != store.data ||
+      load.base == store.base || !isPointer(body, load.base, size) ||
+      !isPointer(body, store.base, size)) {
+    return std::nullopt;
+  }
+
+  LoopIdiom idiom{.kind = LoopIdiom::Kind::kMemcpy,
+                  .size = static_cast<std::uint8_t>(size),
+                  .sext = isSigned(load.opc),
+                  .dst = store.base,
+                  .src = load.base,
+                  .dstOffset = store.offset,
+                  .srcOffset = load.offset,
+                  .val = load.data};
+  if (!matchBound(branch, body, {load.base, store.base}, idiom)) {
+    return std::nullopt;
+  }
+  return idiom;
+}
+
+// Body: byte load, pointer increment. Loop goes on while byte != 0
+std::optional<LoopIdiom> matchStrlen(const Body &body,
+                                     const isa::Instruction &branch) {
+  if (body.loads.size() != 1 || !body.stores.empty() ||
+      body.steps.size() != 1) {
+    return std::nullopt;
+  }
+  const auto &load = body.loads.front();
+  if (isa::accessSize(load.opc) != sizeof(isa::Byte) ||
+      !isPointer(body, load.base, sizeof(isa::Byte))) {
+    return std::nullopt;
+  }
+  const bool testsLoaded =
+      branch.opcode() == isa::Opcode::kBNE &&
+      ((branch.rs1() == load.data && branch.rs2() == 0) ||
+       (branch.rs1() == 0 && branch.rs2() == load.data));
+  if (!testsLoaded) {
+    return std::nullopt;
+  }
+
+  return LoopIdiom{.kind = LoopIdiom::Kind::kStrlen,
+                   .size = sizeof(isa::Byte),
+                   .sext = isSigned(load.opc),
+                   .dst = load.base,
+                   .dstOffset = load.offset,
+                   .val = load.data};
+}
+
+// Head block: two loads, exit on mismatch. Tail block: increments of both
+// pointers, loop branch
+std::optional<LoopIdiom> matchMemcmp(isa::Addr pc,
+                                     std::span<const isa::Instruction> head,
+                                     const Memory &mem) {
+  if (head.size() != kMemcmpHead || head[2].opcode() != isa::Opcode::kBNE) {
+    return std::nullopt;
+  }
+
+  std::vector<isa::Instruction> body{head[0], head[1]};
+  auto tailPc = static_cast<isa::Addr>(pc + isa::kWordSize * head.size());
+  for (std::size_t idx = 0; idx < 3; ++idx, tailPc += isa::kWordSize) {
+    const auto insn = isa::Instruction::decode(mem.read<isa::Word>(tailPc));
+    if (!insn.has_value()) {
+      return std::nullopt;
+    }
+    body.push_back(*insn);
+  }
+  const auto loop = body.back();
+  body.pop_back();
+  const auto loopPc = static_cast<isa::Addr>(tailPc - isa::kWordSize);
+  if (!isa::isBranch(loop.opcode()) || loopPc + loop.imm() != pc) {
+    return std::nullopt;
+  }
+
+  const auto parsed = analyzeBody(body);
+  if (!parsed || parsed->loads.size() != 2 || !parsed->stores.empty() ||
+      parsed->steps.size() != 2) {
+    return std::nullopt;
+  }
+  const auto &lhs = parsed->loads[0];
+  const auto &rhs = parsed->loads[1];
+  const auto size = isa::accessSize(lhs.opc);
+  const auto &exit = head[2];
+  const bool comparesLoaded =
+      (exit.rs1() == lhs.data && exit.rs2() == rhs.data) ||
+      (exit.rs1() == rhs.data && exit.rs2() == lhs.data);
+  if (lhs.opc != rhs.opc || lhs.base == rhs.base || !comparesLoaded ||
+      !isPointer(*parsed, lhs.base, size) ||
+      !isPointer(*parsed, rhs.base, size)) {
+    return std::nullopt;
+  }
+
+  LoopIdiom idiom{.kind = LoopIdiom::Kind::kMemcmp,
+                  .size = static_cast<std::uint8_t>(size),
+                  .sext = isSigned(lhs.opc),
+                  .dst = lhs.base,
+                  .src = rhs.base,
+                  .dstOffset = lhs.offset,
+                  .srcOffset = rhs.offset,
+                  .val = lhs.data,
+                  .srcVal = rhs.data,
+                  .icount = body.size() + 2,
+                  .exit = tailPc,
+                  .mismatch = static_cast<isa::Addr>(
+                      pc + isa::kWordSize * 2 + exit.imm())};
+  if (!matchBound(loop, *parsed, {lhs.base, rhs.base}, idiom)) {
+    return std::nullopt;
+  }
+  return idiom;
+}
+
+// Iterations left till bound, nullopt if it is never reached w/out wrapping
+// counted pointer
+std::optional<std::uint64_t> countIterations(const CPUState &cpu,
+                                             const LoopIdiom &idiom) {
+  const std::uint64_t ptr = cpu.getReg(idiom.counted);
+  const std::uint64_t end = cpu.getReg(idiom.end);
+  const std::uint64_t size = idiom.size;
+
+  // Loop body always runs at least once
+  std::uint64_t num = 1;
+  if (idiom.unsignedBound) {
+    if (ptr < end) {
+      num = (end - ptr + size - 1) / size;
+    }
+  } else {
+    const auto dist = (end - ptr) % kSpace;
+    if (dist == 0 || dist % size != 0) {
+      return std::nullopt;
+    }
+    num = dist / size;
+  }
+  if (ptr + num * size >= kSpace) {
+    return std::nullopt;
+  }
+  return num;
+}
+
+// Address of the first access via reg, nullopt if accessed bytes wrap
+std::optional<isa::Addr> accessStart(const CPUState &cpu, isa::Operand reg,
+                                     isa::Word offset, std::uint64_t bytes) {
+  const auto start = static_cast<isa::Addr>(cpu.getReg(reg) + offset);
+  if (start + bytes > kSpace) {
+    return std::nullopt;
+  }
+  return start;
+}
+
+isa::Word loadElement(const Memory &mem, isa::Addr addr,
+                      const LoopIdiom &idiom) {
+  constexpr auto kBits = sizeofBits<isa::Word>();
+  switch (idiom.size) {
+  case sizeof(isa::Byte): {
+    const isa::Word val = mem.read<isa::Byte>(addr);
+    return idiom.sext ? isa::signExtend<kBits, sizeofBits<isa::Byte>()>(val)
+                      : val;
+  }
+  case sizeof(isa::Half): {
+    const isa::Word val = mem.read<isa::Half>(addr);
+    return idiom.sext ? isa::signExtend<kBits, sizeofBits<isa::Half>()>(val)
+                      : val;
+  }
+  default:
+    return mem.read<isa::Word>(addr);
+  }
+}
+
+void advance(CPUState &cpu, isa::Operand reg, std::uint64_t bytes) {
+  cpu.setReg(reg, static_cast<isa::Word>(cpu.getReg(reg) + bytes));
+}
+
+void leave(CPUState &cpu, isa::Addr pc, std::uint64_t icount) {
+  cpu.icount += icount;
+  cpu.setPC(pc);
+}
+
+bool runMemset(CPUState &cpu, const LoopIdiom &idiom) {
+  const auto num = countIterations(cpu, idiom);
+  if (!num) {
+    return false;
+  }
+  const auto bytes = *num * idiom.size;
+  const auto start = accessStart(cpu, idiom.dst, idiom.dstOffset, bytes);
+  if (!start) {
+    return false;
+  }
+
+  // Buffer repeats stored element, chunk size is a multiple of any element
+  const auto elem =
+      std::bit_cast<std::array<std::byte, sizeof(isa::Word)>>(
+          cpu.getReg(idiom.val));
+  std::vector<std::byte> buf(std::min<std::uint64_t>(bytes, kChunkSize));
+  for (std::size_t idx = 0; idx < buf.size(); ++idx) {
+    buf[idx] = elem[idx % idiom.size];
+  }
+  for (std::uint64_t done = 0; done < bytes; done += buf.size()) {
+    const auto len = std::min<std::uint64_t>(buf.size(), bytes - done);
+    cpu.memory->writeBlock(std::span{buf}.first(len),
+                           static_cast<isa::Addr>(*start + done));
+  }
+
+  advance(cpu, idiom.dst, bytes);
+  leave(cpu, idiom.exit, *num * idiom.icount);
+  return true;
+}
+
+bool runMemcpy(CPUState &cpu, const LoopIdiom &idiom) {
+  const auto num = countIterations(cpu, idiom);
+  if (!num) {
+    return false;
+  }
+  const auto bytes = *num * idiom.size;
+  const auto dst = accessStart(cpu, idiom.dst, idiom.dstOffset, bytes);
+  const auto src = accessStart(cpu, idiom.src, idiom.srcOffset, bytes);
+  // Element loop re-reads its own stores if dst is ahead of src within
+  // copied range, forward bulk copy matches it in all other cases
+  if (!dst || !src || (*dst > *src && *dst - *src < bytes)) {
+    return false;
+  }
+
+  std::vector<std::byte> buf(std::min<std::uint64_t>(bytes, kChunkSize));
+  for (std::uint64_t done = 0; done < bytes; done += buf.size()) {
+    const auto chunk =
+        std::span{buf}.first(std::min<std::uint64_t>(buf.size(), bytes - done));
+    cpu.memory->readBlock(static_cast<isa::Addr>(*src + done), chunk);
+    cpu.memory->writeBlock(chunk, static_cast<isa::Addr>(*dst + done));
+  }
+
+  // Last stored element is the last loaded one
+  cpu.setReg(idiom.val,
+             loadElement(*cpu.memory,
+                         static_cast<isa::Addr>(*dst + bytes - idiom.size),
+                         idiom));
+  advance(cpu, idiom.dst, bytes);
+  advance(cpu, idiom.src, bytes);
+  leave(cpu, idiom.exit, *num * idiom.icount);
+  return true;
+}
+
+bool runMemcmp(CPUState &cpu, const LoopIdiom &idiom) {
+  const auto num = countIterations(cpu, idiom);
+  if (!num) {
+    return false;
+  }
+  const auto bytes = *num * idiom.size;
+  const auto lhs = accessStart(cpu, idiom.dst, idiom.dstOffset, bytes);
+  const auto rhs = accessStart(cpu, idiom.src, idiom.srcOffset, bytes);
+  if (!lhs || !rhs) {
+    return false;
+  }
+
+  // Bytes equal before the first mismatch
+  auto same = bytes;
+  std::vector<std::byte> lhsBuf(std::min<std::uint64_t>(bytes, kChunkSize));
+  std::vector<std::byte> rhsBuf(lhsBuf.size());
+  for (std::uint64_t done = 0; done < bytes; done += lhsBuf.size()) {
+    const auto len = std::min<std::uint64_t>(lhsBuf.size(), bytes - done);
+    const auto lhsChunk = std::span{lhsBuf}.first(len);
+    const auto rhsChunk = std::span{rhsBuf}.first(len);
+    cpu.memory->readBlock(static_cast<isa::Addr>(*lhs + done), lhsChunk);
+    cpu.memory->readBlock(static_cast<isa::Addr>(*rhs + done), rhsChunk);
+    if (std::memcmp(lhsChunk.data(), rhsChunk.data(), len) != 0) {
+      const auto diff = std::ranges::mismatch(lhsChunk, rhsChunk);
+      same = done + static_cast<std::uint64_t>(diff.in1 - lhsChunk.begin());
+      break;
+    }
+  }
+
+  // Registers keep elements loaded by the last executed iteration
+  const auto iters = same / idiom.size;
+  const bool found = same != bytes;
+  const auto last = (found ? iters : iters - 1) * idiom.size;
+  cpu.setReg(idiom.val,
+             loadElement(*cpu.memory, static_cast<isa::Addr>(*lhs + last),
+                         idiom));
+  cpu.setReg(idiom.srcVal,
+             loadElement(*cpu.memory, static_cast<isa::Addr>(*rhs + last),
+                         idiom));
+  advance(cpu, idiom.dst, iters * idiom.size);
+  advance(cpu, idiom.src, iters * idiom.size);
+  if (found) {
+    leave(cpu, idiom.mismatch, iters * idiom.icount + kMemcmpHead);
+  } else {
+    leave(cpu, idiom.exit, iters * idiom.icount);
+  }
+  return true;
+}
+
+bool runStrlen(CPUState &cpu, const LoopIdiom &idiom) {
+  const auto start =
+      static_cast<isa::Addr>(cpu.getReg(idiom.dst) + idiom.dstOffset);
+  std::array<std::byte, kScanAlign> buf{};
+  for (std::uint64_t addr = start; addr < kSpace;) {
+    const auto chunk = std::span{buf}.first(kScanAlign - addr % kScanAlign);
+    cpu.memory->readBlock(static_cast<isa::Addr>(addr), chunk);
+    const auto *found = static_cast<const std::byte *>(
+        std::memchr(chunk.data(), 0, chunk.size()));
+    if (found != nullptr) {
+      // Iteration which loads terminator is the last one
+      const auto num = addr - start + (found - chunk.data()) + 1;
+      cpu.setReg(idiom.val, 0);
+      advance(cpu, idiom.dst, num);
+      leave(cpu, idiom.exit, num * idiom.icount);
+      return true;
+    }
+    addr += chunk.size();
+  }
+  return false;
+}
+} // namespace
+
+std::optional<LoopIdiom>
+matchLoopIdiom(isa::Addr pc, std::span<const isa::Instruction> insns,
+               const Memory &mem) {
+  if (insns.size() < 2 || !isa::isBranch(insns.back().opcode())) {
+    return std::nullopt;
+  }
+  const auto &branch = insns.back();
+  const auto branchPc =
+      static_cast<isa::Addr>(pc + isa::kWordSize * (insns.size() - 1));
+  if (branchPc + branch.imm() != pc) {
+    return matchMemcmp(pc, insns, mem);
+  }
+
+  const auto body = analyzeBody(insns.first(insns.size() - 1));
+  if (!body) {
+    return std::nullopt;
+  }
+  auto idiom = matchMemset(*body, branch);
+  if (!idiom) {
+    idiom = matchMemcpy(*body, branch);
+  }
+  if (!idiom) {
+    idiom = matchStrlen(*body, branch);
+  }
+  if (idiom) {
+    idiom->icount = insns.size();
+    idiom->exit = branchPc + isa::kWordSize;
+  }
+  return idiom;
+}
+
+bool runLoopIdiom(CPUState &cpu, const LoopIdiom &idiom) {
+  switch (idiom.kind) {
+  case LoopIdiom::Kind::kMemset:
+    return runMemset(cpu, idiom);
+  case LoopIdiom::Kind::kMemcpy:
+    return runMemcpy(cpu, idiom);
+  case LoopIdiom::Kind::kMemcmp:
+    return runMemcmp(cpu, idiom);
+  case LoopIdiom::Kind::kStrlen:
+    return runStrlen(cpu, idiom);
+  }
+  return false;
+}
+} // namespace prot::engine
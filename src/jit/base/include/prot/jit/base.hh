@@ -2,17 +2,154 @@
 #define INCLUDE_JIT_BASE_HH_INCLUDED
 
 #include "prot/interpreter.hh"
+#include "prot/jit/idiom.hh"
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace prot::engine {
 using JitFunction = void (*)(CPUState &);
 
+// Set of guest regs, bit i stands for xi
+using RegMask = std::uint32_t;
+inline constexpr RegMask kAllRegs = ~RegMask{};
+static_assert(sizeof(RegMask) * 8 == CPUState::kNumRegs);
+
+[[nodiscard]] constexpr RegMask regBit(isa::Operand reg) {
+  return RegMask{1} << reg;
+}
+
 // simple bb counting
 struct BBInfo final {
+  // Successor observed while interpreting
+  struct Exit final {
+    isa::Addr pc{};
+    std::size_t count{};
+  };
+
+  // guest address of the first insn
+  isa::Addr pc{};
   std::vector<isa::Instruction> insns;
+  // amount of guest insns (insns may contain fused ones)
+  std::size_t icount{};
+  // pre-decoded insns for warm-up interpretation
+  ThreadedCode threaded;
   std::size_t num_exec{};
+  // translated code, null until block's batch is compiled
+  JitFunction code{};
+  bool queued{false};
+  // exit profile, only collected w/ loop regions enabled
+  std::array<Exit, 2> exits{};
+  bool loop_checked{false};
+  // code is a loop region entered from this block
+  bool loop_head{false};
+  // Regs read before being written by block & regs it always writes
+  RegMask uses{};
+  RegMask defs{};
+  // Successors known w/out running block, empty if exit is indirect
+  std::vector<isa::Addr> succs;
+  // Regs which may be read after block exit, writebacks of others can be
+  // skipped. Mask only shrinks as successors get discovered, so code
+  // translated w/ an older one stays valid
+  RegMask live_out{kAllRegs};
+  // Block is a loop w/ library semantics, run as a whole on host
+  std::optional<LoopIdiom> idiom;
+  // Refusals of idiom kernel in a row
+  std::size_t idiom_refusals{};
+
+  void recordExit(isa::Addr next) {
+    for (auto &exit : exits) {
+      if (exit.count == 0 || exit.pc == next) {
+        exit.pc = next;
+        ++exit.count;
+        return;
+      }
+    }
+  }
+};
+
+// Peephole stage of template backends, see isa::Instruction::simplify
+[[nodiscard]] std::vector<isa::Instruction>
+simplifyInsns(std::span<const isa::Instruction> insns);
+
+// Guest stack backed by contiguous host buffer, see Memory::pin
+struct StackMapping final {
+  AddrRange range;
+  // Host address of guest address 0, valid for addresses from range only
+  std::byte *hostBase{};
+};
+
+// Backend-independent translator settings
+struct TranslatorOptions final {
+  // 0 - no optimizations, 1 - cheap ones for warm code, 2-3 - hot code
+  unsigned optLevel{1};
+  // Backend codegen level (0 - 3), derived from optLevel if not set
+  std::optional<unsigned> codegenLevel;
+  // Backend's standard pipeline for optLevel replaces the tuned pass list
+  bool defaultPipeline{false};
+  // Number of threads generating code for a batch
+  unsigned compileThreads{1};
+  // Code of a translated block is generated on its first execution
+  bool lazyCodegen{false};
+  // Guest memory acts as plain RAM inside a block: stored values are
+  // forwarded to loads & repeated loads are reused. Has to be off once
+  // accesses have side effects, e.g. MMIO or self-modifying code tracking
+  bool forwardMemory{true};
+};
+
+// Accumulated wall time of translation phases & sizes of what they produce
+class CompileStats final {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  template <typename Func>
+  decltype(auto) measure(std::string_view phase, Func &&func) {
+    const Timer timer{*this, phase};
+    return std::forward<Func>(func)();
+  }
+
+  void add(std::string_view phase, Clock::duration time);
+  // Sizes may shrink, e.g. once memory is released
+  void addSize(std::string_view name, std::ptrdiff_t bytes);
+  void dump(std::ostream &ost) const;
+
+private:
+  struct Phase final {
+    std::string name;
+    Clock::duration time{};
+    std::size_t count{};
+  };
+
+  struct Size final {
+    std::string name;
+    std::ptrdiff_t bytes{};
+  };
+
+  struct Timer final {
+    Timer(CompileStats &stats, std::string_view phase)
+        : m_stats{stats}, m_phase{phase} {}
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+    ~Timer() { m_stats.add(m_phase, Clock::now() - m_start); }
+
+  private:
+    CompileStats &m_stats;
+    std::string_view m_phase;
+    Clock::time_point m_start{Clock::now()};
+  };
+
+  // Few phases in order of appearance
+  std::vector<Phase> m_phases;
+  std::vector<Size> m_sizes;
 };
 
 struct Translator {
@@ -21,6 +158,29 @@ struct Translator {
   Translator &operator=(const Translator &) = delete;
 
   [[nodiscard]] virtual JitFunction translate(const BBInfo &info) = 0;
+  // Translates several blocks at once, entries are returned in the same
+  // order. By default blocks are translated one by one
+  [[nodiscard]] virtual std::vector<JitFunction>
+  translateBatch(const CPUState &cpu, std::span<const BBInfo *const> batch);
+  // Compiles natural loop as a whole, blocks[0] is its header. Returns null
+  // if backend has no region support
+  [[nodiscard]] virtual JitFunction
+  translateRegion([[maybe_unused]] const CPUState &cpu,
+                  [[maybe_unused]] std::span<const BBInfo *const> blocks) {
+    return nullptr;
+  }
+  // Statically lifts whole program functions ahead of execution. Returns
+  // entries of lifted functions, empty if backend has no lifting support
+  [[nodiscard]] virtual std::vector<std::pair<isa::Addr, JitFunction>>
+  liftProgram([[maybe_unused]] const CPUState &cpu,
+              [[maybe_unused]] std::span<const FuncSymbol> funcs) {
+    return {};
+  }
+  // Stack accesses may go directly to host buffer from now on. Code has to
+  // leave CPUState untouched if it finds sp outside of stack, engine
+  // interprets such block instead
+  virtual void mapStack([[maybe_unused]] const StackMapping &stack) {}
+  virtual void dumpStats([[maybe_unused]] std::ostream &ost) const {}
   virtual ~Translator() = default;
 };
 
@@ -30,12 +190,38 @@ public:
     std::size_t execThreshold{};
     bool singleStep{false};
     bool enableDump{false};
+    bool enableFusion{true};
+    // Constants known inside block (incl. loads from read-only data) are
+    // folded & dead reg writes dropped
+    bool enableBlockOpt{true};
+    // Reg liveness is tracked across discovered blocks, so writes of regs
+    // dead at block exit are dropped before translation (w/ enableBlockOpt)
+    // & translators may skip their writebacks
+    bool enableLiveness{true};
+    // Hot blocks are queued & compiled together once batch is full or
+    // any queued block got interpreted batchWindow more times
+    std::size_t batchSize{1};
+    std::size_t batchWindow{64};
+    // Hot loops spanning several blocks are compiled as single region
+    bool enableRegions{false};
+    // Functions from symbol table are lifted before execution starts
+    bool enableLifting{false};
+    // Stack gets pinned to host buffer, so translators may access it
+    // directly instead of calling memory helpers
+    bool enableStackPath{true};
+    // Loops w/ known library semantics (memcpy, memset, memcmp, strlen)
+    // run as bulk host memory ops
+    bool enableIdioms{true};
   };
 
   JitEngine(const Config &config, std::unique_ptr<Translator> translator)
       : m_config{config}, m_translator{std::move(translator)} {}
 
   void step(CPUState &cpu) override;
+  void preTranslate(CPUState &cpu, std::span<const FuncSymbol> funcs) override;
+  void setStack(CPUState &cpu, const AddrRange &range) override;
+  void setReadOnly(CPUState &cpu, const AddrRange &range) override;
+  void dumpStats(std::ostream &ost) const;
 
 protected:
   struct TbCache {
@@ -72,6 +258,18 @@ protected:
 
 private:
   void interpret(CPUState &cpu, BBInfo &info);
+  // False if code refused to run & left CPUState untouched
+  [[nodiscard]] static bool run(CPUState &cpu, JitFunction code) {
+    const auto icount = cpu.icount;
+    code(cpu);
+    return cpu.icount != icount;
+  }
+  void enqueue(const CPUState &cpu, BBInfo &info);
+  void flush(const CPUState &cpu);
+  void formRegion(const CPUState &cpu, BBInfo &info);
+  void pruneDeadWrites(BBInfo &info) const;
+  void analyzeLiveness(BBInfo &info);
+  bool updateLiveOut(BBInfo &info) const;
   void execute(CPUState &cpu, const isa::Instruction &insn) final {
     Interpreter::execute(cpu, insn);
   }
@@ -81,6 +279,12 @@ private:
   TbCache m_tbCache;
   std::unique_ptr<Translator> m_translator;
   std::unordered_map<isa::Addr, BBInfo> m_cacheBB;
+  // Blocks waiting for translation
+  std::vector<BBInfo *> m_pending;
+  // Discovered blocks by pc of their static successors
+  std::unordered_map<isa::Addr, std::vector<BBInfo *>> m_preds;
+  // Guest memory protected from writes, see Memory::protect
+  std::vector<AddrRange> m_readOnly;
 };
 
 // Helper class to store JITed code
@@ -0,0 +1,59 @@
+#ifndef PROT_JIT_IDIOM_HH_INCLUDED
+#define PROT_JIT_IDIOM_HH_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "prot/cpu_state.hh"
+#include "prot/isa.hh"
+#include "prot/memory.hh"
+
+namespace prot::engine {
+// Guest loop w/ known library semantics. Whole run of such loop is done by
+// bulk memory ops on host instead of guest insns
+struct LoopIdiom final {
+  enum class Kind : std::uint8_t { kMemset, kMemcpy, kMemcmp, kStrlen };
+
+  Kind kind{};
+  // Element size in bytes, loads sign extend elements if sext is set
+  std::uint8_t size{};
+  bool sext{};
+  // Pointer regs advanced by size each iteration & offsets of the first
+  // accesses from their values at loop entry. src is unused by memset &
+  // strlen
+  isa::Operand dst{};
+  isa::Operand src{};
+  isa::Word dstOffset{};
+  isa::Word srcOffset{};
+  // Stored value of memset, loaded one of others (from dst for memcmp)
+  isa::Operand val{};
+  // Value loaded from src by memcmp
+  isa::Operand srcVal{};
+  // Loop goes on while counted pointer != end (< end if unsignedBound),
+  // strlen one goes on while loaded value != 0
+  isa::Operand counted{};
+  isa::Operand end{};
+  bool unsignedBound{};
+  // Guest insns per iteration
+  std::size_t icount{};
+  // pc after the last iteration & memcmp exit on mismatch
+  isa::Addr exit{};
+  isa::Addr mismatch{};
+};
+
+// Matches loop starting at pc w/ one of canonical RV32I shapes. insns are
+// decoded insns of block at pc, memcmp shape spans two blocks, so the next
+// one is decoded from memory
+[[nodiscard]] std::optional<LoopIdiom>
+matchLoopIdiom(isa::Addr pc, std::span<const isa::Instruction> insns,
+               const Memory &mem);
+
+// Runs all remaining iterations of loop entered at its first insn. Returns
+// false & leaves CPUState untouched if they cannot be done at once, e.g.
+// pointers would wrap around address space
+[[nodiscard]] bool runLoopIdiom(CPUState &cpu, const LoopIdiom &idiom);
+} // namespace prot::engine
+
+#endif // PROT_JIT_IDIOM_HH_INCLUDED
@@ -0,0 +1,415 @@
+#include "prot/jit/idiom.hh"
+#include "prot/interpreter.hh"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+namespace {
+using namespace prot;
+using engine::LoopIdiom;
+using isa::Addr;
+using isa::Word;
+
+constexpr isa::Operand kA0 = 10;
+constexpr isa::Operand kA1 = 11;
+constexpr isa::Operand kA2 = 12;
+constexpr isa::Operand kA3 = 13;
+constexpr isa::Operand kA4 = 14;
+constexpr isa::Operand kA5 = 15;
+constexpr isa::Operand kA6 = 16;
+
+// Minimal RV32I encoder for loop shapes under test
+Word encodeI(Word opc, Word funct3, isa::Operand rd, isa::Operand rs1,
+             std::int32_t imm) {
+  return (static_cast<Word>(imm) & 0xfffU) << 20U | Word{rs1} << 15U |
+         funct3 << 12U | Word{rd} << 7U | opc;
+}
+
+Word encodeS(Word funct3, isa::Operand rs2, isa::Operand rs1,
+             std::int32_t imm) {
+  const auto val = static_cast<Word>(imm);
+  return (val >> 5U & 0x7fU) << 25U | Word{rs2} << 20U | Word{rs1} << 15U |
+         funct3 << 12U | (val & 0x1fU) << 7U | 0x23U;
+}
+
+Word encodeB(Word funct3, isa::Operand rs1, isa::Operand rs2,
+             std::int32_t imm) {
+  const auto val = static_cast<Word>(imm);
+  return (val >> 12U & 1U) << 31U | (val >> 5U & 0x3fU) << 25U |
+         Word{rs2} << 20U | Word{rs1} << 15U | funct3 << 12U |
+         (val >> 1U & 0xfU) << 8U | (val >> 11U & 1U) << 7U | 0x63U;
+}
+
+Word addi(isa::Operand rd, isa::Operand rs1, std::int32_t imm) {
+  return encodeI(0x13, 0, rd, rs1, imm);
+}
+Word lb(isa::Operand rd, isa::Operand rs1, std::int32_t imm) {
+  return encodeI(0x03, 0, rd, rs1, imm);
+}
+Word lh(isa::Operand rd, isa::Operand rs1, std::int32_t imm) {
+  return encodeI(0x03, 1, rd, rs1, imm);
+}
+Word lw(isa::Operand rd, isa::Operand rs1, std::int32_t imm) {
+  return encodeI(0x03, 2, rd, rs1, imm);
+}
+Word lbu(isa::Operand rd, isa::Operand rs1, std::int32_t imm) {
+  return encodeI(0x03, 4, rd, rs1, imm);
+}
+Word sb(isa::Operand rs2, isa::Operand rs1, std::int32_t imm) {
+  return encodeS(0, rs2, rs1, imm);
+}
+Word sh(isa::Operand rs2, isa::Operand rs1, std::int32_t imm) {
+  return encodeS(1, rs2, rs1, imm);
+}
+Word sw(isa::Operand rs2, isa::Operand rs1, std::int32_t imm) {
+  return encodeS(2, rs2, rs1, imm);
+}
+Word add(isa::Operand rd, isa::Operand rs1, isa::Operand rs2) {
+  return Word{rs2} << 20U | Word{rs1} << 15U | Word{rd} << 7U | 0x33U;
+}
+Word bne(isa::Operand rs1, isa::Operand rs2, std::int32_t imm) {
+  return encodeB(1, rs1, rs2, imm);
+}
+Word bltu(isa::Operand rs1, isa::Operand rs2, std::int32_t imm) {
+  return encodeB(6, rs1, rs2, imm);
+}
+
+constexpr Addr kCode = 0x1000;
+constexpr Addr kData = 0x8000;
+constexpr std::size_t kMemSize = 0x10000;
+
+// Guest w/ loop at kCode, data at kData & no other code
+struct Guest final {
+  std::unique_ptr<Memory> mem{memory::makePlain(kMemSize)};
+  CPUState cpu{mem.get()};
+  engine::Interpreter interp;
+
+  Guest(std::initializer_list<Word> code,
+        const std::function<void(Guest &)> &setup) {
+    auto addr = kCode;
+    for (const auto word : code) {
+      mem->write<Word>(addr, word);
+      addr += isa::kWordSize;
+    }
+    cpu.setPC(kCode);
+    setup(*this);
+  }
+
+  // Interprets blocks till one of stops is reached
+  void runTill(std::initializer_list<Addr> stops) {
+    while (std::ranges::find(stops, cpu.getPC()) == stops.end()) {
+      interp.step(cpu);
+    }
+  }
+
+  [[nodiscard]] std::vector<std::byte> data() const {
+    std::vector<std::byte> res(kMemSize - kData);
+    mem->readBlock(kData, res);
+    return res;
+  }
+
+  void fill(Addr addr, std::initializer_list<std::uint8_t> bytes) {
+    for (const auto byte : bytes) {
+      mem->write<isa::Byte>(addr++, byte);
+    }
+  }
+};
+
+std::vector<isa::Instruction> decodeBlock(const Memory &mem, Addr pc) {
+  std::vector<isa::Instruction> res;
+  while (true) {
+    const auto insn = isa::Instruction::decode(mem.read<Word>(pc));
+    res.push_back(insn.value());
+    if (isa::isTerminator(insn->opcode())) {
+      return res;
+    }
+    pc += isa::kWordSize;
+  }
+}
+
+std::optional<LoopIdiom> match(const Guest &guest) {
+  return engine::matchLoopIdiom(kCode, decodeBlock(*guest.mem, kCode),
+                                *guest.mem);
+}
+
+void expectSameState(const Guest &lhs, const Guest &rhs) {
+  EXPECT_EQ(lhs.cpu.regs, rhs.cpu.regs);
+  EXPECT_EQ(lhs.cpu.getPC(), rhs.cpu.getPC());
+  EXPECT_EQ(lhs.cpu.icount, rhs.cpu.icount);
+  EXPECT_EQ(lhs.data(), rhs.data());
+}
+
+// Kernel run has to leave the same state as guest loop interpreted till it
+// reaches one of exits
+void checkKernel(std::initializer_list<Word> code,
+                 const std::function<void(Guest &)> &setup,
+                 LoopIdiom::Kind kind) {
+  Guest ref{code, setup};
+  Guest fast{code, setup};
+  const auto idiom = match(fast);
+  ASSERT_TRUE(idiom.has_value());
+  EXPECT_EQ(idiom->kind, kind);
+
+  ref.runTill({idiom->exit, idiom->mismatch});
+  ASSERT_TRUE(engine::runLoopIdiom(fast.cpu, *idiom));
+  expectSameState(ref, fast);
+}
+
+// Kernel has to refuse & leave state untouched
+void checkRefused(std::initializer_list<Word> code,
+                  const std::function<void(Guest &)> &setup) {
+  Guest orig{code, setup};
+  Guest fast{code, setup};
+  const auto idiom = match(fast);
+  ASSERT_TRUE(idiom.has_value());
+  EXPECT_FALSE(engine::runLoopIdiom(fast.cpu, *idiom));
+  expectSameState(orig, fast);
+}
+
+const std::initializer_list<Word> kMemsetBytes{
+    sb(kA2, kA0, 0),
+    addi(kA0, kA0, 1),
+    bne(kA0, kA1, -8),
+};
+
+// Increment comes first, so store uses -4 offset
+const std::initializer_list<Word> kMemsetWordsBltu{
+    addi(kA0, kA0, 4),
+    sw(kA2, kA0, -4),
+    bltu(kA0, kA1, -8),
+};
+
+// Loop shape emitted by GCC for byte copy
+const std::initializer_list<Word> kMemcpyBytes{
+    lb(kA6, kA3, 0),     addi(kA3, kA3, 1), addi(kA4, kA4, 1),
+    sb(kA6, kA4, -1),    bne(kA3, kA5, -16),
+};
+
+const std::initializer_list<Word> kMemcpyHalves{
+    lh(kA6, kA3, 0),  sh(kA6, kA4, 0),   addi(kA3, kA3, 2),
+    addi(kA4, kA4, 2), bne(kA5, kA4, -16),
+};
+
+const std::initializer_list<Word> kMemcpyWords{
+    lw(kA6, kA3, 0),  sw(kA6, kA4, 0),   addi(kA3, kA3, 4),
+    addi(kA4, kA4, 4), bne(kA4, kA5, -16),
+};
+
+const std::initializer_list<Word> kStrlen{
+    lbu(kA6, kA0, 0),
+    addi(kA0, kA0, 1),
+    bne(kA6, 0, -8),
+};
+
+const std::initializer_list<Word> kStrlenSigned{
+    addi(kA0, kA0, 1),
+    lb(kA6, kA0, -1),
+    bne(0, kA6, -8),
+};
+
+// Mismatch exit skips a1 write done on normal loop exit
+const std::initializer_list<Word> kMemcmp{
+    lbu(kA6, kA3, 0),  lbu(kA2, kA4, 0),   bne(kA6, kA2, 20),
+    addi(kA3, kA3, 1), addi(kA4, kA4, 1),  bne(kA3, kA5, -20),
+    addi(kA1, 0, 1),
+};
+
+const std::initializer_list<Word> kMemcmpSignedBltu{
+    lb(kA6, kA3, 0),   lb(kA2, kA4, 0),    bne(kA2, kA6, 20),
+    addi(kA4, kA4, 1), addi(kA3, kA3, 1),  bltu(kA3, kA5, -20),
+    addi(kA1, 0, 1),
+};
+
+TEST(IdiomTest, MemsetBytes) {
+  checkKernel(
+      kMemsetBytes,
+      [](Guest &guest) {
+        guest.cpu.setReg(kA0, kData + 3);
+        guest.cpu.setReg(kA1, kData + 3 + 37);
+        guest.cpu.setReg(kA2, 0x1a5);
+      },
+      LoopIdiom::Kind::kMemset);
+}
+
+TEST(IdiomTest, MemsetWordsBltuRounding) {
+  // Bound which is not a multiple of step, equal to pointer & below it: loop
+  // body runs at least once
+  for (const Word dist : {35U, 36U, 0U}) {
+    checkKernel(
+        kMemsetWordsBltu,
+        [dist](Guest &guest) {
+          guest.cpu.setReg(kA0, kData + 0x40);
+          guest.cpu.setReg(kA1, kData + 0x40 + dist);
+          guest.cpu.setReg(kA2, 0xdeadbeef);
+        },
+        LoopIdiom::Kind::kMemset);
+  }
+  checkKernel(
+      kMemsetWordsBltu,
+      [](Guest &guest) {
+        guest.cpu.setReg(kA0, kData + 0x40);
+        guest.cpu.setReg(kA1, kData);
+        guest.cpu.setReg(kA2, 0x12345678);
+      },
+      LoopIdiom::Kind::kMemset);
+}
+
+TEST(IdiomTest, MemcpyBytesSignExtended) {
+  checkKernel(
+      kMemcpyBytes,
+      [](Guest &guest) {
+        guest.fill(kData, {0x01, 0x7f, 0x80, 0xff, 0x10, 0x90, 0x22});
+        guest.cpu.setReg(kA3, kData);
+        guest.cpu.setReg(kA4, kData + 0x100);
+        guest.cpu.setReg(kA5, kData + 7);
+      },
+      LoopIdiom::Kind::kMemcpy);
+}
+
+TEST(IdiomTest, MemcpyHalvesBoundOnDst) {
+  checkKernel(
+      kMemcpyHalves,
+      [](Guest &guest) {
+        guest.fill(kData, {0x34, 0x12, 0x00, 0x80, 0xff, 0xff, 0x01, 0x90});
+        guest.cpu.setReg(kA3, kData);
+        guest.cpu.setReg(kA4, kData + 0x200);
+        guest.cpu.setReg(kA5, kData + 0x208);
+      },
+      LoopIdiom::Kind::kMemcpy);
+}
+
+TEST(IdiomTest, MemcpyOverlapDstBelowSrc) {
+  // Forward copy reads each word before it gets overwritten
+  checkKernel(
+      kMemcpyWords,
+      [](Guest &guest) {
+        for (Word idx = 0; idx < 16; ++idx) {
+          guest.mem->write<Word>(kData + 4 * idx, idx * 0x01010101U);
+        }
+        guest.cpu.setReg(kA3, kData + 8);
+        guest.cpu.setReg(kA4, kData);
+        guest.cpu.setReg(kA5, kData + 36);
+      },
+      LoopIdiom::Kind::kMemcpy);
+}
+
+TEST(IdiomTest, MemcpyOverlapDstAboveSrcRefused) {
+  // Guest loop replicates leading bytes, bulk copy would not
+  checkRefused(kMemcpyBytes, [](Guest &guest) {
+    guest.fill(kData, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10});
+    guest.cpu.setReg(kA3, kData);
+    guest.cpu.setReg(kA4, kData + 2);
+    guest.cpu.setReg(kA5, kData + 10);
+  });
+}
+
+TEST(IdiomTest, Strlen) {
+  // String crosses 4 KiB boundary scanned by separate chunks
+  const auto setup = [](Guest &guest) {
+    constexpr Addr kStr = kData + 0xf80;
+    guest.mem->fillBlock(kStr, std::byte{0x41}, 300);
+    guest.mem->fillBlock(kStr + 300, std::byte{0}, 1);
+    guest.mem->fillBlock(kStr + 301, std::byte{0x42}, 16);
+    guest.cpu.setReg(kA0, kStr + 5);
+  };
+  checkKernel(kStrlen, setup, LoopIdiom::Kind::kStrlen);
+  checkKernel(kStrlenSigned, setup, LoopIdiom::Kind::kStrlen);
+}
+
+TEST(IdiomTest, StrlenEmpty) {
+  checkKernel(
+      kStrlen, [](Guest &guest) { guest.cpu.setReg(kA0, kData); },
+      LoopIdiom::Kind::kStrlen);
+}
+
+TEST(IdiomTest, MemcmpMismatch) {
+  // Mismatch in the middle leaves loop early w/ partial icount
+  const auto setup = [](Guest &guest) {
+    guest.mem->fillBlock(kData, std::byte{0x55}, 30);
+    guest.mem->fillBlock(kData + 0x100, std::byte{0x55}, 30);
+    guest.fill(kData + 0x100 + 20, {0x80});
+    guest.cpu.setReg(kA3, kData);
+    guest.cpu.setReg(kA4, kData + 0x100);
+    guest.cpu.setReg(kA5, kData + 30);
+  };
+  checkKernel(kMemcmp, setup, LoopIdiom::Kind::kMemcmp);
+  checkKernel(kMemcmpSignedBltu, setup, LoopIdiom::Kind::kMemcmp);
+}
+
+TEST(IdiomTest, MemcmpMismatchFirst) {
+  checkKernel(
+      kMemcmp,
+      [](Guest &guest) {
+        guest.fill(kData, {1});
+        guest.fill(kData + 0x100, {2});
+        guest.cpu.setReg(kA3, kData);
+        guest.cpu.setReg(kA4, kData + 0x100);
+        guest.cpu.setReg(kA5, kData + 8);
+      },
+      LoopIdiom::Kind::kMemcmp);
+}
+
+TEST(IdiomTest, MemcmpEqual) {
+  const auto setup = [](Guest &guest) {
+    guest.mem->fillBlock(kData, std::byte{0xa5}, 50);
+    guest.mem->fillBlock(kData + 0x100, std::byte{0xa5}, 50);
+    guest.cpu.setReg(kA3, kData);
+    guest.cpu.setReg(kA4, kData + 0x100);
+    guest.cpu.setReg(kA5, kData + 50);
+  };
+  checkKernel(kMemcmp, setup, LoopIdiom::Kind::kMemcmp);
+  checkKernel(kMemcmpSignedBltu, setup, LoopIdiom::Kind::kMemcmp);
+}
+
+TEST(IdiomTest, PointerWrapRefused) {
+  // BNE bound is only met after pointer wraps around address space
+  checkRefused(kMemsetBytes, [](Guest &guest) {
+    guest.cpu.setReg(kA0, 0xfffffff0);
+    guest.cpu.setReg(kA1, 0x10);
+  });
+}
+
+TEST(IdiomTest, AccessWrapRefused) {
+  // Pointer stays in range, but the first store goes to 0xfffffffc
+  checkRefused({sw(kA2, kA0, -4), addi(kA0, kA0, 4), bltu(kA0, kA1, -8)},
+               [](Guest &guest) {
+                 guest.cpu.setReg(kA0, 0);
+                 guest.cpu.setReg(kA1, 8);
+               });
+}
+
+TEST(IdiomTest, UnreachableBoundRefused) {
+  // Distance is not a multiple of step, so BNE never leaves loop
+  checkRefused(kMemcpyWords, [](Guest &guest) {
+    guest.cpu.setReg(kA3, kData);
+    guest.cpu.setReg(kA4, kData + 0x100);
+    guest.cpu.setReg(kA5, kData + 0x100 + 6);
+  });
+}
+
+TEST(IdiomTest, OtherLoopsNotMatched) {
+  const auto setup = [](Guest & /*guest*/) {};
+  // Body does arithmetic on loaded value
+  EXPECT_FALSE(match(Guest{{lbu(kA6, kA0, 0), add(kA2, kA2, kA6),
+                            addi(kA0, kA0, 1), bne(kA0, kA1, -12)},
+                           setup}));
+  // Stored value is the pointer itself
+  EXPECT_FALSE(
+      match(Guest{{sw(kA0, kA0, 0), addi(kA0, kA0, 4), bne(kA0, kA1, -8)},
+                  setup}));
+  // Step does not match element size
+  EXPECT_FALSE(
+      match(Guest{{sw(kA2, kA0, 0), addi(kA0, kA0, 8), bne(kA0, kA1, -8)},
+                  setup}));
+  // Bound changes inside loop
+  EXPECT_FALSE(match(Guest{{sb(kA2, kA0, 0), addi(kA0, kA0, 1),
+                            addi(kA1, kA1, 1), bne(kA0, kA1, -12)},
+                           setup}));
+}
+} // namespace
@@ -9,21 +9,32 @@
 #include "prot/jit/lightning.hh"
 #include "prot/jit/llvmbasedjit.hh"
 #include "prot/jit/mir.hh"
+#include "prot/jit/stencil.hh"
 #include "prot/jit/tpde.hh"
 #include "prot/jit/xbyak.hh"
 
 namespace prot::engine {
-const std::unordered_map<std::string_view,
-                         std::function<std::unique_ptr<Translator>()>>
+const std::unordered_map<std::string_view, JitFactory::Maker>
     JitFactory::kFactories = {
-        {"xbyak", []() { return makeXbyak(); }},
-        {"asmjit", []() { return makeAsmJit(); }},
-        {"cached-interp", []() { return std::unique_ptr<Translator>(); }},
-        {"llvm", []() { return makeLLVMBasedJIT(); }},
-        {"lightning", []() { return makeLightning(); }},
-        {"mir", []() { return makeMirJit(); }},
-        {"tpde", []() { return makeTPDE(); }},
-        {"ir", []() { return makeIrJit(); }}};
+        {"xbyak", [](const TranslatorOptions &) { return makeXbyak(); }},
+        {"asmjit",
+         [](const TranslatorOptions &options) { return makeAsmJit(options); }},
+        {"cached-interp",
+         [](const TranslatorOptions &) {
+           return std::unique_ptr<Translator>();
+         }},
+        {"llvm",
+         [](const TranslatorOptions &options) {
+           return makeLLVMBasedJIT(options);
+         }},
+        {"lightning",
+         [](const TranslatorOptions &) { return makeLightning(); }},
+        {"mir",
+         [](const TranslatorOptions &options) { return makeMirJit(options); }},
+        {"tpde", [](const TranslatorOptions &) { return makeTPDE(); }},
+        {"ir",
+         [](const TranslatorOptions &options) { return makeIrJit(options); }},
+        {"stencil", [](const TranslatorOptions &) { return makeStencil(); }}};
 
 std::vector<std::string_view> JitFactory::backends() {
   std::vector<std::string_view> res(kFactories.size());
@@ -32,9 +43,10 @@ std::vector<std::string_view> JitFactory::backends() {
 }
 
 std::unique_ptr<Translator>
-JitFactory::createTranslator(const std::string &backend) {
+JitFactory::createTranslator(const std::string &backend,
+                             const TranslatorOptions &options) {
   if (const auto it = kFactories.find(backend); it != kFactories.end()) {
-    return it->second();
+    return it->second(options);
   }
 
   throw std::invalid_argument("Undefined JIT backend: " + backend);
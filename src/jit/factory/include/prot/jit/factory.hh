@@ -16,13 +16,14 @@ class JitFactory {
 public:
   [[nodiscard]] static std::vector<std::string_view> backends();
   static std::unique_ptr<Translator>
-  createTranslator(const std::string &backend);
+  createTranslator(const std::string &backend,
+                   const TranslatorOptions &options = {});
   static bool exist(const std::string &backend);
 
 private:
-  static const std::unordered_map<std::string_view,
-                                  std::function<std::unique_ptr<Translator>()>>
-      kFactories;
+  using Maker =
+      std::function<std::unique_ptr<Translator>(const TranslatorOptions &)>;
+  static const std::unordered_map<std::string_view, Maker> kFactories;
 };
 
 } // namespace prot::engine
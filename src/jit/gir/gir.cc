@@ -0,0 +1,273 @@
+#include "prot/jit/gir.hh"
+
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+
+namespace prot::gir {
+namespace {
+std::string_view strOp(Op op) {
+  switch (op) {
+  case Op::kConst:
+    return "const";
+  case Op::kGetReg:
+    return "getreg";
+  case Op::kSetReg:
+    return "setreg";
+  case Op::kAdd:
+    return "add";
+  case Op::kSub:
+    return "sub";
+  case Op::kAnd:
+    return "and";
+  case Op::kOr:
+    return "or";
+  case Op::kXor:
+    return "xor";
+  case Op::kShl:
+    return "shl";
+  case Op::kShr:
+    return "shr";
+  case Op::kSar:
+    return "sar";
+  case Op::kCmp:
+    return "cmp";
+  case Op::kSelect:
+    return "select";
+  case Op::kLoad:
+    return "load";
+  case Op::kStore:
+    return "store";
+  case Op::kSyscall:
+    return "syscall";
+  case Op::kGuard:
+    return "guard";
+  case Op::kExit:
+    return "exit";
+  case Op::kNop:
+    return "nop";
+  }
+  throw std::invalid_argument{"Unexpected GIR op"};
+}
+
+std::string_view strCond(Cond cond) {
+  switch (cond) {
+  case Cond::kEq:
+    return "eq";
+  case Cond::kNe:
+    return "ne";
+  case Cond::kLt:
+    return "lt";
+  case Cond::kGe:
+    return "ge";
+  case Cond::kLtu:
+    return "ltu";
+  case Cond::kGeu:
+    return "geu";
+  }
+  throw std::invalid_argument{"Unexpected GIR cond"};
+}
+} // namespace
+
+std::size_t Inst::numArgs() const {
+  switch (op) {
+  case Op::kConst:
+  case Op::kGetReg:
+  case Op::kSyscall:
+  case Op::kNop:
+    return 0;
+  case Op::kSetReg:
+  case Op::kLoad:
+  case Op::kGuard:
+  case Op::kExit:
+    return 1;
+  case Op::kSelect:
+    return 3;
+  default:
+    return 2;
+  }
+}
+
+bool Inst::isPure() const {
+  switch (op) {
+  case Op::kSetReg:
+  case Op::kLoad:
+  case Op::kStore:
+  case Op::kSyscall:
+  case Op::kGuard:
+  case Op::kExit:
+  case Op::kNop:
+    return false;
+  default:
+    return true;
+  }
+}
+
+isa::Word evalCond(Cond cond, isa::Word lhs, isa::Word rhs) {
+  switch (cond) {
+  case Cond::kEq:
+    return lhs == rhs;
+  case Cond::kNe:
+    return lhs != rhs;
+  case Cond::kLt:
+    return isa::signedLess(lhs, rhs);
+  case Cond::kGe:
+    return !isa::signedLess(lhs, rhs);
+  case Cond::kLtu:
+    return lhs < rhs;
+  case Cond::kGeu:
+    return lhs >= rhs;
+  }
+  throw std::invalid_argument{"Unexpected GIR cond"};
+}
+
+isa::Word evalBinary(Op op, isa::Word lhs, isa::Word rhs) {
+  const auto shamt = isa::slice<4, 0>(rhs);
+  switch (op) {
+  case Op::kAdd:
+    return lhs + rhs;
+  case Op::kSub:
+    return lhs - rhs;
+  case Op::kAnd:
+    return lhs & rhs;
+  case Op::kOr:
+    return lhs | rhs;
+  case Op::kXor:
+    return lhs ^ rhs;
+  case Op::kShl:
+    return lhs << shamt;
+  case Op::kShr:
+    return lhs >> shamt;
+  case Op::kSar:
+    return static_cast<isa::Word>(
+        static_cast<std::make_signed_t<isa::Word>>(lhs) >> shamt);
+  default:
+    break;
+  }
+  throw std::invalid_argument{
+      fmt::format("GIR op {} is not binary arith", strOp(op))};
+}
+
+void verify(const Block &block) {
+  if (block.insts.empty() || block.insts.back().op != Op::kExit) {
+    throw std::logic_error{
+        fmt::format("GIR block {:#x} does not end w/ exit", block.pc)};
+  }
+
+  bool hasEffects = false;
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    if (inst.op == Op::kGuard && hasEffects) {
+      throw std::logic_error{
+          fmt::format("GIR block {:#x} has guard %{} after effects", block.pc,
+                      val)};
+    }
+    hasEffects = hasEffects || inst.op == Op::kSetReg ||
+                 inst.op == Op::kStore || inst.op == Op::kSyscall;
+    if (inst.op == Op::kExit && val + 1 != block.insts.size()) {
+      throw std::logic_error{
+          fmt::format("GIR block {:#x} has exit in the middle", block.pc)};
+    }
+    if ((inst.op == Op::kGetReg || inst.op == Op::kSetReg) && inst.reg == 0) {
+      throw std::logic_error{
+          fmt::format("GIR block {:#x} accesses x0 in %{}", block.pc, val)};
+    }
+    for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+      const auto arg = inst.args[idx];
+      if (arg >= val || !block[arg].hasResult()) {
+        throw std::logic_error{fmt::format(
+            "GIR block {:#x} uses invalid value %{} in %{}", block.pc, arg,
+            val)};
+      }
+    }
+  }
+}
+
+void dump(std::ostream &ost, const Block &block) {
+  fmt::print(ost, "block {:#x} icount {}:\n", block.pc, block.icount);
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    if (inst.op == Op::kNop) {
+      continue;
+    }
+
+    fmt::print(ost, "  %{} = {}", val, strOp(inst.op));
+    switch (inst.op) {
+    case Op::kConst:
+      fmt::print(ost, " {:#x}", inst.imm);
+      break;
+    case Op::kGetReg:
+    case Op::kSetReg:
+      fmt::print(ost, " x{}", inst.reg);
+      break;
+    case Op::kCmp:
+      fmt::print(ost, ".{}", strCond(inst.cond));
+      break;
+    case Op::kLoad:
+    case Op::kStore:
+      fmt::print(ost, ".{}{}{}", inst.sext ? "s" : "u", inst.size * 8,
+                 inst.stack ? ".stack" : "");
+      break;
+    default:
+      break;
+    }
+    for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+      fmt::print(ost, " %{}", inst.args[idx]);
+    }
+    fmt::print(ost, "\n");
+  }
+}
+
+Pipeline Pipeline::makeDefault(const engine::TranslatorOptions &options) {
+  Pipeline res;
+  if (options.optLevel == 0) {
+    return res;
+  }
+
+  res.add("forward-regs", forwardRegs);
+  if (options.forwardMemory) {
+    res.add("forward-mem", forwardMemory);
+  }
+  res.add("dce", eliminateDeadCode);
+  res.add("compact", compact);
+  return res;
+}
+
+void Pipeline::add(std::string_view name, Pass pass) {
+  m_passes.push_back(Entry{.name = std::string{name}, .pass = std::move(pass)});
+}
+
+void Pipeline::run(Block &block) const {
+  for (const auto &[name, pass] : m_passes) {
+    pass(block);
+#ifndef NDEBUG
+    try {
+      verify(block);
+    } catch (const std::logic_error &err) {
+      throw std::logic_error{fmt::format("After {}: {}", name, err.what())};
+    }
+#endif
+  }
+}
+} // namespace prot::gir
+
+namespace prot::engine {
+void GirTranslator::mapStack(const StackMapping &stack) {
+  // Offsets from sp are only seen once reg values are forwarded
+  if (m_pipeline.empty()) {
+    return;
+  }
+  m_pipeline.add("stack-access", [stack](gir::Block &block) {
+    gir::mapStackAccesses(block, stack);
+  });
+}
+
+gir::Block GirTranslator::build(const BBInfo &info) const {
+  auto block = gir::lift(info);
+  m_pipeline.run(block);
+  return block;
+}
+} // namespace prot::engine
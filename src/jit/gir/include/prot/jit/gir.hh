@@ -0,0 +1,167 @@
+#ifndef PROT_JIT_GIR_HH_INCLUDED
+#define PROT_JIT_GIR_HH_INCLUDED
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "prot/isa.hh"
+#include "prot/jit/base.hh"
+
+// Guest IR: SSA form of a translated block shared by backends w/ register
+// allocators (asmjit, MIR, IR). Constant folding & dead write elimination
+// are done once on guest insns by JitEngine for every backend, so GIR
+// passes only cover what needs SSA values: reg & memory forwarding, stack
+// mapping & DCE
+namespace prot::gir {
+
+// Index of the defining inst in Block::insts
+using Value = std::uint32_t;
+inline constexpr Value kNoValue = ~Value{};
+
+enum class Op : std::uint8_t {
+  kConst,  // imm
+  kGetReg, // guest reg, never x0
+  kSetReg, // guest reg = args[0], never x0
+  kAdd,
+  kSub,
+  kAnd,
+  kOr,
+  kXor,
+  kShl, // shift amount is taken modulo 32
+  kShr,
+  kSar,
+  kCmp,     // cond(args[0], args[1]) ? 1 : 0
+  kSelect,  // args[0] != 0 ? args[1] : args[2]
+  kLoad,    // mem[args[0]] of size bytes, extended according to sext
+  kStore,   // mem[args[0]] = args[1] truncated to size bytes
+  kSyscall, // reads & writes any guest reg
+  kGuard,   // leaves block w/out any effect unless args[0] != 0
+  kExit,    // leaves block w/ pc = args[0], always the last inst
+  kNop,     // removed inst
+};
+
+enum class Cond : std::uint8_t { kEq, kNe, kLt, kGe, kLtu, kGeu };
+
+struct Inst final {
+  Op op{Op::kNop};
+  // kCmp only
+  Cond cond{};
+  // kLoad & kStore only
+  std::uint8_t size{};
+  bool sext{};
+  // Access goes directly to Block::stackBase, no helper is called
+  bool stack{};
+  // kGetReg & kSetReg only
+  isa::Operand reg{};
+  std::array<Value, 3> args{kNoValue, kNoValue, kNoValue};
+  // kConst only
+  isa::Word imm{};
+
+  [[nodiscard]] std::size_t numArgs() const;
+  // Inst has no effect besides its result
+  [[nodiscard]] bool isPure() const;
+  [[nodiscard]] bool hasResult() const { return isPure() || op == Op::kLoad; }
+  // Inst calls memory or syscall helper
+  [[nodiscard]] bool isCall() const {
+    return op == Op::kLoad || op == Op::kStore || op == Op::kSyscall;
+  }
+};
+
+struct Block final {
+  // guest address of the first insn
+  isa::Addr pc{};
+  // amount of guest insns covered by block
+  std::size_t icount{};
+  // Host address of guest address 0 for stack accesses
+  std::byte *stackBase{};
+  std::vector<Inst> insts;
+
+  Value append(const Inst &inst) {
+    insts.push_back(inst);
+    return static_cast<Value>(insts.size() - 1);
+  }
+
+  [[nodiscard]] const Inst &operator[](Value val) const { return insts[val]; }
+  [[nodiscard]] Inst &operator[](Value val) { return insts[val]; }
+};
+
+[[nodiscard]] isa::Word evalCond(Cond cond, isa::Word lhs, isa::Word rhs);
+// Value of binary arith op applied to known operands
+[[nodiscard]] isa::Word evalBinary(Op op, isa::Word lhs, isa::Word rhs);
+
+// Naive lifting: each guest insn reads its operands from CPUState & writes
+// result back. x0 reads become constants
+[[nodiscard]] Block lift(const engine::BBInfo &info);
+
+// Throws if SSA form is broken: args must be defined before use, guards
+// must precede effects & block must end w/ the only exit
+void verify(const Block &block);
+void dump(std::ostream &ost, const Block &block);
+
+// Reuses values already read from or written to guest regs instead of
+// reading CPUState again
+void forwardRegs(Block &block);
+// Replaces loads w/ values stored to or loaded from the same base reg &
+// offset earlier. Stores via other bases & syscalls may alias anything
+void forwardMemory(Block &block);
+// Makes accesses at constant offsets from sp direct ones. Single guard at
+// block entry checks that all of them fall into stack mapping
+void mapStackAccesses(Block &block, const engine::StackMapping &stack);
+// Turns pure insts w/out uses into nops
+void eliminateDeadCode(Block &block);
+// Drops nops & renumbers values
+void compact(Block &block);
+
+using Pass = std::function<void(Block &)>;
+
+class Pipeline final {
+public:
+  // Passes enabled by TranslatorOptions, mostly by optLevel
+  [[nodiscard]] static Pipeline
+  makeDefault(const engine::TranslatorOptions &options);
+
+  void add(std::string_view name, Pass pass);
+  void run(Block &block) const;
+
+  [[nodiscard]] bool empty() const { return m_passes.empty(); }
+
+private:
+  struct Entry final {
+    std::string name;
+    Pass pass;
+  };
+
+  std::vector<Entry> m_passes;
+};
+} // namespace prot::gir
+
+namespace prot::engine {
+// Backend lowering GIR instead of guest insns. Blocks are lifted & optimized
+// by the shared pipeline, backend only emits code for the result
+class GirTranslator : public Translator {
+public:
+  explicit GirTranslator(const TranslatorOptions &options)
+      : m_pipeline{gir::Pipeline::makeDefault(options)} {}
+
+  [[nodiscard]] JitFunction translate(const BBInfo &info) override {
+    return lower(build(info));
+  }
+  // Lowerings have to support direct stack accesses & guards
+  void mapStack(const StackMapping &stack) override;
+
+protected:
+  [[nodiscard]] gir::Block build(const BBInfo &info) const;
+  [[nodiscard]] virtual JitFunction lower(const gir::Block &block) = 0;
+
+private:
+  gir::Pipeline m_pipeline;
+};
+} // namespace prot::engine
+
+#endif // PROT_JIT_GIR_HH_INCLUDED
@@ -0,0 +1,238 @@
+#include "prot/jit/gir.hh"
+
+#include <stdexcept>
+
+namespace prot::gir {
+namespace {
+class Lifter final {
+public:
+  explicit Lifter(Block &block) : m_block{block} {}
+
+  void lift(const isa::Instruction &insn, isa::Addr pc);
+
+private:
+  Value emit(Op op, Value lhs = kNoValue, Value rhs = kNoValue) {
+    return m_block.append(Inst{.op = op, .args = {lhs, rhs, kNoValue}});
+  }
+  Value constant(isa::Word imm) {
+    return m_block.append(Inst{.op = Op::kConst, .imm = imm});
+  }
+  Value getReg(isa::Operand reg) {
+    if (reg == 0) {
+      return constant(0);
+    }
+    return m_block.append(Inst{.op = Op::kGetReg, .reg = reg});
+  }
+  void setReg(isa::Operand reg, Value val) {
+    if (reg != 0) {
+      m_block.append(Inst{.op = Op::kSetReg, .reg = reg, .args = {val}});
+    }
+  }
+  Value cmp(Cond cond, Value lhs, Value rhs) {
+    return m_block.append(
+        Inst{.op = Op::kCmp, .cond = cond, .args = {lhs, rhs, kNoValue}});
+  }
+  Value load(Value addr, std::size_t size, bool sext) {
+    return m_block.append(Inst{.op = Op::kLoad,
+                               .size = static_cast<std::uint8_t>(size),
+                               .sext = sext,
+                               .args = {addr}});
+  }
+  void exit(Value pc) { emit(Op::kExit, pc); }
+
+  void regReg(const isa::Instruction &insn, Op op) {
+    setReg(insn.rd(), emit(op, getReg(insn.rs1()), getReg(insn.rs2())));
+  }
+  void regImm(const isa::Instruction &insn, Op op) {
+    setReg(insn.rd(), emit(op, getReg(insn.rs1()), constant(insn.imm())));
+  }
+  void branch(const isa::Instruction &insn, isa::Addr pc, Cond cond) {
+    const auto taken = cmp(cond, getReg(insn.rs1()), getReg(insn.rs2()));
+    exit(m_block.append(Inst{.op = Op::kSelect,
+                             .args = {taken, constant(pc + insn.imm()),
+                                      constant(pc + insn.size())}}));
+  }
+  Value address(const isa::Instruction &insn) {
+    return emit(Op::kAdd, getReg(insn.rs1()), constant(insn.imm()));
+  }
+
+  Block &m_block;
+};
+
+void Lifter::lift(const isa::Instruction &insn, isa::Addr pc) {
+  switch (insn.opcode()) {
+    using enum isa::Opcode;
+  case kADD:
+    regReg(insn, Op::kAdd);
+    break;
+  case kSUB:
+    regReg(insn, Op::kSub);
+    break;
+  case kAND:
+    regReg(insn, Op::kAnd);
+    break;
+  case kOR:
+    regReg(insn, Op::kOr);
+    break;
+  case kXOR:
+    regReg(insn, Op::kXor);
+    break;
+  case kSLL:
+    regReg(insn, Op::kShl);
+    break;
+  case kSRL:
+    regReg(insn, Op::kShr);
+    break;
+  case kSRA:
+    regReg(insn, Op::kSar);
+    break;
+  case kADDI:
+    regImm(insn, Op::kAdd);
+    break;
+  case kANDI:
+    regImm(insn, Op::kAnd);
+    break;
+  case kORI:
+    regImm(insn, Op::kOr);
+    break;
+  case kXORI:
+    regImm(insn, Op::kXor);
+    break;
+  case kSLLI:
+    regImm(insn, Op::kShl);
+    break;
+  case kSRLI:
+    regImm(insn, Op::kShr);
+    break;
+  case kSRAI:
+    regImm(insn, Op::kSar);
+    break;
+
+  case kSLT:
+    setReg(insn.rd(), cmp(Cond::kLt, getReg(insn.rs1()), getReg(insn.rs2())));
+    break;
+  case kSLTU:
+    setReg(insn.rd(),
+           cmp(Cond::kLtu, getReg(insn.rs1()), getReg(insn.rs2())));
+    break;
+  case kSLTI:
+    setReg(insn.rd(),
+           cmp(Cond::kLt, getReg(insn.rs1()), constant(insn.imm())));
+    break;
+  case kSLTIU:
+    setReg(insn.rd(),
+           cmp(Cond::kLtu, getReg(insn.rs1()), constant(insn.imm())));
+    break;
+
+  case kBEQ:
+    branch(insn, pc, Cond::kEq);
+    break;
+  case kBNE:
+    branch(insn, pc, Cond::kNe);
+    break;
+  case kBLT:
+    branch(insn, pc, Cond::kLt);
+    break;
+  case kBGE:
+    branch(insn, pc, Cond::kGe);
+    break;
+  case kBLTU:
+    branch(insn, pc, Cond::kLtu);
+    break;
+  case kBGEU:
+    branch(insn, pc, Cond::kGeu);
+    break;
+
+  case kLB:
+  case kLH:
+    setReg(insn.rd(),
+           load(address(insn), isa::accessSize(insn.opcode()), true));
+    break;
+  case kLBU:
+  case kLHU:
+  case kLW:
+    setReg(insn.rd(),
+           load(address(insn), isa::accessSize(insn.opcode()), false));
+    break;
+  case kSB:
+  case kSH:
+  case kSW: {
+    const auto addr = address(insn);
+    m_block.append(
+        Inst{.op = Op::kStore,
+             .size = static_cast<std::uint8_t>(isa::accessSize(insn.opcode())),
+             .args = {addr, getReg(insn.rs2()), kNoValue}});
+    break;
+  }
+
+  case kJAL:
+    setReg(insn.rd(), constant(pc + insn.size()));
+    exit(constant(pc + insn.imm()));
+    break;
+  case kJALR: {
+    // Target is read before rd is written, they may be the same reg
+    const auto target = emit(Op::kAnd, address(insn), constant(~isa::Word{1}));
+    setReg(insn.rd(), constant(pc + insn.size()));
+    exit(target);
+    break;
+  }
+  case kCALL:
+    setReg(insn.rd(), constant(pc + insn.size()));
+    exit(constant((pc + insn.imm()) & ~isa::Word{1}));
+    break;
+
+  case kLUI:
+  case kLI:
+    setReg(insn.rd(), constant(insn.imm()));
+    break;
+  case kAUIPC:
+  case kLA:
+    setReg(insn.rd(), constant(pc + insn.imm()));
+    break;
+  case kLWPC:
+    setReg(insn.rd(), load(constant(pc + insn.imm()), sizeof(isa::Word),
+                           false));
+    break;
+  case kSHADD: {
+    const auto shifted =
+        emit(Op::kShl, getReg(insn.rs1()), constant(insn.imm()));
+    setReg(insn.rd(), emit(Op::kAdd, shifted, getReg(insn.rs2())));
+    break;
+  }
+
+  case kECALL:
+    emit(Op::kSyscall);
+    break;
+
+  case kFENCE:
+  case kEBREAK:
+  case kPAUSE:
+  case kSBREAK:
+  case kSCALL:
+    break;
+
+  case kNumOpcodes:
+    throw std::invalid_argument{"Unexpected insn id"};
+  }
+}
+} // namespace
+
+Block lift(const engine::BBInfo &info) {
+  Block block{.pc = info.pc, .icount = info.icount, .insts = {}};
+  // Roughly get, op & set per insn
+  block.insts.reserve(info.insns.size() * 4 + 1);
+
+  Lifter lifter{block};
+  auto pc = info.pc;
+  for (const auto &insn : info.insns) {
+    lifter.lift(insn, pc);
+    pc += insn.size();
+  }
+
+  if (block.insts.empty() || block.insts.back().op != Op::kExit) {
+    const auto next = block.append(Inst{.op = Op::kConst, .imm = pc});
+    block.append(Inst{.op = Op::kExit, .args = {next}});
+  }
+  return block;
+}
+} // namespace prot::gir
@@ -0,0 +1,267 @@
+#include "prot/jit/gir.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+
+namespace prot::gir {
+namespace {
+// sp in standard calling convention
+constexpr isa::Operand kStackReg = 2;
+
+// Replaces args w/ values they are forwarded to, inst is visited after all
+// defs of its args
+void remapArgs(Inst &inst, const std::vector<Value> &map) {
+  for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+    inst.args[idx] = map[inst.args[idx]];
+  }
+}
+
+// Guest address as base value & constant offset, base is kNoValue for
+// constant addresses
+struct Location final {
+  Value base{kNoValue};
+  isa::Word offset{};
+};
+
+Location locate(const Block &block, Value addr) {
+  const auto &inst = block[addr];
+  if (inst.op == Op::kConst) {
+    return Location{.offset = inst.imm};
+  }
+  if (inst.op == Op::kAdd && block[inst.args[1]].op == Op::kConst) {
+    const auto &base = block[inst.args[0]];
+    const auto offset = block[inst.args[1]].imm;
+    if (base.op == Op::kConst) {
+      return Location{.offset = base.imm + offset};
+    }
+    return Location{.base = inst.args[0], .offset = offset};
+  }
+  return Location{.base = addr};
+}
+
+// Memory contents known from earlier access
+struct Access final {
+  Location loc;
+  std::uint8_t size{};
+  bool sext{};
+  Value val{};
+
+  [[nodiscard]] bool overlaps(const Location &other,
+                              std::uint8_t otherSize) const {
+    // Offsets wrap around like guest addresses do
+    return other.base == loc.base && (other.offset - loc.offset < size ||
+                                      loc.offset - other.offset < otherSize);
+  }
+};
+} // namespace
+
+void forwardRegs(Block &block) {
+  std::vector<Value> map(block.insts.size());
+  std::array<Value, CPUState::kNumRegs> known{};
+  known.fill(kNoValue);
+
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    auto &inst = block[val];
+    remapArgs(inst, map);
+    map[val] = val;
+
+    switch (inst.op) {
+    case Op::kGetReg:
+      if (known[inst.reg] != kNoValue) {
+        map[val] = known[inst.reg];
+        inst = Inst{};
+      } else {
+        known[inst.reg] = val;
+      }
+      break;
+    case Op::kSetReg:
+      known[inst.reg] = inst.args[0];
+      break;
+    case Op::kSyscall:
+      known.fill(kNoValue);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void forwardMemory(Block &block) {
+  std::vector<Value> map(block.insts.size());
+  std::vector<Access> known;
+
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    auto &inst = block[val];
+    remapArgs(inst, map);
+    map[val] = val;
+
+    switch (inst.op) {
+    case Op::kLoad: {
+      const auto loc = locate(block, inst.args[0]);
+      const auto found = std::ranges::find_if(known, [&](const Access &acc) {
+        return acc.loc.base == loc.base && acc.loc.offset == loc.offset &&
+               acc.size == inst.size && acc.sext == inst.sext;
+      });
+      if (found != known.end()) {
+        map[val] = found->val;
+        inst = Inst{};
+      } else {
+        known.push_back(Access{
+            .loc = loc, .size = inst.size, .sext = inst.sext, .val = val});
+      }
+      break;
+    }
+    case Op::kStore: {
+      // Accesses via other bases may alias stored bytes
+      const auto loc = locate(block, inst.args[0]);
+      std::erase_if(known, [&](const Access &acc) {
+        return acc.loc.base != loc.base || acc.overlaps(loc, inst.size);
+      });
+      // Narrow loads would need truncation of stored value
+      if (inst.size == sizeof(isa::Word)) {
+        known.push_back(Access{
+            .loc = loc, .size = inst.size, .sext = false, .val = inst.args[1]});
+      }
+      break;
+    }
+    case Op::kSyscall:
+      known.clear();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void mapStackAccesses(Block &block, const engine::StackMapping &stack) {
+  constexpr std::uint64_t kSpace = std::uint64_t{1} << 32U;
+  const auto &range = stack.range;
+  if (stack.hostBase == nullptr || range.size == 0 ||
+      range.start + range.size > kSpace) {
+    return;
+  }
+
+  // Offsets from sp value at block entry, they wrap like guest addresses
+  std::vector<std::optional<std::int64_t>> offsets(block.insts.size());
+  std::int64_t low = std::numeric_limits<std::int64_t>::max();
+  std::int64_t high = std::numeric_limits<std::int64_t>::min();
+  bool spChanged = false;
+  bool found = false;
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    switch (inst.op) {
+    case Op::kGetReg:
+      if (inst.reg == kStackReg && !spChanged) {
+        offsets[val] = 0;
+      }
+      break;
+    case Op::kSetReg:
+      spChanged = spChanged || inst.reg == kStackReg;
+      break;
+    case Op::kSyscall:
+      spChanged = true;
+      break;
+    case Op::kAdd:
+      if (offsets[inst.args[0]] && block[inst.args[1]].op == Op::kConst) {
+        const auto imm = static_cast<std::int32_t>(block[inst.args[1]].imm);
+        offsets[val] = *offsets[inst.args[0]] + imm;
+      }
+      break;
+    case Op::kLoad:
+    case Op::kStore:
+      if (const auto &offset = offsets[inst.args[0]]) {
+        low = std::min(low, *offset);
+        high = std::max(high, *offset + inst.size);
+        found = true;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if (!found) {
+    return;
+  }
+
+  const auto span = static_cast<std::uint64_t>(high - low);
+  if (span > range.size) {
+    return;
+  }
+
+  // Accesses hit the stack iff sp + low - start <= size - span, so the whole
+  // check is a single unsigned compare
+  Block res{block};
+  res.insts.clear();
+  res.insts.reserve(block.insts.size() + 6);
+  const auto sp = res.append(Inst{.op = Op::kGetReg, .reg = kStackReg});
+  const auto bias = res.append(Inst{
+      .op = Op::kConst,
+      .imm = static_cast<isa::Word>(low - static_cast<std::int64_t>(
+                                              range.start))});
+  const auto first = res.append(
+      Inst{.op = Op::kAdd, .args = {sp, bias, kNoValue}});
+  const auto limit = res.append(Inst{
+      .op = Op::kConst, .imm = static_cast<isa::Word>(range.size - span + 1)});
+  const auto inside = res.append(Inst{
+      .op = Op::kCmp, .cond = Cond::kLtu, .args = {first, limit, kNoValue}});
+  res.append(Inst{.op = Op::kGuard, .args = {inside}});
+  res.stackBase = stack.hostBase;
+
+  std::vector<Value> map(block.insts.size(), kNoValue);
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    auto inst = block[val];
+    if (inst.op == Op::kGetReg && offsets[val]) {
+      map[val] = sp;
+      continue;
+    }
+    if (inst.op == Op::kLoad || inst.op == Op::kStore) {
+      inst.stack = offsets[inst.args[0]].has_value();
+    }
+    remapArgs(inst, map);
+    map[val] = res.append(inst);
+  }
+  block = std::move(res);
+}
+
+void eliminateDeadCode(Block &block) {
+  std::vector<std::size_t> uses(block.insts.size());
+  for (const auto &inst : block.insts) {
+    for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+      ++uses[inst.args[idx]];
+    }
+  }
+
+  // Uses come after defs, so single backward walk frees whole dead chains
+  for (auto val = static_cast<Value>(block.insts.size()); val-- != 0;) {
+    auto &inst = block[val];
+    if (!inst.isPure() || uses[val] != 0) {
+      continue;
+    }
+    for (std::size_t idx = 0; idx < inst.numArgs(); ++idx) {
+      --uses[inst.args[idx]];
+    }
+    inst = Inst{};
+  }
+}
+
+void compact(Block &block) {
+  std::vector<Value> map(block.insts.size(), kNoValue);
+  std::vector<Inst> insts;
+  insts.reserve(block.insts.size());
+
+  for (Value val = 0; val < block.insts.size(); ++val) {
+    auto inst = block[val];
+    if (inst.op == Op::kNop) {
+      continue;
+    }
+    remapArgs(inst, map);
+    map[val] = static_cast<Value>(insts.size());
+    insts.push_back(inst);
+  }
+  block.insts = std::move(insts);
+}
+} // namespace prot::gir
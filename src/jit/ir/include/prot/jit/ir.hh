@@ -6,7 +6,8 @@
 #include "prot/jit/base.hh"
 
 namespace prot::engine {
-std::unique_ptr<Translator> makeIrJit();
+std::unique_ptr<Translator>
+makeIrJit(const TranslatorOptions &options = {});
 }
 
 #endif // PROT_JIT_IR_HH_INCLUDED
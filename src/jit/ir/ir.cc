@@ -4,311 +4,448 @@ extern "C" {
 }
 
 #include "prot/jit/base.hh"
+#include "prot/jit/gir.hh"
+#include "prot/jit/ir.hh"
+
+#include <array>
+#include <cassert>
 #include <cstdint>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
-#include <unordered_map>
+#include <vector>
+
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+
+extern "C" {
+#include <sys/mman.h>
+}
 
 namespace prot::engine {
 namespace {
 
-#define PROT_IR_COMP_R_OP(OP, IR_OP)                                           \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref rs2 = loadReg(insn.rs2());                                          \
-    setDst(insn.rd(), ir_ZEXT_U32(IR_OP(rs1, rs2)));                           \
-    break;                                                                     \
-  }
+using JitFunction = void (*)(CPUState &);
 
-#define PROT_IR_COMP_I_OP(OP, IR_OP)                                           \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref imm = ir_CONST_I32(insn.imm());                                     \
-    setDst(insn.rd(), ir_ZEXT_U32(IR_OP(rs1, imm)));                           \
-    break;                                                                     \
-  }
+template <typename T> void storeHelper(CPUState &state, isa::Addr addr, T val) {
+  state.memory->write(addr, val);
+}
+template <typename T> T loadHelper(CPUState &state, isa::Addr addr) {
+  return state.memory->read<T>(addr);
+}
+void syscallHelper(CPUState &state) { state.emulateSysCall(); }
 
-#define PROT_IR_SHIFT_R_OP(OP, IR_OP)                                          \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref shamt = ir_AND_U32(loadReg(insn.rs2()), ir_CONST_U32(0x1F));        \
-    setDst(insn.rd(), IR_OP(rs1, shamt));                                      \
-    break;                                                                     \
-  }
+enum class Helper : std::uint8_t {
+  kLoadWord,
+  kLoadHalf,
+  kLoadUHalf,
+  kLoadByte,
+  kLoadUByte,
+  kStoreWord,
+  kStoreHalf,
+  kStoreByte,
+  kSyscall,
+  kNum
+};
+
+// Helper addresses are ctx constants, each one is created on first use
+class Helpers final {
+public:
+  explicit Helpers(ir_ctx *ctx) : m_ctx(ctx) {}
 
-#define PROT_IR_SHIFT_I_OP(OP, IR_OP)                                          \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref shamt = ir_CONST_U32(insn.imm());                                   \
-    setDst(insn.rd(), IR_OP(rs1, shamt));                                      \
-    break;                                                                     \
+  [[nodiscard]] ir_ref get(Helper helper) {
+    auto &ref = m_refs[static_cast<std::size_t>(helper)];
+    if (ref == IR_UNUSED) {
+      ref = create(helper);
+    }
+    return ref;
   }
 
-#define PROT_IR_SHIFT_OP(OP, IR_OP)                                            \
-  PROT_IR_R_OP(OP, IR_OP)                                                      \
-  PROT_IR_I_OP(OP##I, IR_OP)
+private:
+  [[nodiscard]] ir_ref create(Helper helper);
 
-#define PROT_IR_R_OP(OP, IR_OP)                                                \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref rs2 = loadReg(insn.rs2());                                          \
-    setDst(insn.rd(), IR_OP(rs1, rs2));                                        \
-    break;                                                                     \
-  }
+  ir_ctx *m_ctx;
+  std::array<ir_ref, static_cast<std::size_t>(Helper::kNum)> m_refs{};
+};
 
-#define PROT_IR_I_OP(OP, IR_OP)                                                \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref imm = ir_CONST_I32(insn.imm());                                     \
-    setDst(insn.rd(), IR_OP(rs1, imm));                                        \
-    break;                                                                     \
-  }
+ir_ref Helpers::create(Helper helper) {
+  auto makeFunc = [this](auto *func, ir_ref proto) {
+    return ir_const_func_addr(m_ctx, reinterpret_cast<uintptr_t>(func), proto);
+  };
+  auto makeLoad = [&](auto *func, ir_type type) {
+    return makeFunc(func,
+                    ir_proto_2(m_ctx, IR_CC_DEFAULT, type, IR_ADDR, IR_U32));
+  };
+  auto makeStore = [&](auto *func, ir_type type) {
+    return makeFunc(func, ir_proto_3(m_ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR,
+                                     IR_U32, type));
+  };
 
-#define PROT_IR_STORE_OP(OP, FUNC, IR_OP)                                      \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref addr = ir_ADD_U32(rs1, ir_CONST_I32(insn.imm()));                   \
-    ir_ref val = loadReg(insn.rs2());                                          \
-    ir_CALL_3(IR_VOID, m_func_proto_map[FUNC], state_ptr, addr, IR_OP(val));   \
-    break;                                                                     \
+  switch (helper) {
+  case Helper::kLoadWord:
+    return makeLoad(loadHelper<isa::Word>, IR_U32);
+  case Helper::kLoadHalf:
+    return makeLoad(loadHelper<isa::Half>, IR_I16);
+  case Helper::kLoadUHalf:
+    return makeLoad(loadHelper<isa::Half>, IR_U16);
+  case Helper::kLoadByte:
+    return makeLoad(loadHelper<isa::Byte>, IR_I8);
+  case Helper::kLoadUByte:
+    return makeLoad(loadHelper<isa::Byte>, IR_U8);
+  case Helper::kStoreWord:
+    return makeStore(storeHelper<isa::Word>, IR_U32);
+  case Helper::kStoreHalf:
+    return makeStore(storeHelper<isa::Half>, IR_I16);
+  case Helper::kStoreByte:
+    return makeStore(storeHelper<isa::Byte>, IR_I8);
+  case Helper::kSyscall:
+    return makeFunc(syscallHelper,
+                    ir_proto_1(m_ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR));
+  case Helper::kNum:
+    break;
   }
+  throw std::invalid_argument{"Unexpected helper id"};
+}
 
-#define PROT_IR_LOAD_OP(OP, FUNC, TYPE, IR_OP)                                 \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref addr = ir_ADD_U32(rs1, ir_CONST_I32(insn.imm()));                   \
-    ir_ref val =                                                               \
-        IR_OP(ir_CALL_2(TYPE, m_func_proto_map[FUNC], state_ptr, addr));       \
-    setDst(insn.rd(), val);                                                    \
-    break;                                                                     \
+// Code of all blocks is emitted one after another into big chunks, which
+// stay executable except while a block is being emitted
+class CodeBuffer final {
+public:
+  static constexpr std::size_t kChunkSize = std::size_t{16} << 20;
+  // Limit on code of a single block, see IRJit::kInsnsLimit
+  static constexpr std::size_t kMaxCodeSize = std::size_t{1} << 20;
+
+  // Returned buffer has at least kMaxCodeSize free bytes & is writable
+  // till close()
+  [[nodiscard]] ir_code_buffer *open();
+  void close();
+
+  // Bytes of emitted code, incl. used part of the current chunk
+  [[nodiscard]] std::size_t size() const {
+    if (m_chunks.empty()) {
+      return 0;
+    }
+    return m_size + static_cast<std::size_t>(
+                        static_cast<const std::byte *>(m_buf.pos) -
+                        static_cast<const std::byte *>(m_buf.start));
   }
 
-#define PROT_IR_ALU_OP(OP, MIR_OP)                                             \
-  PROT_IR_R_OP(OP, MIR_OP)                                                     \
-  PROT_IR_I_OP(OP##I, MIR_OP)
-
-#define PROT_IR_B_COND_OP(OP, COND)                                            \
-  case k##OP: {                                                                \
-    ir_ref rs1 = loadReg(insn.rs1());                                          \
-    ir_ref rs2 = loadReg(insn.rs2());                                          \
-    pc = ir_COND_U32(COND(rs1, rs2), ir_ADD_U32(pc, ir_CONST_U32(insn.imm())), \
-                     ir_ADD_U32(pc, ir_CONST_U32(isa::kWordSize)));            \
-    break;                                                                     \
-  }
+private:
+  struct Unmap final {
+    void operator()(std::byte *ptr) const noexcept {
+      [[maybe_unused]] auto res = ::munmap(ptr, kChunkSize);
+      assert(res != -1);
+    }
+  };
 
-using JitFunction = void (*)(CPUState &);
+  void protect(int prot) const;
 
-template <typename T> void storeHelper(CPUState &state, isa::Addr addr, T val) {
-  state.memory->write(addr, val);
+  std::vector<std::unique_ptr<std::byte, Unmap>> m_chunks;
+  ir_code_buffer m_buf{};
+  // Bytes taken by all chunks but the current one
+  std::size_t m_size{};
+};
+
+ir_code_buffer *CodeBuffer::open() {
+  auto *pos = static_cast<std::byte *>(m_buf.pos);
+  if (m_chunks.empty() ||
+      static_cast<std::size_t>(static_cast<std::byte *>(m_buf.end) - pos) <
+          kMaxCodeSize) {
+    // NOLINTNEXTLINE
+    auto *ptr = ::mmap(NULL, kChunkSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      throw std::runtime_error{
+          fmt::format("Failed to allocate {} bytes for code", kChunkSize)};
+    }
+
+    if (!m_chunks.empty()) {
+      m_size += pos - static_cast<std::byte *>(m_buf.start);
+    }
+    auto &chunk = m_chunks.emplace_back(static_cast<std::byte *>(ptr));
+    m_buf.start = chunk.get();
+    m_buf.pos = chunk.get();
+    m_buf.end = chunk.get() + kChunkSize;
+    return &m_buf;
+  }
+
+  protect(PROT_READ | PROT_WRITE);
+  return &m_buf;
 }
-template <typename T> T loadHelper(CPUState &state, isa::Addr addr) {
-  return state.memory->read<T>(addr);
+
+void CodeBuffer::close() { protect(PROT_READ | PROT_EXEC); }
+
+void CodeBuffer::protect(int prot) const {
+  if (::mprotect(m_buf.start, kChunkSize, prot) == -1) {
+    throw std::runtime_error{"Failed to change protection"};
+  }
 }
-void syscallHelper(CPUState &state) { state.emulateSysCall(); }
 
-class IRJit : public Translator {
+class IRJit final : public GirTranslator {
 public:
-  static constexpr std::size_t kOptLevel = 2;
+  // IR opt level for each translator tier
+  static constexpr std::array kOptLevels{0, 1, 2, 2};
   static constexpr std::size_t kConstsLimit = 1024;
   static constexpr std::size_t kInsnsLimit = 4096;
 
+  explicit IRJit(const TranslatorOptions &options)
+      : GirTranslator{options}, m_optLevel(kOptLevels.at(options.optLevel)) {}
+
 private:
-  [[nodiscard]] JitFunction translate(const BBInfo &info) override;
-  void run(ir_ctx *ctx, const BBInfo &info);
+  [[nodiscard]] JitFunction lower(const gir::Block &block) override;
+  void run(ir_ctx *ctx, const gir::Block &block);
 
-  void registerHelpers(ir_ctx *ctx);
+  void dumpStats(std::ostream &ost) const override {
+    m_stats.dump(ost);
+    fmt::print(ost, "code buffer: {} bytes\n", m_code.size());
+  }
 
-  std::unordered_map<std::string, ir_ref> m_func_proto_map;
+  int m_optLevel{};
+  CodeBuffer m_code;
+  CompileStats m_stats;
 };
 
-void IRJit::registerHelpers(ir_ctx *ctx) {
-
-  ir_ref proto_lw = ir_proto_2(ctx, IR_CC_DEFAULT, IR_U32, IR_ADDR, IR_U32);
-  m_func_proto_map["loadHelperWord"] = proto_lw;
-  m_func_proto_map["loadHelperWord_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(loadHelper<isa::Word>), proto_lw);
-
-  ir_ref proto_lh = ir_proto_2(ctx, IR_CC_DEFAULT, IR_I16, IR_ADDR, IR_U32);
-  m_func_proto_map["loadHelperHalf"] = proto_lh;
-  m_func_proto_map["loadHelperHalf_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(loadHelper<isa::Half>), proto_lh);
-
-  ir_ref proto_lb = ir_proto_2(ctx, IR_CC_DEFAULT, IR_I8, IR_ADDR, IR_U32);
-  m_func_proto_map["loadHelperByte"] = proto_lb;
-  m_func_proto_map["loadHelperByte_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(loadHelper<isa::Byte>), proto_lb);
-
-  ir_ref proto_lhu = ir_proto_2(ctx, IR_CC_DEFAULT, IR_U16, IR_ADDR, IR_U32);
-  m_func_proto_map["loadHelperUHalf"] = proto_lhu;
-  m_func_proto_map["loadHelperUHalf_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(loadHelper<isa::Half>), proto_lhu);
-
-  ir_ref proto_lbu = ir_proto_2(ctx, IR_CC_DEFAULT, IR_U8, IR_ADDR, IR_U32);
-  m_func_proto_map["loadHelperUByte"] = proto_lbu;
-  m_func_proto_map["loadHelperUByte_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(loadHelper<isa::Byte>), proto_lbu);
-
-  ir_ref proto_sw =
-      ir_proto_3(ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR, IR_U32, IR_U32);
-  m_func_proto_map["storeHelperWord"] = proto_sw;
-  m_func_proto_map["storeHelperWord_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(storeHelper<isa::Word>), proto_sw);
-
-  ir_ref proto_sh =
-      ir_proto_3(ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR, IR_U32, IR_I16);
-  m_func_proto_map["storeHelperHalf"] = proto_sh;
-  m_func_proto_map["storeHelperHalf_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(storeHelper<isa::Half>), proto_sh);
-
-  ir_ref proto_sb =
-      ir_proto_3(ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR, IR_U32, IR_I8);
-  m_func_proto_map["storeHelperByte"] = proto_sb;
-  m_func_proto_map["storeHelperByte_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(storeHelper<isa::Byte>), proto_sb);
-
-  ir_ref proto_ecall = ir_proto_1(ctx, IR_CC_DEFAULT, IR_VOID, IR_ADDR);
-  m_func_proto_map["syscallHelper"] = proto_ecall;
-  m_func_proto_map["syscallHelper_func"] = ir_const_func_addr(
-      ctx, reinterpret_cast<uintptr_t>(syscallHelper), proto_ecall);
-}
+void IRJit::run(ir_ctx *ctx, const gir::Block &block) {
+  Helpers helpers{ctx};
 
-void IRJit::run(ir_ctx *ctx, const BBInfo &info) {
   ir_START();
   ir_ref state_ptr = ir_PARAM(IR_ADDR, "state", 1);
 
-  ir_ref pc = ir_LOAD_U32(ir_ADD_OFFSET(state_ptr, offsetof(CPUState, pc)));
-
   auto regAddr = [&](uint32_t reg) {
     return ir_ADD_OFFSET(state_ptr,
                          offsetof(CPUState, regs) + isa::kWordSize * reg);
   };
-  auto loadReg = [&](uint32_t reg) -> ir_ref {
-    if (reg == 0)
-      return ir_CONST_U32(0);
-    return ir_LOAD_U32(regAddr(reg));
+
+  // Comparisons are kept as bools, they are extended only if used as values
+  std::vector<ir_ref> refs(block.insts.size(), IR_UNUSED);
+  std::vector<ir_ref> conds(block.insts.size(), IR_UNUSED);
+  auto value = [&](gir::Value val) {
+    auto &ref = refs[val];
+    if (ref == IR_UNUSED) {
+      assert(conds[val] != IR_UNUSED);
+      ref = ir_ZEXT_U32(conds[val]);
+    }
+    return ref;
   };
-  auto setDst = [&](uint32_t rd, ir_ref val) {
-    if (rd != 0)
-      ir_STORE(regAddr(rd), val);
+  auto cond = [&](gir::Value val) {
+    if (conds[val] == IR_UNUSED) {
+      conds[val] = ir_NE(value(val), ir_CONST_U32(0));
+    }
+    return conds[val];
   };
-
-  for (const auto &insn : info.insns) {
-    switch (insn.opcode()) {
-      using enum isa::Opcode;
-
-      PROT_IR_ALU_OP(ADD, ir_ADD_U32)
-      PROT_IR_ALU_OP(AND, ir_AND_U32)
-      PROT_IR_ALU_OP(OR, ir_OR_U32)
-      PROT_IR_ALU_OP(XOR, ir_XOR_U32)
-
-      PROT_IR_R_OP(SUB, ir_SUB_U32)
-
-      PROT_IR_SHIFT_OP(SLL, ir_SHL_U32)
-      PROT_IR_SHIFT_OP(SRL, ir_SHR_U32)
-      PROT_IR_SHIFT_OP(SRA, ir_SAR_U32)
-
-      PROT_IR_COMP_R_OP(SLT, ir_LT)
-      PROT_IR_COMP_R_OP(SLTU, ir_ULT)
-
-      PROT_IR_COMP_I_OP(SLTI, ir_LT)
-      PROT_IR_COMP_I_OP(SLTIU, ir_ULT)
-
-      PROT_IR_B_COND_OP(BEQ, ir_EQ)
-      PROT_IR_B_COND_OP(BNE, ir_NE)
-      PROT_IR_B_COND_OP(BLT, ir_LT)
-      PROT_IR_B_COND_OP(BGE, ir_GE)
-      PROT_IR_B_COND_OP(BLTU, ir_ULT)
-      PROT_IR_B_COND_OP(BGEU, ir_UGE)
-
-      PROT_IR_LOAD_OP(LB, "loadHelperByte_func", IR_I8, ir_SEXT_U32)
-      PROT_IR_LOAD_OP(LH, "loadHelperHalf_func", IR_I16, ir_SEXT_U32)
-      PROT_IR_LOAD_OP(LW, "loadHelperWord_func", IR_I32, ir_SEXT_U32)
-      PROT_IR_LOAD_OP(LBU, "loadHelperUByte_func", IR_U8, ir_ZEXT_U32)
-      PROT_IR_LOAD_OP(LHU, "loadHelperUHalf_func", IR_U16, ir_ZEXT_U32)
-
-      PROT_IR_STORE_OP(SB, "storeHelperByte_func", ir_TRUNC_I8)
-      PROT_IR_STORE_OP(SH, "storeHelperHalf_func", ir_TRUNC_I16)
-      PROT_IR_STORE_OP(SW, "storeHelperWord_func", ir_TRUNC_I32)
-
-    case kJAL: {
-      ir_ref ret_addr = ir_ADD_U32(pc, ir_CONST_U32(isa::kWordSize));
-      setDst(insn.rd(), ret_addr);
-      pc = ir_ADD_U32(pc, ir_CONST_U32(insn.imm()));
+  auto shamt = [&](gir::Value val) {
+    if (const auto &inst = block[val]; inst.op == gir::Op::kConst) {
+      return ir_CONST_U32(isa::slice<4, 0>(inst.imm));
+    }
+    return ir_AND_U32(value(val), ir_CONST_U32(0x1F));
+  };
+  auto compare = [&](gir::Cond kind, ir_ref lhs, ir_ref rhs) {
+    switch (kind) {
+    case gir::Cond::kEq:
+      return ir_EQ(lhs, rhs);
+    case gir::Cond::kNe:
+      return ir_NE(lhs, rhs);
+    case gir::Cond::kLt:
+      return ir_LT(lhs, rhs);
+    case gir::Cond::kGe:
+      return ir_GE(lhs, rhs);
+    case gir::Cond::kLtu:
+      return ir_ULT(lhs, rhs);
+    case gir::Cond::kGeu:
+      return ir_UGE(lhs, rhs);
+    }
+    throw std::invalid_argument("Unexpected GIR cond");
+  };
+  // Direct stack access: zero extended guest address plus host base
+  auto stackAddr = [&](ir_ref addr) {
+    return ir_ADD_A(
+        ir_CONST_ADDR(reinterpret_cast<std::uintptr_t>(block.stackBase)),
+        ir_ZEXT_A(addr));
+  };
+  auto loadStack = [&](const gir::Inst &inst, ir_ref addr) {
+    const auto ptr = stackAddr(addr);
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      return inst.sext ? ir_SEXT_U32(ir_LOAD_I8(ptr))
+                       : ir_ZEXT_U32(ir_LOAD_U8(ptr));
+    case sizeof(isa::Half):
+      return inst.sext ? ir_SEXT_U32(ir_LOAD_I16(ptr))
+                       : ir_ZEXT_U32(ir_LOAD_U16(ptr));
+    default:
+      return ir_LOAD_U32(ptr);
+    }
+  };
+  auto storeStack = [&](const gir::Inst &inst, ir_ref addr, ir_ref val) {
+    const auto ptr = stackAddr(addr);
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      ir_STORE(ptr, ir_TRUNC_I8(val));
       break;
+    case sizeof(isa::Half):
+      ir_STORE(ptr, ir_TRUNC_I16(val));
+      break;
+    default:
+      ir_STORE(ptr, val);
+      break;
+    }
+  };
+  auto load = [&](const gir::Inst &inst, ir_ref addr) {
+    if (inst.stack) {
+      return loadStack(inst, addr);
     }
-    case kJALR: {
-      ir_ref ret_addr = ir_ADD_U32(pc, ir_CONST_U32(isa::kWordSize));
-      setDst(insn.rd(), ret_addr);
-      ir_ref rs1 = loadReg(insn.rs1());
-      ir_ref target = ir_ADD_U32(rs1, ir_CONST_I32(insn.imm()));
-      pc = ir_AND_U32(target, ir_CONST_U32(~1U));
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      return inst.sext ? ir_SEXT_U32(ir_CALL_2(IR_I8,
+                                               helpers.get(Helper::kLoadByte),
+                                               state_ptr, addr))
+                       : ir_ZEXT_U32(ir_CALL_2(IR_U8,
+                                               helpers.get(Helper::kLoadUByte),
+                                               state_ptr, addr));
+    case sizeof(isa::Half):
+      return inst.sext ? ir_SEXT_U32(ir_CALL_2(IR_I16,
+                                               helpers.get(Helper::kLoadHalf),
+                                               state_ptr, addr))
+                       : ir_ZEXT_U32(ir_CALL_2(IR_U16,
+                                               helpers.get(Helper::kLoadUHalf),
+                                               state_ptr, addr));
+    default:
+      return ir_CALL_2(IR_U32, helpers.get(Helper::kLoadWord), state_ptr,
+                       addr);
+    }
+  };
+  auto store = [&](const gir::Inst &inst, ir_ref addr, ir_ref val) {
+    if (inst.stack) {
+      storeStack(inst, addr, val);
+      return;
+    }
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      ir_CALL_3(IR_VOID, helpers.get(Helper::kStoreByte), state_ptr, addr,
+                ir_TRUNC_I8(val));
+      break;
+    case sizeof(isa::Half):
+      ir_CALL_3(IR_VOID, helpers.get(Helper::kStoreHalf), state_ptr, addr,
+                ir_TRUNC_I16(val));
+      break;
+    default:
+      ir_CALL_3(IR_VOID, helpers.get(Helper::kStoreWord), state_ptr, addr,
+                val);
       break;
     }
+  };
 
-    case kLUI: {
-      setDst(insn.rd(), ir_CONST_U32(insn.imm()));
+  for (gir::Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    const auto &args = inst.args;
+    switch (inst.op) {
+    case gir::Op::kConst:
+      refs[val] = ir_CONST_U32(inst.imm);
       break;
-    }
-    case kAUIPC: {
-      ir_ref res = ir_ADD_U32(pc, ir_CONST_U32(insn.imm()));
-      setDst(insn.rd(), res);
+    case gir::Op::kGetReg:
+      refs[val] = ir_LOAD_U32(regAddr(inst.reg));
       break;
-    }
-    case kECALL: {
-      ir_CALL_1(IR_VOID, m_func_proto_map["syscallHelper_func"], state_ptr);
+    case gir::Op::kSetReg:
+      ir_STORE(regAddr(inst.reg), value(args[0]));
       break;
-    }
 
-    case kFENCE:
-    case kEBREAK:
-    case kPAUSE:
-    case kSBREAK:
-    case kSCALL:
+    case gir::Op::kAdd:
+      refs[val] = ir_ADD_U32(value(args[0]), value(args[1]));
       break;
-    case kNumOpcodes:
-      throw std::invalid_argument("Unexpected insn id");
-    default:
+    case gir::Op::kSub:
+      refs[val] = ir_SUB_U32(value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kAnd:
+      refs[val] = ir_AND_U32(value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kOr:
+      refs[val] = ir_OR_U32(value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kXor:
+      refs[val] = ir_XOR_U32(value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kShl:
+      refs[val] = ir_SHL_U32(value(args[0]), shamt(args[1]));
+      break;
+    case gir::Op::kShr:
+      refs[val] = ir_SHR_U32(value(args[0]), shamt(args[1]));
+      break;
+    case gir::Op::kSar:
+      refs[val] = ir_SAR_U32(value(args[0]), shamt(args[1]));
+      break;
+
+    case gir::Op::kCmp:
+      conds[val] = compare(inst.cond, value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kSelect:
+      refs[val] =
+          ir_COND_U32(cond(args[0]), value(args[1]), value(args[2]));
       break;
-    }
 
-    if (!isa::changesPC(insn.opcode())) {
-      pc = ir_ADD_U32(pc, ir_CONST_U32(isa::kWordSize));
+    case gir::Op::kLoad:
+      refs[val] = load(inst, value(args[0]));
+      break;
+    case gir::Op::kStore:
+      store(inst, value(args[0]), value(args[1]));
+      break;
+    case gir::Op::kSyscall:
+      ir_CALL_1(IR_VOID, helpers.get(Helper::kSyscall), state_ptr);
+      break;
+    case gir::Op::kGuard: {
+      // Nothing is written yet, so plain return leaves state intact
+      const auto check = ir_IF(cond(args[0]));
+      ir_IF_FALSE_cold(check);
+      ir_RETURN(IR_UNUSED);
+      ir_IF_TRUE(check);
+      break;
+    }
+    case gir::Op::kExit:
+      ir_STORE(ir_ADD_OFFSET(state_ptr, offsetof(CPUState, pc)),
+               value(args[0]));
+      break;
+    case gir::Op::kNop:
+      break;
     }
   }
 
-  ir_STORE(ir_ADD_OFFSET(state_ptr, offsetof(CPUState, pc)), pc);
-
   ir_ref icount =
       ir_LOAD_U64(ir_ADD_OFFSET(state_ptr, offsetof(CPUState, icount)));
-  icount = ir_ADD_U64(icount, ir_CONST_U32(info.insns.size()));
+  icount = ir_ADD_U64(icount, ir_CONST_U32(block.icount));
   ir_STORE(ir_ADD_OFFSET(state_ptr, offsetof(CPUState, icount)), icount);
 
   ir_RETURN(IR_UNUSED);
 }
 
-JitFunction IRJit::translate(const BBInfo &info) {
+JitFunction IRJit::lower(const gir::Block &block) {
   ir_ctx ctx;
 
-  ir_init(&ctx, IR_FUNCTION | IR_OPT_FOLDING | IR_OPT_CFG | IR_OPT_CODEGEN,
-          kConstsLimit, kInsnsLimit);
-
-  registerHelpers(&ctx);
-
-  run(&ctx, info);
+  // Folding is not supported at opt level 0
+  const auto flags =
+      m_optLevel == 0
+          ? IR_FUNCTION
+          : IR_FUNCTION | IR_OPT_FOLDING | IR_OPT_CFG | IR_OPT_CODEGEN;
+  m_stats.measure("ir-build", [&] {
+    ir_init(&ctx, flags, kConstsLimit, kInsnsLimit);
+    run(&ctx, block);
+  });
+
+  ctx.code_buffer = m_code.open();
+  size_t codeSize{};
+  void *nativeCode = m_stats.measure(
+      "codegen", [&] { return ir_jit_compile(&ctx, m_optLevel, &codeSize); });
+  m_code.close();
+  ir_free(&ctx);
 
-  size_t codeSize;
-  void *nativeCode = ir_jit_compile(&ctx, kOptLevel, &codeSize);
   if (!nativeCode) {
     throw std::runtime_error("IR JIT compilation failed");
   }
-
-  ir_free(&ctx);
+  m_stats.addSize("code", static_cast<std::ptrdiff_t>(codeSize));
 
   return reinterpret_cast<JitFunction>(nativeCode);
 }
 
 } // namespace
 
-std::unique_ptr<Translator> makeIrJit() { return std::make_unique<IRJit>(); }
+std::unique_ptr<Translator> makeIrJit(const TranslatorOptions &options) {
+  return std::make_unique<IRJit>(options);
+}
 } // namespace prot::engine
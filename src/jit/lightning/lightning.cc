@@ -101,16 +101,16 @@ JitFunction Lightning::translate(const BBInfo &info) {
     jit_stxi_i(getRegOff(rid), JIT_V0, JIT_R(reg));
   };
 
-  auto loadPC = [&](int reg) {
-    assert(reg < JIT_R_NUM);
-    jit_ldxi_ui(JIT_R(reg), JIT_V0, offsetof(CPUState, pc));
-  };
   auto storePC = [&](int reg) {
     assert(reg < JIT_R_NUM);
     jit_stxi_i(offsetof(CPUState, pc), JIT_V0, JIT_R(reg));
   };
 
-  for (const auto &insn : info.insns) {
+  // PC is constant for translated block, so it is written only by control
+  // flow insns or at the very end. Lightning selects host insns itself
+  auto pc = info.pc;
+  const auto insns = simplifyInsns(info.insns);
+  for (const auto &insn : insns) {
     // jit_note(insn.mnemonic().data(), i++);
     std::make_unsigned_t<jit_word_t> sextImm = insn.imm();
     sextImm = isa::signExtend<sizeofBits<decltype(sextImm)>(),
@@ -136,7 +136,21 @@ JitFunction Lightning::translate(const BBInfo &info) {
 
 #define PROT_MAKE_IMPL_SIMPLE(OP, op) PROT_MAKE_IMPL(OP, op##r, op##i)
 
-      PROT_MAKE_IMPL_SIMPLE(ADD, add)
+    case kADD:
+      loadRS1(0);
+      loadRS2(1);
+      jit_addr(JIT_R0, JIT_R0, JIT_R1);
+      storeRd(0);
+      break;
+    case kADDI:
+      // Register copy after peephole
+      loadRS1(0);
+      if (insn.imm() != 0) {
+        jit_addi(JIT_R0, JIT_R0, insn.imm());
+      }
+      storeRd(0);
+      break;
+
       PROT_MAKE_IMPL_SIMPLE(AND, and)
       PROT_MAKE_IMPL_SIMPLE(OR, or)
       PROT_MAKE_IMPL_SIMPLE(XOR, xor)
@@ -176,8 +190,8 @@ JitFunction Lightning::translate(const BBInfo &info) {
 #undef PROT_MAKE_SHIFT_IMPL
 #undef PROT_MAKE_IMPL
     case kAUIPC:
-      loadPC(0);
-      jit_addi(JIT_R0, JIT_R0, insn.imm());
+    case kLA:
+      jit_movi(JIT_R0, pc + insn.imm());
       storeRd(0);
       break;
 #define PROT_MAKE_BR(OP, cond)                                                 \
@@ -185,12 +199,10 @@ JitFunction Lightning::translate(const BBInfo &info) {
     loadRS1(0, true);                                                          \
     loadRS2(1, true);                                                          \
     jit_##cond(JIT_R0, JIT_R0, JIT_R1);                                        \
-    jit_movi(JIT_R1, sizeof(isa::Word));                                       \
-    jit_movi(JIT_R2, insn.imm());                                              \
+    jit_movi(JIT_R1, pc + sizeof(isa::Word));                                  \
+    jit_movi(JIT_R2, pc + insn.imm());                                         \
     jit_movzr(JIT_R2, JIT_R1, JIT_R0);                                         \
-    loadPC(0);                                                                 \
-    jit_addr(JIT_R0, JIT_R0, JIT_R2);                                          \
-    storePC(0);                                                                \
+    storePC(2);                                                                \
     break;
 
       PROT_MAKE_BR(EQ, eqr)
@@ -211,15 +223,13 @@ JitFunction Lightning::translate(const BBInfo &info) {
       break;
 
     case kJAL:
-      loadPC(0);
-      jit_addi(JIT_R1, JIT_R0, sizeof(isa::Word));
+      jit_movi(JIT_R1, pc + sizeof(isa::Word));
       storeRd(1);
-      jit_addi(JIT_R0, JIT_R0, insn.imm());
+      jit_movi(JIT_R0, pc + insn.imm());
       storePC(0);
       break;
     case kJALR:
-      loadPC(0);
-      jit_addi(JIT_R0, JIT_R0, sizeof(isa::Word));
+      jit_movi(JIT_R0, pc + sizeof(isa::Word));
       loadRS1(1);
       storeRd(0);
       jit_addi(JIT_R1, JIT_R1, insn.imm());
@@ -309,20 +319,48 @@ JitFunction Lightning::translate(const BBInfo &info) {
       jit_subr(JIT_R0, JIT_R0, JIT_R1);
       storeRd(0);
       break;
+
+    case kLI:
+      jit_movi(JIT_R0, insn.imm());
+      storeRd(0);
+      break;
+    case kLWPC:
+      jit_movi(JIT_R0, pc + insn.imm());
+      jit_prepare();
+      jit_pushargr(JIT_V0);
+      jit_pushargr(JIT_R0);
+      jit_finishi(reinterpret_cast<void *>(&loadHelper<isa::Word>));
+      jit_retval(JIT_R0);
+      storeRd(0);
+      break;
+    case kCALL:
+      jit_movi(JIT_R1, pc + insn.size());
+      storeRd(1);
+      jit_movi(JIT_R0, (pc + insn.imm()) & ~std::uint32_t{1});
+      storePC(0);
+      break;
+    case kSHADD:
+      loadRS1(0);
+      loadRS2(1);
+      jit_lshi(JIT_R0, JIT_R0, isa::slice<4, 0>(insn.imm()));
+      jit_addr(JIT_R0, JIT_R0, JIT_R1);
+      storeRd(0);
+      break;
+
     case kNumOpcodes:
       break;
     }
 
-    if (!isa::changesPC(insn.opcode())) {
-      loadPC(0);
-      jit_addi(JIT_R0, JIT_R0, sizeof(isa::Word));
-      storePC(0);
-    }
+    pc += insn.size();
+  }
+  if (!isa::changesPC(insns.back().opcode())) {
+    jit_movi(JIT_R0, pc);
+    storePC(0);
   }
-  // update icount
-  jit_ldxi_ui(JIT_R0, JIT_V0, offsetof(CPUState, icount));
-  jit_addi(JIT_R0, JIT_R0, info.insns.size());
-  jit_stxi_i(offsetof(CPUState, icount), JIT_V0, JIT_R0);
+  // update icount, it is 64 bit wide
+  jit_ldxi_l(JIT_R0, JIT_V0, offsetof(CPUState, icount));
+  jit_addi(JIT_R0, JIT_R0, info.icount);
+  jit_stxi_l(offsetof(CPUState, icount), JIT_V0, JIT_R0);
   jit_epilog();
 
   // fmt::println("CODE!!");
@@ -4,25 +4,40 @@
 #include "prot/isa.hh"
 #include "prot/memory.hh"
 
+#include <algorithm>
 #include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/ModRef.h>
 
 namespace prot::ll {
 namespace {
 struct InsnIRBuilder : public llvm::IRBuilder<> {
-  explicit InsnIRBuilder(llvm::Module &module)
-      : llvm::IRBuilder<>(module.getContext()) {}
+  explicit InsnIRBuilder(llvm::Module &module, std::byte *hostBase = nullptr)
+      : llvm::IRBuilder<>(module.getContext()), m_hostBase(hostBase) {}
 
   void build(const isa::Instruction &insn);
 
   llvm::Module *getModule() const { return GetInsertBlock()->getModule(); }
   llvm::Function *getFn() const { return GetInsertBlock()->getParent(); }
-  llvm::Value *getCpuStatePtr() const { return getFn()->getArg(0); }
+  // State accessed by generated code: the argument itself or its local copy
+  // which is promoted to SSA values (see translateRegion)
+  llvm::Value *getCpuStatePtr() const {
+    return m_state != nullptr ? m_state : getFn()->getArg(0);
+  }
+  void setCpuStatePtr(llvm::Value *state) { m_state = state; }
 
   llvm::Value *getReg(std::size_t idx) {
     auto *cpuState = getCpuStatePtr();
@@ -53,16 +68,42 @@ struct InsnIRBuilder : public llvm::IRBuilder<> {
 
   void generateLoad(const isa::Instruction &insn);
   void generateStore(const isa::Instruction &insn);
+  // Run of word accesses found by findAccessRun done as single host one
+  void generateAccessRun(std::span<const isa::Instruction> run);
+  [[nodiscard]] bool hasFlatMemory() const { return m_hostBase != nullptr; }
 
   template <typename T> llvm::Function *getLoadFn();
   template <typename T> llvm::Function *getStoreFn();
 
-  void advancePC();
+  // Guest memory access, inlined if memory is a flat host mapping
+  template <typename T> llvm::Value *loadMem(llvm::Value *addr);
+  template <typename T> void storeMem(llvm::Value *addr, llvm::Value *val);
+
+  llvm::Value *getPCPtr() {
+    return CreateStructGEP(getCPUStateType(), getCpuStatePtr(), 1);
+  }
+
+  void advancePC(isa::Word size);
+
+private:
+  llvm::Value *getHostPtr(llvm::Value *addr) {
+    auto *base = CreateIntToPtr(
+        getInt64(reinterpret_cast<std::uintptr_t>(m_hostBase)),
+        llvm::PointerType::getUnqual(getContext()));
+    return CreateGEP(getInt8Ty(), base, CreateZExt(addr, getInt64Ty()));
+  }
+
+  std::byte *m_hostBase{};
+  llvm::Value *m_state{};
 };
 
 struct CpuStateMethInfo final {
   llvm::Type *OutTy{};
   std::vector<llvm::Type *> OtherArgs;
+  // Known side effects, such helpers also always return or unwind. They are
+  // not nounwind: memory w/out host base throws on unmapped access & the
+  // error has to reach the caller through JITed frames
+  std::optional<llvm::MemoryEffects> Effects;
 };
 [[nodiscard]] llvm::Function *getCpuStateMeth(llvm::Module &Module,
                                               llvm::StringRef Name,
@@ -78,8 +119,13 @@ struct CpuStateMethInfo final {
 
   llvm::FunctionType *ft = llvm::FunctionType::get(info.OutTy, args, false);
 
-  return llvm::Function::Create(ft, llvm::Function::ExternalLinkage, Name,
-                                Module);
+  auto *fn = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, Name,
+                                    Module);
+  if (info.Effects.has_value()) {
+    fn->setMemoryEffects(*info.Effects);
+    fn->setWillReturn();
+  }
+  return fn;
 }
 
 template <auto Func>
@@ -114,12 +160,22 @@ void doStore(CPUState &cpu, isa::Imm addr, auto val) {
 
 void doSyscall(CPUState &state) { state.emulateSysCall(); }
 
+// Memory helpers only read CPUState::memory, guest memory itself is never
+// accessed by IR in that case
+const auto kLoadEffects =
+    llvm::MemoryEffects::argMemOnly(llvm::ModRefInfo::Ref) |
+    llvm::MemoryEffects::inaccessibleMemOnly(llvm::ModRefInfo::Ref);
+const auto kStoreEffects =
+    llvm::MemoryEffects::argMemOnly(llvm::ModRefInfo::Ref) |
+    llvm::MemoryEffects::inaccessibleMemOnly(llvm::ModRefInfo::ModRef);
+
 #define PROT_GEN_LOAD(Tpy, Size)                                               \
   ExtFunctionInfo<&doLoad<isa::Tpy>> {                                         \
     "doLoad" #Tpy, [](llvm::Module &Mod) {                                     \
       auto &Ctx = Mod.getContext();                                            \
       return CpuStateMethInfo{.OutTy = llvm::Type::getInt##Size##Ty(Ctx),      \
-                              .OtherArgs = {llvm::Type::getInt32Ty(Ctx)}};     \
+                              .OtherArgs = {llvm::Type::getInt32Ty(Ctx)},      \
+                              .Effects = kLoadEffects};                        \
     }                                                                          \
   }
 #define PROT_GEN_STORE(Tpy, Size)                                              \
@@ -129,7 +185,8 @@ void doSyscall(CPUState &state) { state.emulateSysCall(); }
       return CpuStateMethInfo{                                                 \
           .OutTy = llvm::Type::getVoidTy(Ctx),                                 \
           .OtherArgs = {llvm::Type::getInt32Ty(Ctx),                           \
-                        llvm::Type::getInt##Size##Ty(Ctx)}};                   \
+                        llvm::Type::getInt##Size##Ty(Ctx)},                    \
+          .Effects = kStoreEffects};                                           \
     }                                                                          \
   }
 
@@ -159,6 +216,24 @@ template <typename T> llvm::Function *InsnIRBuilder::getStoreFn() {
   return getSpecialFunc<&doStore<T>>()(*getModule());
 }
 
+template <typename T> llvm::Value *InsnIRBuilder::loadMem(llvm::Value *addr) {
+  if (m_hostBase != nullptr) {
+    return CreateAlignedLoad(getIntNTy(sizeofBits<T>()), getHostPtr(addr),
+                             llvm::Align{1});
+  }
+  // Helpers only need memory pointer, so local state copy never escapes
+  return CreateCall(getLoadFn<T>(), {getFn()->getArg(0), addr});
+}
+
+template <typename T>
+void InsnIRBuilder::storeMem(llvm::Value *addr, llvm::Value *val) {
+  if (m_hostBase != nullptr) {
+    CreateAlignedStore(val, getHostPtr(addr), llvm::Align{1});
+    return;
+  }
+  CreateCall(getStoreFn<T>(), {getFn()->getArg(0), addr, val});
+}
+
 void InsnIRBuilder::generateLoad(const isa::Instruction &insn) {
   auto *cpuStructTy = getCPUStateType();
   auto *regsArrTy = cpuStructTy->getStructElementType(0);
@@ -174,26 +249,24 @@ void InsnIRBuilder::generateLoad(const isa::Instruction &insn) {
 
   llvm::Value *addrVal = CreateAdd(rs1Val, getInt32(insn.imm()));
 
-  auto [func, do_sext] = [&] {
+  auto [loaded, do_sext] = [&] {
     switch (insn.opcode()) {
       using enum isa::Opcode;
     case kLB:
-      return std::pair{getLoadFn<isa::Byte>(), true};
+      return std::pair{loadMem<isa::Byte>(addrVal), true};
     case kLBU:
-      return std::pair{getLoadFn<isa::Byte>(), false};
+      return std::pair{loadMem<isa::Byte>(addrVal), false};
     case kLH:
-      return std::pair{getLoadFn<isa::Half>(), true};
+      return std::pair{loadMem<isa::Half>(addrVal), true};
     case kLHU:
-      return std::pair{getLoadFn<isa::Half>(), false};
+      return std::pair{loadMem<isa::Half>(addrVal), false};
     case kLW:
-      return std::pair{getLoadFn<isa::Word>(), false};
+      return std::pair{loadMem<isa::Word>(addrVal), false};
     default:
       throw std::invalid_argument{"Bad opcode"};
     }
   }();
 
-  llvm::Value *loaded = CreateCall(func, {cpuStatePtr, addrVal});
-
   if (insn.rd() != 0) {
     CreateStore(do_sext
                     ? CreateSExt(loaded, llvm::Type::getInt32Ty(getContext()))
@@ -217,30 +290,87 @@ void InsnIRBuilder::generateStore(const isa::Instruction &insn) {
 
   llvm::Value *rs2Ptr = CreateInBoundsGEP(regsArrTy, regsPtr,
                                           {getInt32(0), getInt32(insn.rs2())});
-  auto [valTy, func] = [&] {
-    switch (insn.opcode()) {
-      using enum isa::Opcode;
-    case kSB:
-      return std::pair(getInt8Ty(), getStoreFn<isa::Byte>());
-    case kSH:
-      return std::pair(getInt16Ty(), getStoreFn<isa::Half>());
-    case kSW:
-      return std::pair(getInt32Ty(), getStoreFn<isa::Word>());
-    default:
-      throw std::invalid_argument{"Bad store insn"};
+  switch (insn.opcode()) {
+    using enum isa::Opcode;
+  case kSB:
+    return storeMem<isa::Byte>(addrVal, CreateLoad(getInt8Ty(), rs2Ptr));
+  case kSH:
+    return storeMem<isa::Half>(addrVal, CreateLoad(getInt16Ty(), rs2Ptr));
+  case kSW:
+    return storeMem<isa::Word>(addrVal, CreateLoad(getInt32Ty(), rs2Ptr));
+  default:
+    throw std::invalid_argument{"Bad store insn"};
+  }
+}
+
+void InsnIRBuilder::generateAccessRun(std::span<const isa::Instruction> run) {
+  auto *cpuStructTy = getCPUStateType();
+  auto *regsArrTy = cpuStructTy->getStructElementType(0);
+  llvm::Value *regsPtr = CreateStructGEP(cpuStructTy, getCpuStatePtr(), 0);
+  const auto getRegPtr = [&](isa::Operand reg) {
+    return CreateInBoundsGEP(regsArrTy, regsPtr, {getInt32(0), getInt32(reg)});
+  };
+
+  // Descending runs start at their last insn, vector lanes follow memory
+  const auto &first = run.front();
+  const auto low = std::min(static_cast<std::int32_t>(first.imm()),
+                            static_cast<std::int32_t>(run.back().imm()));
+  const auto lane = [low](const isa::Instruction &insn) {
+    return (static_cast<std::int32_t>(insn.imm()) - low) /
+           static_cast<std::int32_t>(isa::kWordSize);
+  };
+  llvm::Value *rs1Val = CreateLoad(getInt32Ty(), getRegPtr(first.rs1()));
+  llvm::Value *addr = CreateAdd(rs1Val, getInt32(low));
+
+  // Word accesses wrap to guest address 0, single host access would run
+  // past the mapping instead
+  auto &ctx = getContext();
+  auto *fastBB = llvm::BasicBlock::Create(ctx, "run", getFn());
+  auto *slowBB = llvm::BasicBlock::Create(ctx, "run.wrap", getFn());
+  auto *doneBB = llvm::BasicBlock::Create(ctx, "run.done", getFn());
+  const auto lastStart =
+      static_cast<isa::Word>(-isa::kWordSize * run.size());
+  CreateCondBr(CreateICmpUGT(addr, getInt32(lastStart)), slowBB, fastBB);
+
+  SetInsertPoint(slowBB);
+  for (const auto &insn : run) {
+    build(insn);
+  }
+  CreateBr(doneBB);
+
+  SetInsertPoint(fastBB);
+  llvm::Value *hostPtr = getHostPtr(addr);
+  // <2 x i32> & <4 x i32> become 64 & 128 bit host accesses
+  auto *vecTy = llvm::FixedVectorType::get(getInt32Ty(), run.size());
+  if (first.opcode() == isa::Opcode::kLW) {
+    llvm::Value *loaded = CreateAlignedLoad(vecTy, hostPtr, llvm::Align{1});
+    // Program order is kept, so the last load wins if rds repeat
+    for (const auto &insn : run) {
+      if (insn.rd() != 0) {
+        CreateStore(CreateExtractElement(loaded, lane(insn)),
+                    getRegPtr(insn.rd()));
+      }
     }
-  }();
-  auto *rs2Val = CreateLoad(valTy, rs2Ptr);
+  } else {
+    llvm::Value *stored = llvm::PoisonValue::get(vecTy);
+    for (const auto &insn : run) {
+      stored = CreateInsertElement(
+          stored, CreateLoad(getInt32Ty(), getRegPtr(insn.rs2())),
+          lane(insn));
+    }
+    CreateAlignedStore(stored, hostPtr, llvm::Align{1});
+  }
+  CreateBr(doneBB);
 
-  CreateCall(func, {cpuStatePtr, addrVal, rs2Val});
+  SetInsertPoint(doneBB);
 }
 
-void InsnIRBuilder::advancePC() {
+void InsnIRBuilder::advancePC(isa::Word size) {
   auto *cpuStructTy = getCPUStateType();
   auto *cpuArg = getCpuStatePtr();
   llvm::Value *pcPtr = CreateStructGEP(cpuStructTy, cpuArg, 1);
   llvm::Value *pcVal = CreateLoad(getInt32Ty(), pcPtr);
-  llvm::Value *newPCVal = CreateAdd(pcVal, getInt32(4));
+  llvm::Value *newPCVal = CreateAdd(pcVal, getInt32(size));
   CreateStore(newPCVal, pcPtr);
 }
 
@@ -1018,43 +1148,484 @@ void ECALLbuildIR(InsnIRBuilder &Data, const isa::Instruction & /*unused*/) {
 void EBREAKbuildIR(InsnIRBuilder & /*unused*/,
                    const isa::Instruction & /*unused*/) {}
 
-} // namespace
-std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<llvm::Module>>
-translate(const std::string &name, const std::vector<isa::Instruction> &insns) {
-  auto ctxPtr = std::make_unique<llvm::LLVMContext>();
-  auto modulePtr = std::make_unique<llvm::Module>(name, *ctxPtr);
+void LIbuildIR(InsnIRBuilder &Data, const isa::Instruction &insn) {
+  if (insn.rd() != 0) {
+    Data.CreateStore(Data.getInt32(insn.imm()), Data.getReg(insn.rd()));
+  }
+}
 
-  auto *fnTy =
-      llvm::FunctionType::get(llvm::Type::getVoidTy(*ctxPtr),
-                              {llvm::PointerType::getUnqual(*ctxPtr)}, false);
-  auto *fn = llvm::Function::Create(fnTy, llvm::Function::ExternalLinkage, name,
-                                    *modulePtr);
+void LAbuildIR(InsnIRBuilder &Data, const isa::Instruction &insn) {
+  llvm::Value *pcVal = Data.CreateLoad(Data.getInt32Ty(), Data.getPCPtr());
+  if (insn.rd() != 0) {
+    Data.CreateStore(Data.CreateAdd(pcVal, Data.getInt32(insn.imm())),
+                     Data.getReg(insn.rd()));
+  }
+}
 
-  InsnIRBuilder data{*modulePtr};
+void LWPCbuildIR(InsnIRBuilder &Data, const isa::Instruction &insn) {
+  llvm::Value *pcVal = Data.CreateLoad(Data.getInt32Ty(), Data.getPCPtr());
+  llvm::Value *addrVal = Data.CreateAdd(pcVal, Data.getInt32(insn.imm()));
+  llvm::Value *loaded = Data.loadMem<isa::Word>(addrVal);
+  if (insn.rd() != 0) {
+    Data.CreateStore(loaded, Data.getReg(insn.rd()));
+  }
+}
 
-  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(*ctxPtr, "entry", fn);
-  data.SetInsertPoint(entryBB);
+void CALLbuildIR(InsnIRBuilder &Data, const isa::Instruction &insn) {
+  llvm::Value *pcPtr = Data.getPCPtr();
+  llvm::Value *pcVal = Data.CreateLoad(Data.getInt32Ty(), pcPtr);
 
-  for (const auto &insn : insns) {
-    data.build(insn);
-    if (!isa::changesPC(insn.opcode())) {
-      data.advancePC();
+  llvm::Value *target = Data.CreateAdd(pcVal, Data.getInt32(insn.imm()));
+  Data.CreateStore(Data.CreateAnd(target, Data.getInt32(~1U)), pcPtr);
+  if (insn.rd() != 0) {
+    Data.CreateStore(Data.CreateAdd(pcVal, Data.getInt32(insn.size())),
+                     Data.getReg(insn.rd()));
+  }
+}
+
+void SHADDbuildIR(InsnIRBuilder &Data, const isa::Instruction &insn) {
+  llvm::Value *rs1Val = Data.CreateLoad(Data.getInt32Ty(), Data.getReg(insn.rs1()));
+  llvm::Value *rs2Val = Data.CreateLoad(Data.getInt32Ty(), Data.getReg(insn.rs2()));
+  llvm::Value *shifted = Data.CreateShl(rs1Val, Data.getInt32(insn.imm() & 0x1f));
+  if (insn.rd() != 0) {
+    Data.CreateStore(Data.CreateAdd(shifted, rs2Val), Data.getReg(insn.rd()));
+  }
+}
+
+llvm::Function *declareBlock(llvm::Module &module, const std::string &name) {
+  auto &ctx = module.getContext();
+  auto *fnTy = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx),
+                                       {llvm::PointerType::getUnqual(ctx)},
+                                       false);
+  return llvm::Function::Create(fnTy, llvm::Function::ExternalLinkage, name,
+                                module);
+}
+
+// Amount of leading LW or SW insns accessing consecutive words off the same
+// base reg, which is not overwritten by them. Words may go up or down, the
+// latter is common in prologues & epilogues. Runs are cut to 2 or 4 words,
+// so they fit single host access. 1 if there is no run
+std::size_t findAccessRun(std::span<const isa::Instruction> insns) {
+  constexpr std::size_t kMaxRun = 4;
+  const auto &first = insns.front();
+  const auto opc = first.opcode();
+  if ((opc != isa::Opcode::kLW && opc != isa::Opcode::kSW) ||
+      insns.size() < 2) {
+    return 1;
+  }
+
+  // Direction is set by the second access
+  const auto step = static_cast<isa::Word>(insns[1].imm() - first.imm());
+  if (step != isa::kWordSize &&
+      step != static_cast<isa::Word>(-isa::kWordSize)) {
+    return 1;
+  }
+
+  std::size_t num = 0;
+  for (const auto &insn : insns.first(std::min(insns.size(), kMaxRun))) {
+    if (insn.opcode() != opc || insn.rs1() != first.rs1() ||
+        insn.imm() != static_cast<isa::Word>(first.imm() + step * num) ||
+        (opc == isa::Opcode::kLW && insn.rd() == first.rs1())) {
+      break;
     }
+    ++num;
   }
+  return num == kMaxRun ? num : std::max<std::size_t>(num & ~1U, 1);
+}
+
+// Builds block body at current insert point
+void buildBlock(InsnIRBuilder &data, const Block &block) {
+  auto &ctx = data.getContext();
+
+  for (std::size_t idx = 0; idx < block.insns.size();) {
+    const auto rest = block.insns.subspan(idx);
+    // Adjacent accesses are combined only if memory is accessed directly
+    const auto num = data.hasFlatMemory() ? findAccessRun(rest) : 1;
+    if (num > 1) {
+      data.generateAccessRun(rest.first(num));
+    } else {
+      data.build(rest.front());
+    }
 
-  auto *icountType =
-      llvm::IntegerType::get(*ctxPtr, sizeofBits<std::uint64_t>());
+    for (const auto &insn : rest.first(num)) {
+      if (!isa::changesPC(insn.opcode())) {
+        data.advancePC(insn.size());
+      }
+    }
+    idx += num;
+  }
+
+  auto *icountType = llvm::IntegerType::get(ctx, sizeofBits<std::uint64_t>());
   auto *cpuStructTy = data.getCPUStateType();
 
   auto *cpuArg = data.getCpuStatePtr();
 
   llvm::Value *icPtr = data.CreateStructGEP(cpuStructTy, cpuArg, 4);
   auto *icVal = data.CreateLoad(icountType, icPtr);
-  auto *newVal = data.CreateAdd(icVal, data.getInt64(insns.size()));
+  auto *newVal = data.CreateAdd(icVal, data.getInt64(block.icount));
   data.CreateStore(newVal, icPtr);
+}
+
+// Guest memory never overlaps CPUState: accesses get disjoint TBAA types and
+// alias scopes, so registers may stay in SSA values across memory accesses
+void annotateAliasing(llvm::Function &fn) {
+  auto &ctx = fn.getContext();
+  llvm::MDBuilder mdb{ctx};
+
+  auto *root = mdb.createTBAARoot("prot");
+  auto makeTag = [&](llvm::StringRef name) {
+    auto *type = mdb.createTBAAScalarTypeNode(name, root);
+    return mdb.createTBAAStructTagNode(type, type, 0);
+  };
+  auto *cpuTag = makeTag("cpu state");
+  auto *memTag = makeTag("guest memory");
+
+  auto *domain = mdb.createAliasScopeDomain("prot");
+  auto *cpuScope =
+      llvm::MDNode::get(ctx, mdb.createAliasScope("cpu state", domain));
+  auto *memScope =
+      llvm::MDNode::get(ctx, mdb.createAliasScope("guest memory", domain));
+
+  auto *cpuArg = fn.getArg(0);
+  for (auto &inst : llvm::instructions(fn)) {
+    llvm::Value *ptr{};
+    if (auto *load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+      ptr = load->getPointerOperand();
+    } else if (auto *store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+      ptr = store->getPointerOperand();
+    } else {
+      continue;
+    }
+
+    // CPUState is only addressed by inbounds GEPs off the argument or off
+    // its local copy
+    const auto *base = ptr->stripInBoundsOffsets();
+    const bool isCpu = base == cpuArg || llvm::isa<llvm::AllocaInst>(base);
+    inst.setMetadata(llvm::LLVMContext::MD_tbaa, isCpu ? cpuTag : memTag);
+    inst.setMetadata(llvm::LLVMContext::MD_alias_scope,
+                     isCpu ? cpuScope : memScope);
+    inst.setMetadata(llvm::LLVMContext::MD_noalias,
+                     isCpu ? memScope : cpuScope);
+  }
+}
+
+// Guest address of the last block insn
+isa::Addr getLastPC(const Block &block) {
+  auto pc = block.pc;
+  for (const auto &insn : block.insns.first(block.insns.size() - 1)) {
+    pc += insn.size();
+  }
+  return pc;
+}
+
+// Statically known guest addresses where block may continue
+std::vector<isa::Addr> getSuccessors(const Block &block) {
+  const auto pc = getLastPC(block);
+  const auto &last = block.insns.back();
+  switch (last.opcode()) {
+    using enum isa::Opcode;
+  case kBEQ:
+  case kBNE:
+  case kBLT:
+  case kBGE:
+  case kBLTU:
+  case kBGEU:
+    if (last.imm() == last.size()) {
+      return {pc + last.size()};
+    }
+    return {pc + last.imm(), pc + last.size()};
+  case kJAL:
+    return {pc + last.imm()};
+  case kCALL:
+    return {(pc + last.imm()) & ~isa::Word{1}};
+  // ecall may finish simulation, so engine has to check state after it
+  case kECALL:
+  case kEBREAK:
+  case kJALR:
+    return {};
+  default:
+    return {pc + last.size()};
+  }
+}
+
+// Host calls between lifted functions nest as deep as guest calls do. Above
+// this depth callee is left to engine, so deep guest recursion cannot
+// overflow host stack
+constexpr std::uint32_t kMaxLiftedDepth = 512;
+// Current nesting of such calls, lifted code runs on engine thread only
+std::uint32_t liftedDepth{};
+} // namespace
+
+std::vector<llvm::Function *> translate(llvm::Module &module,
+                                        std::span<const Block> blocks,
+                                        const BuildOptions &options) {
+  std::vector<llvm::Function *> fns;
+  std::unordered_map<isa::Addr, llvm::Function *> entries;
+  for (const auto &block : blocks) {
+    fns.push_back(declareBlock(module, block.name));
+    entries.emplace(block.pc, fns.back());
+  }
+
+  InsnIRBuilder data{module, options.hostBase};
+  for (std::size_t idx = 0; idx < blocks.size(); ++idx) {
+    auto *fn = fns[idx];
+    data.SetInsertPoint(
+        llvm::BasicBlock::Create(module.getContext(), "entry", fn));
+    buildBlock(data, blocks[idx]);
+
+    std::vector<std::pair<isa::Addr, llvm::Function *>> targets;
+    if (options.chain) {
+      for (auto succ : getSuccessors(blocks[idx])) {
+        const auto found = entries.find(succ);
+        if (found != entries.end()) {
+          targets.emplace_back(*found);
+        }
+      }
+    }
+    if (targets.empty()) {
+      data.CreateRetVoid();
+      continue;
+    }
+
+    // Jump straight to the next block of the batch w/out returning to engine
+    auto &ctx = module.getContext();
+    auto *exitBB = llvm::BasicBlock::Create(ctx, "exit", fn);
+    auto *pcVal = data.CreateLoad(data.getInt32Ty(), data.getPCPtr());
+    auto *sw = data.CreateSwitch(pcVal, exitBB, targets.size());
+    for (const auto &[addr, target] : targets) {
+      auto *chainBB = llvm::BasicBlock::Create(ctx, "chain", fn);
+      sw->addCase(data.getInt32(addr), chainBB);
+
+      data.SetInsertPoint(chainBB);
+      auto *call = data.CreateCall(target, {data.getCpuStatePtr()});
+      call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+      data.CreateRetVoid();
+    }
+
+    data.SetInsertPoint(exitBB);
+    data.CreateRetVoid();
+  }
+
+  for (auto *fn : fns) {
+    annotateAliasing(*fn);
+  }
+  return fns;
+}
+
+llvm::Function *translateRegion(llvm::Module &module, const std::string &name,
+                                std::span<const Block> blocks,
+                                const BuildOptions &options) {
+  auto &ctx = module.getContext();
+  auto *fn = declareBlock(module, name);
+  InsnIRBuilder data{module, options.hostBase};
+
+  // Whole state is copied to stack on entry and back on exit, so SROA turns
+  // guest registers into SSA values inside the loop
+  data.SetInsertPoint(llvm::BasicBlock::Create(ctx, "entry", fn));
+  auto *cpuArg = fn->getArg(0);
+  auto *state = data.CreateAlloca(data.getCPUStateType());
+  const llvm::Align align{alignof(CPUState)};
+  data.CreateMemCpy(state, align, cpuArg, align, sizeof(CPUState));
+  data.setCpuStatePtr(state);
+
+  std::unordered_map<isa::Addr, llvm::BasicBlock *> entries;
+  for (const auto &block : blocks) {
+    entries.emplace(block.pc, llvm::BasicBlock::Create(ctx, "block", fn));
+  }
+  auto *exitBB = llvm::BasicBlock::Create(ctx, "exit", fn);
+  data.CreateBr(entries.at(blocks.front().pc));
+
+  for (const auto &block : blocks) {
+    data.SetInsertPoint(entries.at(block.pc));
+    buildBlock(data, block);
+
+    // Edges leaving region are side exits
+    auto *pcVal = data.CreateLoad(data.getInt32Ty(), data.getPCPtr());
+    auto *sw = data.CreateSwitch(pcVal, exitBB);
+    for (auto succ : getSuccessors(block)) {
+      if (const auto found = entries.find(succ); found != entries.end()) {
+        sw->addCase(data.getInt32(succ), found->second);
+      }
+    }
+  }
 
+  data.SetInsertPoint(exitBB);
+  data.CreateMemCpy(cpuArg, align, state, align, sizeof(CPUState));
   data.CreateRetVoid();
 
+  annotateAliasing(*fn);
+  return fn;
+}
+
+LiftedFunction discoverFunction(const Memory &mem, const FuncSymbol &func,
+                                std::string name) {
+  const auto &range = func.range;
+  std::map<isa::Addr, isa::Instruction> decoded;
+  std::set<isa::Addr> leaders{range.start};
+  std::vector<isa::Addr> worklist{range.start};
+  const auto addLeader = [&](isa::Addr addr) {
+    if (range.contains(addr) && leaders.insert(addr).second) {
+      worklist.push_back(addr);
+    }
+  };
+
+  while (!worklist.empty()) {
+    auto addr = worklist.back();
+    worklist.pop_back();
+
+    for (; range.contains(addr); addr += isa::kWordSize) {
+      // Fell through into already decoded code
+      if (decoded.contains(addr)) {
+        leaders.insert(addr);
+        break;
+      }
+      // Data in text section, engine will report it if it is ever reached
+      const auto insn = isa::Instruction::decode(mem.read<isa::Word>(addr));
+      if (!insn.has_value()) {
+        break;
+      }
+      decoded.emplace(addr, *insn);
+
+      const auto opc = insn->opcode();
+      if (isa::isTerminator(opc)) {
+        const Block single{.pc = addr, .insns = std::span{&*insn, 1}};
+        for (auto succ : getSuccessors(single)) {
+          addLeader(succ);
+        }
+        // Callee returns to the next insn
+        if ((opc == isa::Opcode::kJAL || opc == isa::Opcode::kJALR) &&
+            insn->rd() != 0) {
+          addLeader(addr + insn->size());
+        }
+        break;
+      }
+    }
+  }
+
+  LiftedFunction res{.name = std::move(name), .entry = range.start};
+  res.insns.reserve(decoded.size());
+  std::vector<std::pair<isa::Addr, std::size_t>> starts;
+  std::optional<isa::Addr> next;
+  for (const auto &[addr, insn] : decoded) {
+    if (next != addr || leaders.contains(addr)) {
+      starts.emplace_back(addr, res.insns.size());
+    }
+    res.insns.push_back(insn);
+    next = isa::isTerminator(insn.opcode())
+               ? std::nullopt
+               : std::optional{addr + insn.size()};
+  }
+
+  const std::span insns{res.insns};
+  for (std::size_t idx = 0; idx < starts.size(); ++idx) {
+    const auto [pc, begin] = starts[idx];
+    const auto end =
+        idx + 1 < starts.size() ? starts[idx + 1].second : insns.size();
+    res.blocks.push_back(Block{.name = {},
+                               .pc = pc,
+                               .insns = insns.subspan(begin, end - begin),
+                               .icount = end - begin});
+  }
+  return res;
+}
+
+std::vector<llvm::Function *> lift(llvm::Module &module,
+                                   std::span<const LiftedFunction> funcs,
+                                   const BuildOptions &options) {
+  auto &ctx = module.getContext();
+  std::vector<llvm::Function *> fns;
+  std::unordered_map<isa::Addr, llvm::Function *> entries;
+  for (const auto &func : funcs) {
+    assert(!func.blocks.empty() && func.blocks.front().pc == func.entry);
+    fns.push_back(declareBlock(module, func.name));
+    entries.emplace(func.entry, fns.back());
+  }
+
+  InsnIRBuilder data{module, options.hostBase};
+  for (std::size_t idx = 0; idx < funcs.size(); ++idx) {
+    const auto &func = funcs[idx];
+    auto *fn = fns[idx];
+    data.SetInsertPoint(llvm::BasicBlock::Create(ctx, "entry", fn));
+
+    std::unordered_map<isa::Addr, llvm::BasicBlock *> blocks;
+    for (const auto &block : func.blocks) {
+      blocks.emplace(block.pc, llvm::BasicBlock::Create(ctx, "block", fn));
+    }
+    auto *exitBB = llvm::BasicBlock::Create(ctx, "exit", fn);
+    data.CreateBr(blocks.at(func.entry));
+
+    for (const auto &block : func.blocks) {
+      data.SetInsertPoint(blocks.at(block.pc));
+      buildBlock(data, block);
+
+      const auto lastPC = getLastPC(block);
+      const auto &last = block.insns.back();
+      const auto callee = entries.find(lastPC + last.imm());
+      if (last.opcode() == isa::Opcode::kJAL && last.rd() != 0 &&
+          callee != entries.end()) {
+        // JAL has already set pc to callee, so exit hands it to engine
+        auto *depthPtr = data.CreateIntToPtr(
+            data.getInt64(reinterpret_cast<std::uintptr_t>(&liftedDepth)),
+            llvm::PointerType::getUnqual(ctx));
+        auto *depth = data.CreateLoad(data.getInt32Ty(), depthPtr);
+        auto *callBB = llvm::BasicBlock::Create(ctx, "call", fn);
+        data.CreateCondBr(
+            data.CreateICmpUGE(depth, data.getInt32(kMaxLiftedDepth)), exitBB,
+            callBB);
+
+        // Callee returns once guest function is done or control has left
+        // lifted code, only the former continues here
+        data.SetInsertPoint(callBB);
+        data.CreateStore(data.CreateAdd(depth, data.getInt32(1)), depthPtr);
+        data.CreateCall(callee->second, {data.getCpuStatePtr()});
+        data.CreateStore(depth, depthPtr);
+        auto *finishedPtr = data.CreateStructGEP(data.getCPUStateType(),
+                                                 data.getCpuStatePtr(), 2);
+        auto *retBB = llvm::BasicBlock::Create(ctx, "ret", fn);
+        data.CreateCondBr(data.CreateLoad(data.getInt1Ty(), finishedPtr),
+                          exitBB, retBB);
+
+        data.SetInsertPoint(retBB);
+        auto *pcVal = data.CreateLoad(data.getInt32Ty(), data.getPCPtr());
+        auto *sw = data.CreateSwitch(pcVal, exitBB);
+        const auto retAddr = lastPC + last.size();
+        if (const auto found = blocks.find(retAddr); found != blocks.end()) {
+          sw->addCase(data.getInt32(retAddr), found->second);
+        }
+        continue;
+      }
+
+      auto *pcVal = data.CreateLoad(data.getInt32Ty(), data.getPCPtr());
+      auto *sw = data.CreateSwitch(pcVal, exitBB);
+      for (auto succ : getSuccessors(block)) {
+        if (const auto found = blocks.find(succ); found != blocks.end()) {
+          sw->addCase(data.getInt32(succ), found->second);
+        }
+      }
+    }
+
+    data.SetInsertPoint(exitBB);
+    data.CreateRetVoid();
+    annotateAliasing(*fn);
+  }
+  return fns;
+}
+
+llvm::Function *translate(llvm::Module &module, const std::string &name,
+                          const std::vector<isa::Instruction> &insns,
+                          std::size_t icount) {
+  const Block block{.name = name, .pc = {}, .insns = insns, .icount = icount};
+  return translate(module, std::span{&block, 1}, {}).front();
+}
+
+std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<llvm::Module>>
+translate(const std::string &name, const std::vector<isa::Instruction> &insns,
+          std::size_t icount) {
+  auto ctxPtr = std::make_unique<llvm::LLVMContext>();
+  auto modulePtr = std::make_unique<llvm::Module>(name, *ctxPtr);
+
+  translate(*modulePtr, name, insns, icount);
+
   return {std::move(ctxPtr), std::move(modulePtr)};
 }
 
@@ -1117,6 +1688,11 @@ void InsnIRBuilder::build(const isa::Instruction &insn) {
     PROT_JIT_CASE(PAUSE)
     PROT_JIT_CASE(ECALL)
     PROT_JIT_CASE(EBREAK)
+    PROT_JIT_CASE(LI)
+    PROT_JIT_CASE(LA)
+    PROT_JIT_CASE(LWPC)
+    PROT_JIT_CASE(CALL)
+    PROT_JIT_CASE(SHADD)
 #undef PROT_JIT_CASE
   default:
     assert(false);
@@ -2,18 +2,79 @@
 #define INCLUDE_PROT_LLVM_BUILDER_HH_INCLUDED
 
 #include <array>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <vector>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/Support/Error.h>
 
 #include "prot/isa.hh"
+#include "prot/memory.hh"
 
 namespace prot::ll {
 
 const std::unordered_map<std::string_view, void *> &getFuncMapper();
 
+struct Block final {
+  std::string name;
+  // guest address of the first insn
+  isa::Addr pc{};
+  std::span<const isa::Instruction> insns;
+  // amount of guest insns covered by insns (some may be fused)
+  std::size_t icount{};
+};
+
+struct BuildOptions final {
+  // Blocks tail call other blocks of the batch when they branch to their
+  // entries
+  bool chain{false};
+  // If set, guest memory is accessed directly at hostBase + addr instead of
+  // calling memory helpers
+  std::byte *hostBase{};
+};
+
+// Builds function per block in module
+std::vector<llvm::Function *> translate(llvm::Module &module,
+                                        std::span<const Block> blocks,
+                                        const BuildOptions &options);
+
+// Builds natural loop of blocks as single function, blocks[0] is its header.
+// Control stays inside function until it leaves the region
+llvm::Function *translateRegion(llvm::Module &module, const std::string &name,
+                                std::span<const Block> blocks,
+                                const BuildOptions &options);
+
+// Guest function recovered from memory
+struct LiftedFunction final {
+  std::string name;
+  isa::Addr entry{};
+  // decoded body in address order, blocks refer to it
+  std::vector<isa::Instruction> insns;
+  std::vector<Block> blocks;
+};
+
+// Finds blocks reachable from function entry by recursive descent. Only
+// direct branches inside function are followed
+LiftedFunction discoverFunction(const Memory &mem, const FuncSymbol &func,
+                                std::string name);
+
+// Builds LLVM function per guest one. Direct calls between them become host
+// calls, any other edge leaving function returns to engine
+std::vector<llvm::Function *> lift(llvm::Module &module,
+                                   std::span<const LiftedFunction> funcs,
+                                   const BuildOptions &options);
+
+// Single block w/ unknown address, never chained
+llvm::Function *translate(llvm::Module &module, const std::string &name,
+                          const std::vector<isa::Instruction> &insns,
+                          std::size_t icount);
+
+// Same as above, but in a fresh context & module
 std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<llvm::Module>>
-translate(const std::string &name, const std::vector<isa::Instruction> &insns);
+translate(const std::string &name, const std::vector<isa::Instruction> &insns,
+          std::size_t icount);
 
 } // namespace prot::ll
 
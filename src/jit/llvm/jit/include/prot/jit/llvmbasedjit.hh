@@ -7,7 +7,7 @@
 #include "prot/jit/base.hh"
 
 namespace prot::engine {
-std::unique_ptr<Translator> makeLLVMBasedJIT();
+std::unique_ptr<Translator> makeLLVMBasedJIT(const TranslatorOptions &options = {});
 } // end namespace prot::engine
 
 #endif // PROT_JIT_LLVMBASEDJIT_HH_INCLUDED
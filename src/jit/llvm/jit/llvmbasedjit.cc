@@ -1,81 +1,420 @@
 #include "llvm-c/Target.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/Shared/MemoryFlags.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CodeGen.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdio>
 #include <functional>
 #include <iostream>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/GenericValue.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/Support/raw_ostream.h>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+
+extern "C" {
+#include <malloc.h>
+}
 
 #include "prot/cpu_state.hh"
 #include "prot/exec_engine.hh"
 #include "prot/isa.hh"
 #include "prot/jit/base.hh"
 #include "prot/llvm/builder.hh"
+#include "prot/memory.hh"
 
 namespace prot::engine {
 namespace {
+std::string toString(llvm::Error err) {
+  std::string msg;
+  llvm::raw_string_ostream{msg} << err;
+  return msg;
+}
+
+// Warm tiers are compiled w/ FastISel, hot ones w/ full SelectionDAG unless
+// codegen level is set explicitly
+llvm::CodeGenOptLevel getCodeGenOptLevel(const TranslatorOptions &options) {
+  if (options.codegenLevel.has_value()) {
+    if (const auto level = llvm::CodeGenOpt::getLevel(
+            static_cast<int>(*options.codegenLevel))) {
+      return *level;
+    }
+    throw std::invalid_argument{
+        fmt::format("Invalid codegen level {}", *options.codegenLevel)};
+  }
+
+  switch (options.optLevel) {
+  case 0:
+  case 1:
+    return llvm::CodeGenOptLevel::None;
+  case 2:
+    return llvm::CodeGenOptLevel::Default;
+  default:
+    return llvm::CodeGenOptLevel::Aggressive;
+  }
+}
+
+llvm::OptimizationLevel getOptimizationLevel(unsigned optLevel) {
+  switch (optLevel) {
+  case 0:
+    return llvm::OptimizationLevel::O0;
+  case 1:
+    return llvm::OptimizationLevel::O1;
+  case 2:
+    return llvm::OptimizationLevel::O2;
+  default:
+    return llvm::OptimizationLevel::O3;
+  }
+}
+
+// Symbols are named after guest address & kind of code, so there is at most
+// one name per guest address for each kind
+std::string getSymbolName(std::string_view kind, isa::Addr pc) {
+  return fmt::format("prot.{}.{:x}", kind, pc);
+}
+
+std::ptrdiff_t getHeapInUse() {
+  return static_cast<std::ptrdiff_t>(::mallinfo2().uordblks);
+}
+
+// Heap growth left behind by translation is LLVM bookkeeping: IR is freed
+// right after codegen & code lives in its own mappings
+class HeapTracker final {
+  CompileStats &m_stats;
+  std::ptrdiff_t m_before{getHeapInUse()};
+
+public:
+  explicit HeapTracker(CompileStats &stats) : m_stats{stats} {}
+  HeapTracker(const HeapTracker &) = delete;
+  HeapTracker &operator=(const HeapTracker &) = delete;
+  ~HeapTracker() {
+    m_stats.addSize("bookkeeping", getHeapInUse() - m_before);
+  }
+};
+
+// Counts bytes of linked sections: executable ones are code, the rest is
+// constant pools & unwind info emitted along w/ it
+class CodeSizePlugin final : public llvm::orc::ObjectLinkingLayer::Plugin {
+  CompileStats &m_stats;
+
+public:
+  explicit CodeSizePlugin(CompileStats &stats) : m_stats{stats} {}
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility & /*resp*/,
+                        llvm::jitlink::LinkGraph & /*graph*/,
+                        llvm::jitlink::PassConfiguration &config) override {
+    config.PostAllocationPasses.push_back(
+        [this](llvm::jitlink::LinkGraph &graph) {
+          for (auto &sec : graph.sections()) {
+            if (sec.getMemLifetime() == llvm::orc::MemLifetime::NoAlloc) {
+              continue;
+            }
+            const auto prot = sec.getMemProt();
+            const auto size = llvm::jitlink::SectionRange{sec}.getSize();
+            m_stats.addSize((prot & llvm::orc::MemProt::Exec) !=
+                                    llvm::orc::MemProt::None
+                                ? "code"
+                                : "data",
+                            static_cast<std::ptrdiff_t>(size));
+          }
+          return llvm::Error::success();
+        });
+  }
+
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility & /*resp*/) override {
+    return llvm::Error::success();
+  }
+  llvm::Error notifyRemovingResources(llvm::orc::JITDylib & /*jd*/,
+                                      llvm::orc::ResourceKey /*key*/) override {
+    return llvm::Error::success();
+  }
+  void notifyTransferringResources(llvm::orc::JITDylib & /*jd*/,
+                                   llvm::orc::ResourceKey /*dstKey*/,
+                                   llvm::orc::ResourceKey /*srcKey*/) override {
+  }
+};
+
+// Marks lifted functions which are optimized lazily on their first call
+constexpr llvm::StringLiteral kLiftedAttr{"prot-lifted"};
+
 class LLVMBasedJIT : public Translator {
-  std::unique_ptr<llvm::orc::LLJIT> m_jit;
-  std::size_t m_moduleId{};
+  std::unique_ptr<llvm::orc::LLLazyJIT> m_jit;
+  std::unique_ptr<llvm::TargetMachine> m_tm;
+  // Modules are built in one context, it is never touched concurrently.
+  // Constants & metadata uniqued in it are never freed, so it is replaced
+  // every kModulesPerContext modules. Old one lives while its modules do
+  static constexpr std::size_t kModulesPerContext{256};
+  llvm::orc::ThreadSafeContext m_ctx{std::make_unique<llvm::LLVMContext>()};
+  std::size_t m_ctxModules{};
+
+  // New pass manager state reused between blocks
+  llvm::LoopAnalysisManager m_lam;
+  llvm::FunctionAnalysisManager m_fam;
+  llvm::CGSCCAnalysisManager m_cgam;
+  llvm::ModuleAnalysisManager m_mam;
+  llvm::PassBuilder m_pb;
+  llvm::FunctionPassManager m_fpm;
+  // Replaces m_fpm for blocks if default pipeline is requested
+  std::optional<llvm::ModulePassManager> m_mpm;
+  llvm::FunctionPassManager m_regionFpm;
+
+  // Linked code & data are never released: every translation stays
+  // reachable from TB cache & batch chains, so they grow w/ number of
+  // translated blocks. See "code" & "data" sizes in stats
+  CompileStats m_stats;
 
 public:
-  LLVMBasedJIT(std::unique_ptr<llvm::orc::LLJIT> JIT);
+  LLVMBasedJIT(std::unique_ptr<llvm::orc::LLLazyJIT> JIT,
+               std::unique_ptr<llvm::TargetMachine> TM,
+               const TranslatorOptions &options);
 
 private:
   JitFunction translate(const BBInfo &info) override {
-    auto name = std::to_string(m_moduleId++);
-    auto &&[ctx, module] = ll::translate(name, info.insns);
-    llvm::orc::ThreadSafeModule tsm(std::move(module), std::move(ctx));
+    return compile(std::array{&info}, {.chain = true}).front();
+  }
 
-    optimizeIRModule(tsm);
+  std::vector<JitFunction>
+  translateBatch(const CPUState &cpu,
+                 std::span<const BBInfo *const> batch) override {
+    return compile(batch, {.chain = true,
+                           .hostBase = cpu.memory->getHostBase()});
+  }
 
-    auto err = m_jit->addIRModule(std::move(tsm));
-    assert(!err);
+  // Whole loop becomes one function which is the most expensive tier, so it
+  // is optimized w/ vectorization regardless of opt level
+  JitFunction translateRegion(const CPUState &cpu,
+                              std::span<const BBInfo *const> blocks) override {
+    const HeapTracker heap{m_stats};
+    const auto region = makeBlocks(blocks);
+    const auto name = getSymbolName("loop", blocks.front()->pc);
+    auto module = buildModule(name, [&](llvm::Module &mod) {
+      ll::translateRegion(mod, name, region,
+                          {.hostBase = cpu.memory->getHostBase()});
+    });
+    m_stats.measure("ir-opt",
+                    [&] { optimizeIRModule(*module, m_regionFpm); });
+    return materialize(std::move(module), std::array{name}).front();
+  }
 
-    return *m_jit->lookup(name)->toPtr<JitFunction>();
+  // Whole program goes to one module, but only stubs are emitted here: each
+  // function is optimized & compiled on its first call
+  std::vector<std::pair<isa::Addr, JitFunction>>
+  liftProgram(const CPUState &cpu,
+              std::span<const FuncSymbol> funcs) override {
+    const HeapTracker heap{m_stats};
+    std::vector<ll::LiftedFunction> lifted;
+    m_stats.measure("lift-cfg", [&] {
+      for (const auto &func : funcs) {
+        auto res = ll::discoverFunction(
+            *cpu.memory, func, getSymbolName("lift", func.range.start));
+        if (!res.blocks.empty()) {
+          lifted.push_back(std::move(res));
+        }
+      }
+    });
+    if (lifted.empty()) {
+      return {};
+    }
+
+    const ll::BuildOptions options{.hostBase = cpu.memory->getHostBase()};
+    auto module = buildModule("prot.lift", [&](llvm::Module &mod) {
+      for (auto *fn : ll::lift(mod, lifted, options)) {
+        fn->addFnAttr(kLiftedAttr);
+      }
+    });
+
+    std::vector<std::string> names;
+    names.reserve(lifted.size());
+    for (const auto &func : lifted) {
+      names.push_back(func.name);
+    }
+    const auto codes = materialize(std::move(module), names, /*lazy=*/true);
+
+    std::vector<std::pair<isa::Addr, JitFunction>> res;
+    res.reserve(lifted.size());
+    for (std::size_t idx = 0; idx < lifted.size(); ++idx) {
+      res.emplace_back(lifted[idx].entry, codes[idx]);
+    }
+    return res;
+  }
+
+  // Whole batch goes to one module, so it is linked as single object file
+  std::vector<JitFunction> compile(std::span<const BBInfo *const> batch,
+                                   const ll::BuildOptions &options) {
+    const HeapTracker heap{m_stats};
+    const auto blocks = makeBlocks(batch);
+    auto module = buildModule(blocks.front().name, [&](llvm::Module &mod) {
+      ll::translate(mod, blocks, options);
+    });
+    m_stats.measure("ir-opt", [&] {
+      if (m_mpm.has_value()) {
+        m_mpm->run(*module, m_mam);
+        clearAnalyses();
+      } else {
+        optimizeIRModule(*module, m_fpm);
+      }
+    });
+
+    std::vector<std::string> names;
+    names.reserve(blocks.size());
+    for (const auto &block : blocks) {
+      names.push_back(block.name);
+    }
+    return materialize(std::move(module), names);
+  }
+
+  std::vector<ll::Block> makeBlocks(std::span<const BBInfo *const> batch) {
+    std::vector<ll::Block> blocks;
+    blocks.reserve(batch.size());
+    for (const auto *info : batch) {
+      blocks.push_back(ll::Block{.name = getSymbolName("bb", info->pc),
+                                 .pc = info->pc,
+                                 .insns = info->insns,
+                                 .icount = info->icount});
+    }
+    return blocks;
+  }
+
+  template <typename Func>
+  std::unique_ptr<llvm::Module> buildModule(const std::string &name,
+                                            Func &&fill) {
+    if (++m_ctxModules > kModulesPerContext) {
+      m_ctx =
+          llvm::orc::ThreadSafeContext{std::make_unique<llvm::LLVMContext>()};
+      m_ctxModules = 1;
+    }
+    return m_ctx.withContextDo([&](llvm::LLVMContext *ctx) {
+      return m_stats.measure("ir-build", [&] {
+        auto res = std::make_unique<llvm::Module>(name, *ctx);
+        res->setDataLayout(m_jit->getDataLayout());
+        res->setTargetTriple(m_jit->getTargetTriple());
+        fill(*res);
+        return res;
+      });
+    });
   }
 
-  static void optimizeIRModule(llvm::orc::ThreadSafeModule &TSM);
+  // Lazy modules are split per function by ORC, lookup only yields stubs
+  // which compile the function on the first call
+  std::vector<JitFunction> materialize(std::unique_ptr<llvm::Module> module,
+                                       std::span<const std::string> names,
+                                       bool lazy = false) {
+    // ORC materializes modules lazily on lookup, so query the main dylib
+    // directly w/ already mangled names instead of going through LLJIT
+    llvm::orc::SymbolLookupSet symbols;
+    for (const auto &name : names) {
+      symbols.add(m_jit->mangleAndIntern(name));
+    }
+    return m_stats.measure(lazy ? "lift-stubs" : "codegen", [&] {
+      const auto add = [&](llvm::orc::ThreadSafeModule tsm) {
+        if (lazy) {
+          return m_jit->addLazyIRModule(std::move(tsm));
+        }
+        return m_jit->addIRModule(std::move(tsm));
+      };
+      if (auto err = add({std::move(module), m_ctx})) {
+        throw std::runtime_error{"Failed to add module: " +
+                                 toString(std::move(err))};
+      }
+
+      auto addrs = m_jit->getExecutionSession().lookup(
+          llvm::orc::makeJITDylibSearchOrder(&m_jit->getMainJITDylib()),
+          symbols);
+      if (!addrs) {
+        throw std::runtime_error{"Failed to compile blocks: " +
+                                 toString(addrs.takeError())};
+      }
+
+      std::vector<JitFunction> res;
+      res.reserve(names.size());
+      for (const auto &name : names) {
+        const auto &sym = addrs->at(m_jit->mangleAndIntern(name));
+        res.push_back(sym.getAddress().toPtr<JitFunction>());
+      }
+      return res;
+    });
+  }
+
+  void dumpStats(std::ostream &ost) const override {
+    ost << "target: " << m_tm->getTargetCPU().str() << ' '
+        << m_tm->getTargetFeatureString().str() << '\n';
+    m_stats.dump(ost);
+  }
+
+  void optimizeIRModule(llvm::Module &M, llvm::FunctionPassManager &fpm);
+  void clearAnalyses();
+  void optimizeLifted(llvm::Module &M);
 };
 
-void LLVMBasedJIT::optimizeIRModule(llvm::orc::ThreadSafeModule &TSM) {
-  TSM.withModuleDo([](llvm::Module &M) {
-    auto funcPM = std::make_unique<llvm::legacy::FunctionPassManager>(&M);
-    funcPM->add(llvm::createInstructionCombiningPass());
-    funcPM->add(llvm::createReassociatePass());
-    funcPM->add(llvm::createGVNPass());
-    funcPM->add(llvm::createCFGSimplificationPass());
-    funcPM->doInitialization();
-    for (auto &f : M)
-      funcPM->run(f);
+void LLVMBasedJIT::optimizeIRModule(llvm::Module &M,
+                                    llvm::FunctionPassManager &fpm) {
+  for (auto &f : M) {
+    if (!f.isDeclaration()) {
+      fpm.run(f, m_fam);
+    }
+  }
+  clearAnalyses();
+}
+
+// Cached results refer to IR which is handed over to codegen
+void LLVMBasedJIT::clearAnalyses() {
+  m_fam.clear();
+  m_lam.clear();
+  m_cgam.clear();
+  m_mam.clear();
+}
+
+// Called by ORC for every module on its way to codegen, lifted functions
+// reach it one by one once they are called
+void LLVMBasedJIT::optimizeLifted(llvm::Module &M) {
+  const bool hasLifted = std::ranges::any_of(M, [](const llvm::Function &f) {
+    return !f.isDeclaration() && f.hasFnAttribute(kLiftedAttr);
   });
+  if (hasLifted) {
+    // Lifted functions are as hot as loop regions & have loops of their own
+    m_stats.measure("lift-opt", [&] { optimizeIRModule(M, m_regionFpm); });
+  }
 }
 
-LLVMBasedJIT::LLVMBasedJIT(std::unique_ptr<llvm::orc::LLJIT> JIT)
-    : m_jit(std::move(JIT)) {
+LLVMBasedJIT::LLVMBasedJIT(std::unique_ptr<llvm::orc::LLLazyJIT> JIT,
+                           std::unique_ptr<llvm::TargetMachine> TM,
+                           const TranslatorOptions &options)
+    : m_jit(std::move(JIT)), m_tm(std::move(TM)), m_pb(m_tm.get()) {
   auto &jdExpected = m_jit->getMainJITDylib();
 
   llvm::orc::SymbolMap mySymbolMap;
@@ -87,20 +426,100 @@ LLVMBasedJIT::LLVMBasedJIT(std::unique_ptr<llvm::orc::LLJIT> JIT)
 
   if (auto err = jdExpected.define(
           llvm::orc::absoluteSymbols(std::move(mySymbolMap)))) {
-    std::string msg;
-    llvm::raw_string_ostream{msg} << err;
-    throw std::runtime_error{"Failed to add special functions to jit: " + msg};
+    throw std::runtime_error{"Failed to add special functions to jit: " +
+                             toString(std::move(err))};
+  }
+
+  if (auto *linker = llvm::dyn_cast<llvm::orc::ObjectLinkingLayer>(
+          &m_jit->getObjLinkingLayer())) {
+    linker->addPlugin(std::make_unique<CodeSizePlugin>(m_stats));
+  }
+
+  m_pb.registerModuleAnalyses(m_mam);
+  m_pb.registerCGSCCAnalyses(m_cgam);
+  m_pb.registerFunctionAnalyses(m_fam);
+  m_pb.registerLoopAnalyses(m_lam);
+  m_pb.crossRegisterProxies(m_lam, m_fam, m_cgam, m_mam);
+
+  if (options.defaultPipeline) {
+    m_mpm = options.optLevel == 0
+                ? m_pb.buildO0DefaultPipeline(llvm::OptimizationLevel::O0)
+                : m_pb.buildPerModuleDefaultPipeline(
+                      getOptimizationLevel(options.optLevel));
+  }
+
+  switch (options.optLevel) {
+  case 0:
+    break;
+  case 1:
+    m_fpm.addPass(llvm::InstCombinePass{});
+    m_fpm.addPass(llvm::ReassociatePass{});
+    m_fpm.addPass(llvm::GVNPass{});
+    m_fpm.addPass(llvm::SimplifyCFGPass{});
+    break;
+  default:
+    m_fpm = m_pb.buildFunctionSimplificationPipeline(
+        getOptimizationLevel(options.optLevel),
+        llvm::ThinOrFullLTOPhase::None);
+    break;
   }
+
+  // Loop regions: SROA promotes guest registers, then loops are vectorized,
+  // unrolled and invariant code is hoisted out
+  m_regionFpm = m_pb.buildFunctionSimplificationPipeline(
+      llvm::OptimizationLevel::O3, llvm::ThinOrFullLTOPhase::None);
+  m_regionFpm.addPass(llvm::LoopVectorizePass{});
+  m_regionFpm.addPass(llvm::InstCombinePass{});
+  m_regionFpm.addPass(llvm::LoopUnrollPass{llvm::LoopUnrollOptions{3}});
+  m_regionFpm.addPass(llvm::createFunctionToLoopPassAdaptor(
+      llvm::LICMPass{llvm::LICMOptions{}}, /*UseMemorySSA=*/true));
+  m_regionFpm.addPass(llvm::SimplifyCFGPass{});
+
+  // Each lifted function is its own partition, so it is compiled only once
+  // it is called
+  m_jit->setPartitionFunction(
+      llvm::orc::CompileOnDemandLayer::compileRequested);
+  m_jit->getIRTransformLayer().setTransform(
+      [this](llvm::orc::ThreadSafeModule tsm,
+             llvm::orc::MaterializationResponsibility & /*resp*/)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        tsm.withModuleDo([&](llvm::Module &mod) { optimizeLifted(mod); });
+        return std::move(tsm);
+      });
 }
 
 } // namespace
 
-std::unique_ptr<Translator> makeLLVMBasedJIT() {
+std::unique_ptr<Translator> makeLLVMBasedJIT(const TranslatorOptions &options) {
   LLVMInitializeNativeTarget();
   LLVMInitializeNativeAsmPrinter();
   LLVMInitializeNativeAsmParser();
-  auto jitOrErr = llvm::orc::LLJITBuilder().create();
-  return std::make_unique<LLVMBasedJIT>(std::move(*jitOrErr));
+
+  auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!jtmb) {
+    throw std::runtime_error{"Failed to detect host: " +
+                             toString(jtmb.takeError())};
+  }
+  // Host CPU & its features (e.g. BMI2, AVX2) are detected as well
+  jtmb->setCodeGenOptLevel(getCodeGenOptLevel(options));
+  jtmb->getOptions().EnableFastISel =
+      jtmb->getCodeGenOptLevel() == llvm::CodeGenOptLevel::None;
+
+  auto tm = jtmb->createTargetMachine();
+  if (!tm) {
+    throw std::runtime_error{"Failed to create target machine: " +
+                             toString(tm.takeError())};
+  }
+
+  auto jitOrErr = llvm::orc::LLLazyJITBuilder()
+                      .setJITTargetMachineBuilder(*jtmb)
+                      .create();
+  if (!jitOrErr) {
+    throw std::runtime_error{"Failed to create jit: " +
+                             toString(jitOrErr.takeError())};
+  }
+  return std::make_unique<LLVMBasedJIT>(std::move(*jitOrErr), std::move(*tm),
+                                        options);
 }
 
 } // end namespace prot::engine
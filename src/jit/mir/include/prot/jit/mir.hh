@@ -6,7 +6,8 @@
 #include "prot/jit/base.hh"
 
 namespace prot::engine {
-std::unique_ptr<Translator> makeMirJit();
+std::unique_ptr<Translator>
+makeMirJit(const TranslatorOptions &options = {});
 }
 
 #endif // PROT_JIT_MIR_HH_INCLUDED
@@ -4,131 +4,19 @@ extern "C" {
 }
 
 #include "prot/jit/base.hh"
+#include "prot/jit/gir.hh"
+#include "prot/jit/mir.hh"
 
-namespace prot::engine {
-namespace {
-
-#define PROT_MIR_R_OP(OP, MIR_OP)                                              \
-  case k##OP: {                                                                \
-    loadReg(rs1_reg, insn.rs1());                                              \
-    loadReg(rs2_reg, insn.rs2());                                              \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_OP, MIR_new_reg_op(ctx, rd_reg),     \
-                                 MIR_new_reg_op(ctx, rs1_reg),                 \
-                                 MIR_new_reg_op(ctx, rs2_reg)));               \
-                                                                               \
-    setDst(insn.rd(), MIR_new_reg_op(ctx, rd_reg));                            \
-    break;                                                                     \
-  }
-
-#define PROT_MIR_I_OP(OP, MIR_OP)                                              \
-  case k##OP: {                                                                \
-    loadReg(rs1_reg, insn.rs1());                                              \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_OP, MIR_new_reg_op(ctx, rd_reg),     \
-                                 MIR_new_reg_op(ctx, rs1_reg),                 \
-                                 MIR_new_int_op(ctx, insn.imm())));            \
-    setDst(insn.rd(), MIR_new_reg_op(ctx, rd_reg));                            \
-    break;                                                                     \
-  }
+#include <algorithm>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#define PROT_MIR_ALU_OP(OP, MIR_OP)                                            \
-  PROT_MIR_R_OP(OP, MIR_OP)                                                    \
-  PROT_MIR_I_OP(OP##I, MIR_OP)
-
-#define PROT_MIR_B_COND_OP(OP, COND)                                           \
-  case k##OP: {                                                                \
-    MIR_label_t true_label = MIR_new_label(ctx);                               \
-    MIR_label_t end_label = MIR_new_label(ctx);                                \
-                                                                               \
-    loadReg(rs1_reg, insn.rs1());                                              \
-    loadReg(rs2_reg, insn.rs2());                                              \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, COND, MIR_new_label_op(ctx, true_label), \
-                                 MIR_new_reg_op(ctx, rs1_reg),                 \
-                                 MIR_new_reg_op(ctx, rs2_reg)));               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, pc_reg),   \
-                                 MIR_new_reg_op(ctx, pc_reg),                  \
-                                 MIR_new_int_op(ctx, isa::kWordSize)));        \
-                                                                               \
-    MIR_append_insn(                                                           \
-        ctx, func_item,                                                        \
-        MIR_new_insn(ctx, MIR_JMP, MIR_new_label_op(ctx, end_label)));         \
-                                                                               \
-    MIR_append_insn(ctx, func_item, true_label);                               \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, pc_reg),   \
-                                 MIR_new_reg_op(ctx, pc_reg),                  \
-                                 MIR_new_int_op(ctx, insn.imm())));            \
-    MIR_append_insn(ctx, func_item, end_label);                                \
-    break;                                                                     \
-  }
-
-#define PROT_MIR_S_OP(OP, FUNC, FUNC_PROTO, DATA_TYPE)                         \
-  case k##OP: {                                                                \
-    loadReg(rs1_reg, insn.rs1());                                              \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, rs1_reg),  \
-                                 MIR_new_reg_op(ctx, rs1_reg),                 \
-                                 MIR_new_int_op(ctx, insn.imm())));            \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rs2_reg),   \
-                                 getReg(insn.rs2())));                         \
-    MIR_item_t store_proto;                                                    \
-    auto find_res = m_func_proto.find(FUNC_PROTO);                             \
-    if (find_res == m_func_proto.end()) {                                      \
-      MIR_var_t store_args[] = {{MIR_T_P, "state", 0},                         \
-                                {MIR_T_U32, "addr", 0},                        \
-                                {DATA_TYPE, "val", 0}};                        \
-      store_proto =                                                            \
-          MIR_new_proto_arr(ctx, FUNC_PROTO, 0, nullptr, 3, store_args);       \
-      m_func_proto[FUNC_PROTO] = store_proto;                                  \
-    } else                                                                     \
-      store_proto = find_res->second;                                          \
-    MIR_append_insn(                                                           \
-        ctx, func_item,                                                        \
-        MIR_new_call_insn(ctx, 5, MIR_new_ref_op(ctx, store_proto),            \
-                          MIR_new_ref_op(ctx, MIR_new_import(ctx, FUNC)),      \
-                          MIR_new_reg_op(ctx, state_ptr),                      \
-                          MIR_new_reg_op(ctx, rs1_reg),                        \
-                          MIR_new_reg_op(ctx, rs2_reg)));                      \
-    break;                                                                     \
-  }
+#include <fmt/core.h>
 
-#define PROT_MIR_L_OP(OP, FUNC, FUNC_PROTO, DATA_TYPE)                         \
-  case k##OP: {                                                                \
-    loadReg(rs1_reg, insn.rs1());                                              \
-                                                                               \
-    MIR_append_insn(ctx, func_item,                                            \
-                    MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, rs1_reg),  \
-                                 MIR_new_reg_op(ctx, rs1_reg),                 \
-                                 MIR_new_int_op(ctx, insn.imm())));            \
-    MIR_item_t load_proto;                                                     \
-    auto find_res = m_func_proto.find(FUNC_PROTO);                             \
-    if (find_res == m_func_proto.end()) {                                      \
-      MIR_type_t load_res_types[] = {DATA_TYPE};                               \
-      MIR_var_t load_args[] = {{MIR_T_P, "state", 0}, {MIR_T_U32, "addr", 0}}; \
-      load_proto =                                                             \
-          MIR_new_proto_arr(ctx, FUNC_PROTO, 1, load_res_types, 2, load_args); \
-      m_func_proto[FUNC_PROTO] = load_proto;                                   \
-    } else                                                                     \
-      load_proto = find_res->second;                                           \
-    MIR_append_insn(                                                           \
-        ctx, func_item,                                                        \
-        MIR_new_call_insn(ctx, 5, MIR_new_ref_op(ctx, load_proto),             \
-                          MIR_new_ref_op(ctx, MIR_new_import(ctx, FUNC)),      \
-                          MIR_new_reg_op(ctx, rd_reg),                         \
-                          MIR_new_reg_op(ctx, state_ptr),                      \
-                          MIR_new_reg_op(ctx, rs1_reg)));                      \
-    setDst(insn.rd(), MIR_new_reg_op(ctx, rd_reg));                            \
-    break;                                                                     \
-  }
+namespace prot::engine {
+namespace {
 
 using JitFunction = void (*)(CPUState &);
 
@@ -142,9 +30,68 @@ template <typename T> T loadHelper(CPUState &state, isa::Addr addr) {
 
 void syscallHelper(CPUState &state) { state.emulateSysCall(); }
 
-class MIRJit : public Translator {
+// Helper protos & imports are module items, so they are created once per
+// module & shared by all its blocks
+struct ModuleItems final {
+  explicit ModuleItems(MIR_context_t ctx);
+
+  MIR_item_t loadWordProto{};
+  MIR_item_t loadHalfProto{};
+  MIR_item_t loadUHalfProto{};
+  MIR_item_t loadByteProto{};
+  MIR_item_t loadUByteProto{};
+  MIR_item_t storeWordProto{};
+  MIR_item_t storeHalfProto{};
+  MIR_item_t storeByteProto{};
+  MIR_item_t syscallProto{};
+
+  MIR_item_t loadWord{};
+  MIR_item_t loadHalf{};
+  MIR_item_t loadByte{};
+  MIR_item_t storeWord{};
+  MIR_item_t storeHalf{};
+  MIR_item_t storeByte{};
+  MIR_item_t syscall{};
+};
+
+ModuleItems::ModuleItems(MIR_context_t ctx) {
+  auto loadProto = [ctx](const char *name, MIR_type_t type) {
+    MIR_type_t load_res_types[] = {type};
+    MIR_var_t load_args[] = {{MIR_T_P, "state", 0}, {MIR_T_U32, "addr", 0}};
+    return MIR_new_proto_arr(ctx, name, 1, load_res_types, 2, load_args);
+  };
+  auto storeProto = [ctx](const char *name, MIR_type_t type) {
+    MIR_var_t store_args[] = {
+        {MIR_T_P, "state", 0}, {MIR_T_U32, "addr", 0}, {type, "val", 0}};
+    return MIR_new_proto_arr(ctx, name, 0, nullptr, 3, store_args);
+  };
+
+  loadWordProto = loadProto("loadHelperWordProto", MIR_T_U32);
+  loadHalfProto = loadProto("loadHelperHalfProto", MIR_T_I16);
+  loadUHalfProto = loadProto("loadHelperUHalfProto", MIR_T_U16);
+  loadByteProto = loadProto("loadHelperByteProto", MIR_T_I8);
+  loadUByteProto = loadProto("loadHelperUByteProto", MIR_T_U8);
+  storeWordProto = storeProto("storeHelperWordProto", MIR_T_U32);
+  storeHalfProto = storeProto("storeHelperHalfProto", MIR_T_I16);
+  storeByteProto = storeProto("storeHelperByteProto", MIR_T_I8);
+
+  MIR_var_t syscall_args[] = {{MIR_T_P, "state", 0}};
+  syscallProto =
+      MIR_new_proto_arr(ctx, "syscall_proto", 0, nullptr, 1, syscall_args);
+
+  loadWord = MIR_new_import(ctx, "loadHelperWord");
+  loadHalf = MIR_new_import(ctx, "loadHelperHalf");
+  loadByte = MIR_new_import(ctx, "loadHelperByte");
+  storeWord = MIR_new_import(ctx, "storeHelperWord");
+  storeHalf = MIR_new_import(ctx, "storeHelperHalf");
+  storeByte = MIR_new_import(ctx, "storeHelperByte");
+  syscall = MIR_new_import(ctx, "syscallHelper");
+}
+
+// MIR context is not thread safe, so each compile thread owns one
+class Context final {
 public:
-  MIRJit() : ctx(MIR_init()) {
+  explicit Context(bool lazy) : ctx(MIR_init()), m_lazy(lazy) {
     MIR_gen_init(ctx);
 
     MIR_load_external(ctx, "loadHelperWord",
@@ -166,234 +113,383 @@ public:
                       reinterpret_cast<void *>(syscallHelper));
   }
 
-  ~MIRJit() override {
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  ~Context() {
     MIR_gen_finish(ctx);
     MIR_finish(ctx);
   }
 
+  // Blocks are compiled in one module, entries are stored to res
+  void compile(std::span<const gir::Block> batch, std::span<JitFunction> res);
+
 private:
-  [[nodiscard]] JitFunction translate(const BBInfo &info) override;
+  MIR_item_t translate(const ModuleItems &items, const gir::Block &block);
 
   MIR_context_t ctx;
-  std::unordered_map<std::string, MIR_item_t> m_func_proto{};
+  // Basic blocks are generated on their first execution
+  bool m_lazy{};
 };
 
-JitFunction MIRJit::translate(const BBInfo &info) {
+class MIRJit final : public GirTranslator {
+public:
+  explicit MIRJit(const TranslatorOptions &options) : GirTranslator{options} {
+    const auto count = std::max(options.compileThreads, 1U);
+    for (unsigned idx = 0; idx < count; ++idx) {
+      m_contexts.push_back(std::make_unique<Context>(options.lazyCodegen));
+    }
+  }
+
+private:
+  [[nodiscard]] JitFunction lower(const gir::Block &block) override {
+    return compile(std::span{&block, 1}).front();
+  }
+
+  [[nodiscard]] std::vector<JitFunction>
+  translateBatch([[maybe_unused]] const CPUState &cpu,
+                 std::span<const BBInfo *const> batch) override {
+    std::vector<gir::Block> blocks;
+    blocks.reserve(batch.size());
+    for (const auto *info : batch) {
+      blocks.push_back(build(*info));
+    }
+    return compile(blocks);
+  }
+
+  std::vector<JitFunction> compile(std::span<const gir::Block> batch);
+
+  std::vector<std::unique_ptr<Context>> m_contexts;
+};
+
+// Batch is split between contexts which generate code concurrently
+std::vector<JitFunction> MIRJit::compile(std::span<const gir::Block> batch) {
+  std::vector<JitFunction> res(batch.size());
+  if (batch.empty()) {
+    return res;
+  }
+
+  // Rounding chunk size up may leave trailing contexts w/out blocks, e.g. 5
+  // blocks for 4 contexts take only 3 chunks of 2
+  const auto contexts = std::min(m_contexts.size(), batch.size());
+  const auto chunkSize = (batch.size() + contexts - 1) / contexts;
+  const auto chunks = (batch.size() + chunkSize - 1) / chunkSize;
+
+  auto compileChunk = [&](std::size_t idx) {
+    const auto begin = idx * chunkSize;
+    const auto size = std::min(chunkSize, batch.size() - begin);
+    m_contexts[idx]->compile(batch.subspan(begin, size),
+                             std::span{res}.subspan(begin, size));
+  };
+
+  std::vector<std::jthread> workers;
+  workers.reserve(chunks - 1);
+  for (std::size_t idx = 1; idx < chunks; ++idx) {
+    workers.emplace_back(compileChunk, idx);
+  }
+  compileChunk(0);
+  workers.clear();
+
+  return res;
+}
+
+void Context::compile(std::span<const gir::Block> batch,
+                      std::span<JitFunction> res) {
   MIR_module_t module = MIR_new_module(ctx, "jit_module");
+  const ModuleItems items{ctx};
+
+  std::vector<MIR_item_t> funcs;
+  funcs.reserve(batch.size());
+  for (const auto &block : batch) {
+    funcs.push_back(translate(items, block));
+  }
+
+  MIR_finish_module(ctx);
+  MIR_load_module(ctx, module);
 
+  // Code is generated while linking, unless it is deferred till execution
+  MIR_link(ctx, m_lazy ? MIR_set_lazy_bb_gen_interface : MIR_set_gen_interface,
+           nullptr);
+
+  std::ranges::transform(funcs, res.begin(), [this](MIR_item_t func_item) {
+    return reinterpret_cast<JitFunction>(
+        m_lazy ? func_item->addr : func_item->u.func->machine_code);
+  });
+}
+
+MIR_item_t Context::translate(const ModuleItems &items,
+                              const gir::Block &block) {
   MIR_var_t func_args[] = {{MIR_T_P, "state", 0}};
+  const auto name = fmt::format("bb_{:x}", block.pc);
   MIR_item_t func_item =
-      MIR_new_func_arr(ctx, "jit_func", 0, nullptr, 1, func_args);
+      MIR_new_func_arr(ctx, name.c_str(), 0, nullptr, 1, func_args);
 
   MIR_func_t func = func_item->u.func;
-
   MIR_reg_t state_ptr = MIR_reg(ctx, "state", func);
-  MIR_reg_t pc_reg = MIR_new_func_reg(ctx, func, MIR_T_I64, "pc");
-  MIR_reg_t rs1_reg = MIR_new_func_reg(ctx, func, MIR_T_I64, "rs1");
-  MIR_reg_t rs2_reg = MIR_new_func_reg(ctx, func, MIR_T_I64, "rs2");
-  MIR_reg_t rd_reg = MIR_new_func_reg(ctx, func, MIR_T_I64, "rd");
-
-  auto getReg = [this, state_ptr](auto regId) {
-    return MIR_new_mem_op(ctx, MIR_T_U32,
-                          offsetof(CPUState, regs) + isa::kWordSize * regId,
-                          state_ptr, 0, 0);
-  };
 
-  auto loadReg = [this, func_item, getReg](auto reg, auto regId) {
-    if (regId == 0)
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, reg),
-                                   MIR_new_int_op(ctx, 0)));
-    else
-      MIR_append_insn(
-          ctx, func_item,
-          MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, reg), getReg(regId)));
+  auto append = [this, func_item](MIR_insn_t insn) {
+    MIR_append_insn(ctx, func_item, insn);
+  };
+  auto stateOp = [this, state_ptr](MIR_type_t type, std::size_t offset) {
+    return MIR_new_mem_op(ctx, type, offset, state_ptr, 0, 0);
+  };
+  auto regOp = [&](isa::Operand reg) {
+    return stateOp(MIR_T_U32,
+                   offsetof(CPUState, regs) + isa::kWordSize * reg);
   };
 
-  auto getPC = [this, state_ptr]() {
-    return MIR_new_mem_op(ctx, MIR_T_U32, offsetof(CPUState, pc), state_ptr, 0,
-                          0);
+  // Each value w/ a result gets own reg, constants are immediates
+  std::vector<MIR_reg_t> regs(block.insts.size());
+  std::size_t numTemps{};
+  auto newReg = [&](std::string_view prefix, std::size_t idx) {
+    const auto regName = fmt::format("{}{}", prefix, idx);
+    return MIR_new_func_reg(ctx, func, MIR_T_I64, regName.c_str());
+  };
+  auto operand = [&](gir::Value val) {
+    const auto &inst = block[val];
+    if (inst.op == gir::Op::kConst) {
+      return MIR_new_int_op(ctx, inst.imm);
+    }
+    return MIR_new_reg_op(ctx, regs[val]);
+  };
+  // Helper args & first operands have to be regs
+  auto regOperand = [&](gir::Value val) {
+    const auto &inst = block[val];
+    if (inst.op != gir::Op::kConst) {
+      return MIR_new_reg_op(ctx, regs[val]);
+    }
+    const auto tmp = newReg("t", numTemps++);
+    append(MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, tmp),
+                        MIR_new_int_op(ctx, inst.imm)));
+    return MIR_new_reg_op(ctx, tmp);
   };
 
-  auto setDst = [this, func_item, getReg](auto dstId, auto dst_op) {
-    if (dstId != 0) {
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, getReg(dstId), dst_op));
+  auto binaryCode = [](gir::Op op) {
+    switch (op) {
+    case gir::Op::kAdd:
+      return MIR_ADDS;
+    case gir::Op::kSub:
+      return MIR_SUBS;
+    case gir::Op::kAnd:
+      return MIR_ANDS;
+    case gir::Op::kOr:
+      return MIR_ORS;
+    case gir::Op::kXor:
+      return MIR_XORS;
+    case gir::Op::kShl:
+      return MIR_LSHS;
+    case gir::Op::kShr:
+      return MIR_URSHS;
+    case gir::Op::kSar:
+      return MIR_RSHS;
+    default:
+      throw std::invalid_argument{"Unexpected GIR op"};
+    }
+  };
+  auto cmpCode = [](gir::Cond cond) {
+    switch (cond) {
+    case gir::Cond::kEq:
+      return MIR_EQS;
+    case gir::Cond::kNe:
+      return MIR_NES;
+    case gir::Cond::kLt:
+      return MIR_LTS;
+    case gir::Cond::kGe:
+      return MIR_GES;
+    case gir::Cond::kLtu:
+      return MIR_ULTS;
+    case gir::Cond::kGeu:
+      return MIR_UGES;
+    }
+    throw std::invalid_argument{"Unexpected GIR cond"};
+  };
+  auto branchCode = [](gir::Cond cond) {
+    switch (cond) {
+    case gir::Cond::kEq:
+      return MIR_BEQS;
+    case gir::Cond::kNe:
+      return MIR_BNES;
+    case gir::Cond::kLt:
+      return MIR_BLTS;
+    case gir::Cond::kGe:
+      return MIR_BGES;
+    case gir::Cond::kLtu:
+      return MIR_UBLTS;
+    case gir::Cond::kGeu:
+      return MIR_UBGES;
+    }
+    throw std::invalid_argument{"Unexpected GIR cond"};
+  };
+  auto loadItems = [&items](const gir::Inst &inst) {
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      return std::pair{items.loadByte,
+                       inst.sext ? items.loadByteProto : items.loadUByteProto};
+    case sizeof(isa::Half):
+      return std::pair{items.loadHalf,
+                       inst.sext ? items.loadHalfProto : items.loadUHalfProto};
+    default:
+      return std::pair{items.loadWord, items.loadWordProto};
+    }
+  };
+  // Direct stack access: zero extended guest address plus host base
+  auto stackOp = [&](const gir::Inst &inst) {
+    const auto addr = newReg("t", numTemps++);
+    const auto addrOp = MIR_new_reg_op(ctx, addr);
+    append(MIR_new_insn(ctx, MIR_UEXT32, addrOp, regOperand(inst.args[0])));
+    append(MIR_new_insn(
+        ctx, MIR_ADD, addrOp, addrOp,
+        MIR_new_int_op(ctx, reinterpret_cast<std::int64_t>(block.stackBase))));
+    auto type = MIR_T_U32;
+    if (inst.size == sizeof(isa::Byte)) {
+      type = inst.sext ? MIR_T_I8 : MIR_T_U8;
+    } else if (inst.size == sizeof(isa::Half)) {
+      type = inst.sext ? MIR_T_I16 : MIR_T_U16;
+    }
+    return MIR_new_mem_op(ctx, type, 0, addr, 0, 1);
+  };
+  auto storeItems = [&items](const gir::Inst &inst) {
+    switch (inst.size) {
+    case sizeof(isa::Byte):
+      return std::pair{items.storeByte, items.storeByteProto};
+    case sizeof(isa::Half):
+      return std::pair{items.storeHalf, items.storeHalfProto};
+    default:
+      return std::pair{items.storeWord, items.storeWordProto};
     }
   };
 
-  MIR_append_insn(
-      ctx, func_item,
-      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, pc_reg), getPC()));
-
-  for (const auto &insn : info.insns) {
-    switch (insn.opcode()) {
-      using enum isa::Opcode;
-
-      PROT_MIR_ALU_OP(ADD, MIR_ADDS)
-      PROT_MIR_ALU_OP(AND, MIR_ANDS)
-      PROT_MIR_ALU_OP(OR, MIR_ORS)
-      PROT_MIR_ALU_OP(XOR, MIR_XORS)
-
-      PROT_MIR_ALU_OP(SLL, MIR_LSHS)
-      PROT_MIR_ALU_OP(SRL, MIR_URSHS)
-      PROT_MIR_ALU_OP(SRA, MIR_RSHS)
-
-      PROT_MIR_R_OP(SUB, MIR_SUBS)
-
-      PROT_MIR_R_OP(SLT, MIR_LTS)
-      PROT_MIR_R_OP(SLTU, MIR_ULTS)
-
-      PROT_MIR_I_OP(SLTI, MIR_LTS)
-      PROT_MIR_I_OP(SLTIU, MIR_ULTS)
-
-      PROT_MIR_B_COND_OP(BEQ, MIR_BEQS)
-      PROT_MIR_B_COND_OP(BNE, MIR_BNES)
-      PROT_MIR_B_COND_OP(BLT, MIR_BLTS)
-      PROT_MIR_B_COND_OP(BGE, MIR_BGES)
-      PROT_MIR_B_COND_OP(BLTU, MIR_UBLTS)
-      PROT_MIR_B_COND_OP(BGEU, MIR_UBGES)
-
-      // PROT_MIR_L_OP
-      PROT_MIR_L_OP(LW, "loadHelperWord", "loadHelperWordProto", MIR_T_U32)
-      PROT_MIR_L_OP(LH, "loadHelperHalf", "loadHelperHalfProto", MIR_T_I16)
-      PROT_MIR_L_OP(LB, "loadHelperByte", "loadHelperByteProto", MIR_T_I8)
-
-      PROT_MIR_L_OP(LHU, "loadHelperHalf", "loadHelperUHalfProto", MIR_T_U16)
-      PROT_MIR_L_OP(LBU, "loadHelperByte", "loadHelperUByteProto", MIR_T_U8)
-
-      // PROT_MIR_S_OP
-      PROT_MIR_S_OP(SW, "storeHelperWord", "storeHelperWordProto", MIR_T_U32)
-      PROT_MIR_S_OP(SH, "storeHelperHalf", "storeHelperHalfProto", MIR_T_I16)
-      PROT_MIR_S_OP(SB, "storeHelperByte", "storeHelperByteProto", MIR_T_I8)
-
-    case kJAL: {
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_reg_op(ctx, pc_reg)));
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_int_op(ctx, isa::kWordSize)));
-      setDst(insn.rd(), MIR_new_reg_op(ctx, rd_reg));
-
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_int_op(ctx, insn.imm())));
-      break;
+  for (gir::Value val = 0; val < block.insts.size(); ++val) {
+    const auto &inst = block[val];
+    if (inst.hasResult() && inst.op != gir::Op::kConst) {
+      regs[val] = newReg("v", val);
     }
+    const auto dst = MIR_new_reg_op(ctx, regs[val]);
 
-    case kJALR: {
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_reg_op(ctx, pc_reg)));
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_reg_op(ctx, rd_reg),
-                                   MIR_new_int_op(ctx, isa::kWordSize)));
-
-      loadReg(rs1_reg, insn.rs1());
-
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_reg_op(ctx, rs1_reg),
-                                   MIR_new_int_op(ctx, insn.imm())));
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_AND, MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_int_op(ctx, ~1)));
-
-      setDst(insn.rd(), MIR_new_reg_op(ctx, rd_reg));
+    switch (inst.op) {
+    case gir::Op::kConst:
+    case gir::Op::kNop:
+      break;
+    case gir::Op::kGetReg:
+      append(MIR_new_insn(ctx, MIR_MOV, dst, regOp(inst.reg)));
+      break;
+    case gir::Op::kSetReg:
+      append(MIR_new_insn(ctx, MIR_MOV, regOp(inst.reg),
+                          operand(inst.args[0])));
       break;
-    }
 
-    case kLUI: {
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rs1_reg),
-                                   MIR_new_int_op(ctx, insn.imm())));
-      setDst(insn.rd(), MIR_new_reg_op(ctx, rs1_reg));
+    case gir::Op::kShl:
+    case gir::Op::kShr:
+    case gir::Op::kSar: {
+      // Shift amount is masked explicitly unless it is known
+      const auto &amount = block[inst.args[1]];
+      auto amountOp = MIR_new_int_op(ctx, isa::slice<4, 0>(amount.imm));
+      if (amount.op != gir::Op::kConst) {
+        const auto tmp = newReg("t", numTemps++);
+        amountOp = MIR_new_reg_op(ctx, tmp);
+        append(MIR_new_insn(ctx, MIR_ANDS, amountOp, operand(inst.args[1]),
+                            MIR_new_int_op(ctx, 0x1F)));
+      }
+      append(MIR_new_insn(ctx, binaryCode(inst.op), dst,
+                          regOperand(inst.args[0]), amountOp));
       break;
     }
+    case gir::Op::kAdd:
+    case gir::Op::kSub:
+    case gir::Op::kAnd:
+    case gir::Op::kOr:
+    case gir::Op::kXor:
+      append(MIR_new_insn(ctx, binaryCode(inst.op), dst,
+                          regOperand(inst.args[0]), operand(inst.args[1])));
+      break;
 
-    case kAUIPC: {
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rs1_reg),
-                                   MIR_new_reg_op(ctx, pc_reg)));
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, rs1_reg),
-                                   MIR_new_reg_op(ctx, rs1_reg),
-                                   MIR_new_int_op(ctx, insn.imm())));
-      setDst(insn.rd(), MIR_new_reg_op(ctx, rs1_reg));
+    case gir::Op::kCmp:
+      append(MIR_new_insn(ctx, cmpCode(inst.cond), dst,
+                          regOperand(inst.args[0]), operand(inst.args[1])));
+      break;
+    case gir::Op::kSelect: {
+      // dst = true value, skip false one if condition holds
+      MIR_label_t end_label = MIR_new_label(ctx);
+      append(MIR_new_insn(ctx, MIR_MOV, dst, operand(inst.args[1])));
+      if (const auto &cond = block[inst.args[0]]; cond.op == gir::Op::kCmp) {
+        append(MIR_new_insn(ctx, branchCode(cond.cond),
+                            MIR_new_label_op(ctx, end_label),
+                            regOperand(cond.args[0]),
+                            operand(cond.args[1])));
+      } else {
+        append(MIR_new_insn(ctx, MIR_BTS, MIR_new_label_op(ctx, end_label),
+                            regOperand(inst.args[0])));
+      }
+      append(MIR_new_insn(ctx, MIR_MOV, dst, operand(inst.args[2])));
+      append(end_label);
       break;
     }
 
-    case kECALL: {
-      MIR_var_t syscall_args[] = {{MIR_T_P, "state", 0}};
-      MIR_item_t syscall_proto =
-          MIR_new_proto_arr(ctx, "syscall_proto", 0, nullptr, 1, syscall_args);
-
-      MIR_append_insn(
-          ctx, func_item,
-          MIR_new_call_insn(
-              ctx, 3, MIR_new_ref_op(ctx, syscall_proto),
-              MIR_new_ref_op(ctx, MIR_new_import(ctx, "syscallHelper")),
-              MIR_new_reg_op(ctx, state_ptr)));
+    case gir::Op::kLoad: {
+      if (inst.stack) {
+        append(MIR_new_insn(ctx, MIR_MOV, dst, stackOp(inst)));
+        break;
+      }
+      const auto [helper, proto] = loadItems(inst);
+      append(MIR_new_call_insn(
+          ctx, 5, MIR_new_ref_op(ctx, proto), MIR_new_ref_op(ctx, helper), dst,
+          MIR_new_reg_op(ctx, state_ptr), regOperand(inst.args[0])));
       break;
     }
-
-    case kFENCE:
-    case kEBREAK:
-    case kPAUSE:
-    case kSBREAK:
-    case kSCALL:
+    case gir::Op::kStore: {
+      if (inst.stack) {
+        append(MIR_new_insn(ctx, MIR_MOV, stackOp(inst),
+                            regOperand(inst.args[1])));
+        break;
+      }
+      const auto [helper, proto] = storeItems(inst);
+      append(MIR_new_call_insn(
+          ctx, 5, MIR_new_ref_op(ctx, proto), MIR_new_ref_op(ctx, helper),
+          MIR_new_reg_op(ctx, state_ptr), regOperand(inst.args[0]),
+          regOperand(inst.args[1])));
       break;
-
-    case kNumOpcodes:
-      throw std::invalid_argument{"Unexpected insn id"};
-
-    default:
+    }
+    case gir::Op::kSyscall:
+      append(MIR_new_call_insn(ctx, 3, MIR_new_ref_op(ctx, items.syscallProto),
+                               MIR_new_ref_op(ctx, items.syscall),
+                               MIR_new_reg_op(ctx, state_ptr)));
+      break;
+    case gir::Op::kGuard: {
+      // Nothing is written yet, so plain return leaves state intact
+      MIR_label_t pass_label = MIR_new_label(ctx);
+      append(MIR_new_insn(ctx, MIR_BTS, MIR_new_label_op(ctx, pass_label),
+                          regOperand(inst.args[0])));
+      append(MIR_new_ret_insn(ctx, 0));
+      append(pass_label);
+      break;
+    }
+    case gir::Op::kExit:
+      append(MIR_new_insn(ctx, MIR_MOV,
+                          stateOp(MIR_T_U32, offsetof(CPUState, pc)),
+                          operand(inst.args[0])));
       break;
     }
-
-    if (!isa::changesPC(insn.opcode()))
-      MIR_append_insn(ctx, func_item,
-                      MIR_new_insn(ctx, MIR_ADDS, MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_reg_op(ctx, pc_reg),
-                                   MIR_new_int_op(ctx, isa::kWordSize)));
   }
 
-  MIR_append_insn(
-      ctx, func_item,
-      MIR_new_insn(ctx, MIR_MOV, getPC(), MIR_new_reg_op(ctx, pc_reg)));
-
-  MIR_append_insn(
-      ctx, func_item,
-      MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, rd_reg),
-                   MIR_new_mem_op(ctx, MIR_T_U32, offsetof(CPUState, icount),
-                                  state_ptr, 0, 0)));
-
-  MIR_append_insn(
-      ctx, func_item,
-      MIR_new_insn(ctx, MIR_ADDS,
-                   MIR_new_mem_op(ctx, MIR_T_U32, offsetof(CPUState, icount),
-                                  state_ptr, 0, 0),
-                   MIR_new_reg_op(ctx, rd_reg),
-                   MIR_new_int_op(ctx, info.insns.size())));
+  // Icount is 64 bit wide
+  const auto icount = newReg("t", numTemps++);
+  append(MIR_new_insn(ctx, MIR_MOV, MIR_new_reg_op(ctx, icount),
+                      stateOp(MIR_T_I64, offsetof(CPUState, icount))));
+  append(MIR_new_insn(ctx, MIR_ADD,
+                      stateOp(MIR_T_I64, offsetof(CPUState, icount)),
+                      MIR_new_reg_op(ctx, icount),
+                      MIR_new_int_op(ctx, block.icount)));
 
-  MIR_append_insn(ctx, func_item, MIR_new_ret_insn(ctx, 0));
+  append(MIR_new_ret_insn(ctx, 0));
 
   MIR_finish_func(ctx);
-  MIR_finish_module(ctx);
-
-  MIR_load_module(ctx, module);
 
-  MIR_link(ctx, MIR_set_gen_interface, nullptr);
-
-  return reinterpret_cast<JitFunction>(MIR_gen(ctx, func_item));
+  return func_item;
 }
 
 } // namespace
 
-std::unique_ptr<Translator> makeMirJit() { return std::make_unique<MIRJit>(); }
+std::unique_ptr<Translator> makeMirJit(const TranslatorOptions &options) {
+  return std::make_unique<MIRJit>(options);
+}
 } // namespace prot::engine
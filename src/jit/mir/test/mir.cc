@@ -0,0 +1,58 @@
+#include "prot/jit/mir.hh"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace {
+using namespace prot;
+
+constexpr isa::Operand kA0 = 10;
+
+isa::Instruction decode(isa::Word word) {
+  return isa::Instruction::decode(word).value();
+}
+
+// addi a0, a0, imm
+isa::Word addiA0(std::int32_t imm) {
+  return (static_cast<isa::Word>(imm) & 0xfffU) << 20U | isa::Word{kA0} << 15U |
+         isa::Word{kA0} << 7U | 0x13U;
+}
+
+// jal x0, +8
+constexpr isa::Word kJumpOver = 0x0080006f;
+
+TEST(MirTest, BatchNotDividedByThreads) {
+  // 4 threads get 5 blocks as chunks of 2, 2 & 1
+  engine::TranslatorOptions options;
+  options.compileThreads = 4;
+  const auto translator = engine::makeMirJit(options);
+  auto mem = memory::makePlain(0x1000);
+  CPUState cpu{mem.get()};
+
+  constexpr std::size_t kBlocks = 5;
+  std::vector<engine::BBInfo> infos(kBlocks);
+  std::vector<const engine::BBInfo *> batch;
+  for (std::size_t idx = 0; idx < kBlocks; ++idx) {
+    auto &info = infos[idx];
+    info.pc = static_cast<isa::Addr>(0x100 * idx);
+    info.insns = {decode(addiA0(static_cast<std::int32_t>(idx) + 1)),
+                  decode(kJumpOver)};
+    info.icount = info.insns.size();
+    batch.push_back(&info);
+  }
+
+  const auto codes = translator->translateBatch(cpu, batch);
+  ASSERT_EQ(codes.size(), kBlocks);
+  for (std::size_t idx = 0; idx < kBlocks; ++idx) {
+    ASSERT_NE(codes[idx], nullptr);
+    cpu.setReg(kA0, 0);
+    cpu.setPC(infos[idx].pc);
+    codes[idx](cpu);
+    EXPECT_EQ(cpu.getReg(kA0), idx + 1);
+    EXPECT_EQ(cpu.getPC(), infos[idx].pc + 4 + 8);
+  }
+}
+} // namespace
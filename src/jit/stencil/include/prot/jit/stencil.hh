@@ -0,0 +1,13 @@
+#ifndef PROT_JIT_STENCIL_HH_INCLUDED
+#define PROT_JIT_STENCIL_HH_INCLUDED
+
+#include <memory>
+
+#include "prot/jit/base.hh"
+
+namespace prot::engine {
+// Copy-and-patch JIT: blocks are glued from precompiled machine code stencils
+std::unique_ptr<Translator> makeStencil();
+}
+
+#endif // PROT_JIT_STENCIL_HH_INCLUDED
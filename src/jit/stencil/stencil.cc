@@ -0,0 +1,284 @@
+#include "prot/jit/stencil.hh"
+#include "prot/jit/base.hh"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace prot::engine {
+namespace {
+enum class HoleKind : std::uint8_t {
+  kRd,
+  kRs1,
+  kRs2,
+  kImm,
+  kImm2,
+  kFnLo,
+  kFnHi,
+  kCont,
+};
+
+enum class RelocKind : std::uint8_t {
+  kAbs32,
+  kPcRel32,
+};
+
+struct Hole final {
+  std::uint32_t offset{};
+  HoleKind kind{};
+  RelocKind reloc{};
+  std::int32_t addend{};
+};
+
+#include "stencils.inc"
+
+#define PROT_STENCIL_LIST(X)                                                   \
+  X(ADD) X(ADDI) X(AND) X(ANDI) X(OR) X(ORI) X(XOR) X(XORI) X(SLL) X(SLLI)     \
+  X(SRL) X(SRLI) X(SRA) X(SRAI) X(SLT) X(SLTI) X(SLTU) X(SLTIU) X(SUB)         \
+  X(SHADD) X(LI) X(LB) X(LBU) X(LH) X(LHU) X(LW) X(SB) X(SH) X(SW) X(BEQ)     \
+  X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU) X(JAL) X(J) X(JALR) X(JR) X(ECALL)     \
+  X(SetPC) X(ZeroX0) X(Exit)
+
+enum class StencilId : std::uint8_t {
+#define PROT_MAKE_ID(name) k##name,
+  PROT_STENCIL_LIST(PROT_MAKE_ID)
+#undef PROT_MAKE_ID
+};
+
+struct Stencil final {
+  std::span<const std::uint8_t> code;
+  std::span<const Hole> holes;
+};
+
+constexpr std::array kStencils = {
+#define PROT_MAKE_STENCIL(name)                                                \
+  Stencil{.code = k##name##Code, .holes = k##name##Holes},
+    PROT_STENCIL_LIST(PROT_MAKE_STENCIL)
+#undef PROT_MAKE_STENCIL
+};
+
+void syscallHelper(CPUState &state) { state.emulateSysCall(); }
+
+// Values for stencil holes, registers are given by ids
+struct Operands final {
+  isa::Operand rd{};
+  isa::Operand rs1{};
+  isa::Operand rs2{};
+  isa::Word imm{};
+  isa::Word imm2{};
+};
+
+class StencilJit final : public Translator {
+public:
+  StencilJit() = default;
+
+private:
+  [[nodiscard]] JitFunction translate(const BBInfo &info) override;
+
+  void emit(StencilId id, const Operands &ops = {});
+  void translateInsn(const isa::Instruction &insn, isa::Addr pc);
+
+  std::vector<std::uint8_t> m_code;
+  std::vector<CodeHolder> m_holders;
+};
+
+void StencilJit::emit(StencilId id, const Operands &ops) {
+  const auto &stencil = kStencils[toUnderlying(id)];
+  const auto start = m_code.size();
+  m_code.insert(m_code.end(), stencil.code.begin(), stencil.code.end());
+  // Continuation is the stencil placed right after this one
+  const auto end = m_code.size();
+
+  auto getRegOffset = [](isa::Operand reg) -> std::uint64_t {
+    return offsetof(CPUState, regs) + isa::kWordSize * reg;
+  };
+  const auto helper = reinterpret_cast<std::uintptr_t>(&syscallHelper);
+
+  for (const auto &hole : stencil.holes) {
+    const auto pos = start + hole.offset;
+    const std::uint64_t value = [&]() -> std::uint64_t {
+      switch (hole.kind) {
+      case HoleKind::kRd:
+        return getRegOffset(ops.rd);
+      case HoleKind::kRs1:
+        return getRegOffset(ops.rs1);
+      case HoleKind::kRs2:
+        return getRegOffset(ops.rs2);
+      case HoleKind::kImm:
+        return ops.imm;
+      case HoleKind::kImm2:
+        return ops.imm2;
+      case HoleKind::kFnLo:
+        return helper & ~isa::Word{};
+      case HoleKind::kFnHi:
+        return helper >> sizeofBits<isa::Word>();
+      case HoleKind::kCont:
+        return end - pos;
+      }
+      throw std::invalid_argument{"Unexpected hole kind"};
+    }();
+
+    const auto patched = static_cast<std::uint32_t>(value + hole.addend);
+    std::memcpy(m_code.data() + pos, &patched, sizeof(patched));
+  }
+}
+
+void StencilJit::translateInsn(const isa::Instruction &insn, isa::Addr pc) {
+  const auto next = pc + insn.size();
+  const Operands ops{.rd = insn.rd(),
+                     .rs1 = insn.rs1(),
+                     .rs2 = insn.rs2(),
+                     .imm = insn.imm(),
+                     .imm2 = next};
+
+  switch (insn.opcode()) {
+    using enum isa::Opcode;
+#define PROT_MAKE_ALU(OP)                                                      \
+  case k##OP:                                                                  \
+    if (insn.rd() != 0) {                                                      \
+      emit(StencilId::k##OP, ops);                                             \
+    }                                                                          \
+    break;
+
+    PROT_MAKE_ALU(ADD)
+    PROT_MAKE_ALU(ADDI)
+    PROT_MAKE_ALU(AND)
+    PROT_MAKE_ALU(ANDI)
+    PROT_MAKE_ALU(OR)
+    PROT_MAKE_ALU(ORI)
+    PROT_MAKE_ALU(XOR)
+    PROT_MAKE_ALU(XORI)
+    PROT_MAKE_ALU(SLL)
+    PROT_MAKE_ALU(SLLI)
+    PROT_MAKE_ALU(SRL)
+    PROT_MAKE_ALU(SRLI)
+    PROT_MAKE_ALU(SRA)
+    PROT_MAKE_ALU(SRAI)
+    PROT_MAKE_ALU(SLT)
+    PROT_MAKE_ALU(SLTI)
+    PROT_MAKE_ALU(SLTU)
+    PROT_MAKE_ALU(SLTIU)
+    PROT_MAKE_ALU(SUB)
+    PROT_MAKE_ALU(SHADD)
+    PROT_MAKE_ALU(LI)
+#undef PROT_MAKE_ALU
+
+  case kLUI:
+    if (insn.rd() != 0) {
+      emit(StencilId::kLI, ops);
+    }
+    break;
+  case kAUIPC:
+  case kLA:
+    if (insn.rd() != 0) {
+      emit(StencilId::kLI, {.rd = insn.rd(), .imm = pc + insn.imm()});
+    }
+    break;
+
+#define PROT_MAKE_LOAD(OP)                                                     \
+  case k##OP:                                                                  \
+    emit(StencilId::k##OP, ops);                                               \
+    if (insn.rd() == 0) {                                                      \
+      emit(StencilId::kZeroX0);                                                \
+    }                                                                          \
+    break;
+
+    PROT_MAKE_LOAD(LB)
+    PROT_MAKE_LOAD(LBU)
+    PROT_MAKE_LOAD(LH)
+    PROT_MAKE_LOAD(LHU)
+    PROT_MAKE_LOAD(LW)
+#undef PROT_MAKE_LOAD
+
+  case kLWPC:
+    // x0 is always zero, so absolute address is used as an offset
+    emit(StencilId::kLW, {.rd = insn.rd(), .rs1 = 0, .imm = pc + insn.imm()});
+    // Dead loads keep their access, but write x0
+    if (insn.rd() == 0) {
+      emit(StencilId::kZeroX0);
+    }
+    break;
+
+  case kSB:
+    emit(StencilId::kSB, ops);
+    break;
+  case kSH:
+    emit(StencilId::kSH, ops);
+    break;
+  case kSW:
+    emit(StencilId::kSW, ops);
+    break;
+
+#define PROT_MAKE_BRANCH(OP)                                                   \
+  case k##OP:                                                                  \
+    emit(StencilId::k##OP, {.rs1 = insn.rs1(),                                 \
+                            .rs2 = insn.rs2(),                                 \
+                            .imm = pc + insn.imm(),                            \
+                            .imm2 = next});                                    \
+    break;
+
+    PROT_MAKE_BRANCH(BEQ)
+    PROT_MAKE_BRANCH(BNE)
+    PROT_MAKE_BRANCH(BLT)
+    PROT_MAKE_BRANCH(BGE)
+    PROT_MAKE_BRANCH(BLTU)
+    PROT_MAKE_BRANCH(BGEU)
+#undef PROT_MAKE_BRANCH
+
+  case kJAL:
+  case kCALL: {
+    auto target = pc + insn.imm();
+    if (insn.opcode() == kCALL) {
+      target &= ~isa::Word{1};
+    }
+    emit(insn.rd() != 0 ? StencilId::kJAL : StencilId::kJ,
+         {.rd = insn.rd(), .imm = target, .imm2 = next});
+    break;
+  }
+  case kJALR:
+    emit(insn.rd() != 0 ? StencilId::kJALR : StencilId::kJR, ops);
+    break;
+
+  case kECALL:
+    emit(StencilId::kECALL);
+    break;
+  case kEBREAK:
+  case kFENCE:
+  case kPAUSE:
+  case kSBREAK:
+  case kSCALL:
+    break;
+  case kNumOpcodes:
+    throw std::invalid_argument{"Unexpected insn id"};
+  }
+}
+
+JitFunction StencilJit::translate(const BBInfo &info) {
+  m_code.clear();
+
+  // PC is constant for translated block, so pc-relative values are patched
+  // and PC itself is written only by control flow insns or at the very end
+  auto pc = info.pc;
+  for (const auto &insn : info.insns) {
+    translateInsn(insn, pc);
+    pc += insn.size();
+  }
+  if (!isa::changesPC(info.insns.back().opcode())) {
+    emit(StencilId::kSetPC, {.imm = pc});
+  }
+  emit(StencilId::kExit, {.imm = static_cast<isa::Word>(info.icount)});
+
+  return m_holders.emplace_back(std::as_bytes(std::span{m_code}))
+      .as<JitFunction>();
+}
+} // namespace
+
+std::unique_ptr<Translator> makeStencil() {
+  return std::make_unique<StencilJit>();
+}
+} // namespace prot::engine
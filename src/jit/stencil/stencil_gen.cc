@@ -0,0 +1,221 @@
+// Build-time tool: extracts copy-and-patch stencils from relocatable x86-64
+// ELF object (see stencils.cc) and emits them as C++ tables
+#include <elf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+
+namespace {
+constexpr std::string_view kStencilPrefix = ".text.prot_stencil_";
+constexpr std::string_view kHolePrefix = "prot_hole_";
+
+// Symbol suffix -> HoleKind enumerator
+const std::map<std::string_view, std::string_view> kHoleKinds = {
+    {"rd", "kRd"},       {"rs1", "kRs1"},       {"rs2", "kRs2"},
+    {"imm", "kImm"},     {"imm2", "kImm2"},     {"fn_lo", "kFnLo"},
+    {"fn_hi", "kFnHi"},  {"cont", "kCont"},
+};
+
+struct Hole final {
+  std::uint64_t offset{};
+  std::string_view kind;
+  std::string_view reloc;
+  std::int64_t addend{};
+};
+
+struct Stencil final {
+  std::string name;
+  std::vector<std::uint8_t> code;
+  std::vector<Hole> holes;
+};
+
+class ObjectFile final {
+public:
+  explicit ObjectFile(const std::string &path) {
+    std::ifstream ifs{path, std::ios::binary};
+    if (!ifs) {
+      throw std::runtime_error{fmt::format("Failed to open {}", path)};
+    }
+    m_data.assign(std::istreambuf_iterator<char>{ifs}, {});
+
+    const auto &ehdr = get<Elf64_Ehdr>(0);
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_type != ET_REL ||
+        ehdr.e_machine != EM_X86_64) {
+      throw std::runtime_error{
+          fmt::format("{} is not x86-64 relocatable ELF", path)};
+    }
+
+    for (std::size_t idx = 0; idx < ehdr.e_shnum; ++idx) {
+      m_sections.push_back(
+          get<Elf64_Shdr>(ehdr.e_shoff + idx * ehdr.e_shentsize));
+    }
+    m_shstrtab = m_sections.at(ehdr.e_shstrndx).sh_offset;
+  }
+
+  [[nodiscard]] std::vector<Stencil> extract() const {
+    std::vector<Stencil> stencils;
+    for (std::size_t idx = 0; idx < m_sections.size(); ++idx) {
+      const auto name = getSectionName(idx);
+      if (!name.starts_with(kStencilPrefix)) {
+        continue;
+      }
+
+      const auto &sec = m_sections[idx];
+      Stencil stencil{.name = std::string{name.substr(kStencilPrefix.size())},
+                      .code = {},
+                      .holes = {}};
+      const auto *begin = m_data.data() + sec.sh_offset;
+      stencil.code.assign(begin, begin + sec.sh_size);
+      stencil.holes = collectHoles(idx, stencil.name);
+
+      stencils.push_back(std::move(stencil));
+    }
+
+    return stencils;
+  }
+
+private:
+  template <typename T> [[nodiscard]] const T &get(std::size_t offset) const {
+    if (offset + sizeof(T) > m_data.size()) {
+      throw std::runtime_error{"Truncated ELF file"};
+    }
+    // NOLINTNEXTLINE
+    return *reinterpret_cast<const T *>(m_data.data() + offset);
+  }
+
+  [[nodiscard]] std::string_view getString(std::size_t offset) const {
+    return m_data.data() + offset;
+  }
+
+  [[nodiscard]] std::string_view getSectionName(std::size_t idx) const {
+    return getString(m_shstrtab + m_sections[idx].sh_name);
+  }
+
+  [[nodiscard]] std::vector<Hole> collectHoles(std::size_t textIdx,
+                                               std::string_view name) const {
+    std::vector<Hole> holes;
+    for (const auto &rela : m_sections) {
+      if (rela.sh_type != SHT_RELA || rela.sh_info != textIdx) {
+        continue;
+      }
+
+      const auto &symtab = m_sections.at(rela.sh_link);
+      const auto strtab = m_sections.at(symtab.sh_link).sh_offset;
+      for (std::size_t off = 0; off < rela.sh_size; off += rela.sh_entsize) {
+        const auto &entry = get<Elf64_Rela>(rela.sh_offset + off);
+        const auto &sym = get<Elf64_Sym>(symtab.sh_offset +
+                                         ELF64_R_SYM(entry.r_info) *
+                                             symtab.sh_entsize);
+        const auto symName = getString(strtab + sym.st_name);
+        const auto type = ELF64_R_TYPE(entry.r_info);
+
+        const auto kind = symName.starts_with(kHolePrefix)
+                              ? kHoleKinds.find(
+                                    symName.substr(kHolePrefix.size()))
+                              : kHoleKinds.end();
+        if (kind == kHoleKinds.end()) {
+          throw std::runtime_error{fmt::format(
+              "Stencil {} references {}: only holes are allowed", name,
+              symName)};
+        }
+
+        const bool isCont = kind->second == "kCont";
+        const bool pcRel = type == R_X86_64_PC32 || type == R_X86_64_PLT32;
+        const bool abs = type == R_X86_64_32 || type == R_X86_64_32S;
+        if ((isCont && !pcRel) || (!isCont && !abs)) {
+          throw std::runtime_error{fmt::format(
+              "Stencil {}: unsupported relocation {} against {}", name, type,
+              symName)};
+        }
+
+        holes.push_back(Hole{.offset = entry.r_offset,
+                             .kind = kind->second,
+                             .reloc = pcRel ? "kPcRel32" : "kAbs32",
+                             .addend = entry.r_addend});
+      }
+    }
+
+    std::ranges::sort(holes, {}, &Hole::offset);
+    return holes;
+  }
+
+  std::vector<char> m_data;
+  std::vector<Elf64_Shdr> m_sections;
+  std::size_t m_shstrtab{};
+};
+
+// Continuation jump at the very end falls through to the next stencil
+void dropTailJump(Stencil &stencil) {
+  constexpr std::uint8_t kJmpRel32 = 0xe9;
+  constexpr std::size_t kJmpSize = 5;
+
+  if (stencil.holes.empty() || stencil.code.size() < kJmpSize) {
+    return;
+  }
+  const auto &last = stencil.holes.back();
+  const auto jmpOffset = stencil.code.size() - kJmpSize;
+  if (last.kind == "kCont" && last.offset == jmpOffset + 1 &&
+      stencil.code[jmpOffset] == kJmpRel32) {
+    stencil.holes.pop_back();
+    stencil.code.resize(jmpOffset);
+  }
+}
+
+void emit(std::ostream &ost, std::span<const Stencil> stencils) {
+  ost << "// Generated by prot_stencil_gen, do not edit\n";
+  for (const auto &stencil : stencils) {
+    ost << fmt::format(
+        "inline constexpr std::array<std::uint8_t, {}> k{}Code{{",
+        stencil.code.size(), stencil.name);
+    for (std::size_t idx = 0; idx < stencil.code.size(); ++idx) {
+      ost << (idx % 12 == 0 ? "\n    " : " ")
+          << fmt::format("{:#04x},", stencil.code[idx]);
+    }
+    ost << "};\n";
+
+    ost << fmt::format("inline constexpr std::array<Hole, {}> k{}Holes{{{{",
+                       stencil.holes.size(), stencil.name);
+    for (const auto &hole : stencil.holes) {
+      ost << fmt::format("\n    {{.offset = {:#x}, .kind = HoleKind::{}, "
+                         ".reloc = RelocKind::{}, .addend = {}}},",
+                         hole.offset, hole.kind, hole.reloc, hole.addend);
+    }
+    ost << "}};\n\n";
+  }
+}
+} // namespace
+
+int main(int argc, char **argv) try {
+  const std::span args{argv, static_cast<std::size_t>(argc)};
+  if (args.size() != 3) {
+    std::cerr << fmt::format("Usage: {} <stencils.o> <output.inc>\n",
+                             args[0]);
+    return 1;
+  }
+
+  auto stencils = ObjectFile{args[1]}.extract();
+  if (stencils.empty()) {
+    throw std::runtime_error{"No stencils found"};
+  }
+  std::ranges::for_each(stencils, dropTailJump);
+
+  std::ofstream ofs{args[2]};
+  emit(ofs, stencils);
+  return 0;
+} catch (const std::exception &ex) {
+  std::cerr << ex.what() << std::endl;
+  return 1;
+}
@@ -0,0 +1,221 @@
+// Copy-and-patch stencils. This file is compiled to a plain object file and
+// never linked: prot_stencil_gen extracts machine code of every
+// prot_stencil_* function and records relocations against prot_hole_* symbols
+// as holes which are patched by translator
+#include "prot/cpu_state.hh"
+#include "prot/isa.hh"
+#include "prot/memory.hh"
+
+#include <cstdint>
+
+#if defined(__has_cpp_attribute) && __has_cpp_attribute(clang::musttail)
+#define PROT_MUSTTAIL [[clang::musttail]]
+#elif defined(__has_cpp_attribute) && __has_cpp_attribute(gnu::musttail)
+#define PROT_MUSTTAIL [[gnu::musttail]]
+#else
+#define PROT_MUSTTAIL
+#endif
+
+// Holes are never defined: translator patches values in place of their
+// addresses. Register holes hold byte offsets of registers in CPUState
+extern "C" {
+// NOLINTBEGIN
+extern char prot_hole_rd[];
+extern char prot_hole_rs1[];
+extern char prot_hole_rs2[];
+extern char prot_hole_imm[];
+extern char prot_hole_imm2[];
+extern char prot_hole_fn_lo[];
+extern char prot_hole_fn_hi[];
+
+// Next stencil in block
+void prot_hole_cont(prot::CPUState &cpu);
+// NOLINTEND
+}
+
+namespace {
+using prot::CPUState;
+namespace isa = prot::isa;
+
+std::uintptr_t holeValue(const char *hole) {
+  // NOLINTNEXTLINE
+  return reinterpret_cast<std::uintptr_t>(hole);
+}
+
+isa::Word imm() { return static_cast<isa::Word>(holeValue(prot_hole_imm)); }
+isa::Word imm2() { return static_cast<isa::Word>(holeValue(prot_hole_imm2)); }
+
+isa::Word &reg(CPUState &cpu, const char *hole) {
+  // NOLINTNEXTLINE
+  return *reinterpret_cast<isa::Word *>(reinterpret_cast<char *>(&cpu) +
+                                        holeValue(hole));
+}
+
+isa::Word &rd(CPUState &cpu) { return reg(cpu, prot_hole_rd); }
+isa::Word rs1(CPUState &cpu) { return reg(cpu, prot_hole_rs1); }
+isa::Word rs2(CPUState &cpu) { return reg(cpu, prot_hole_rs2); }
+
+isa::Word sll(isa::Word lhs, isa::Word rhs) {
+  return lhs << isa::slice<4, 0>(rhs);
+}
+isa::Word srl(isa::Word lhs, isa::Word rhs) {
+  return lhs >> isa::slice<4, 0>(rhs);
+}
+isa::Word sra(isa::Word lhs, isa::Word rhs) {
+  return static_cast<std::make_signed_t<isa::Word>>(lhs) >>
+         isa::slice<4, 0>(rhs);
+}
+
+template <typename T, bool Signed> isa::Word load(CPUState &cpu) {
+  isa::Word loaded = cpu.memory->read<T>(rs1(cpu) + imm());
+  if constexpr (Signed) {
+    loaded = isa::signExtend<prot::sizeofBits<isa::Word>(),
+                             prot::sizeofBits<T>()>(loaded);
+  }
+  return loaded;
+}
+
+template <typename T> void store(CPUState &cpu) {
+  cpu.memory->write(rs1(cpu) + imm(), static_cast<T>(rs2(cpu)));
+}
+} // namespace
+
+#define PROT_STENCIL(name) extern "C" void prot_stencil_##name(CPUState &cpu)
+#define PROT_CONTINUE() PROT_MUSTTAIL return prot_hole_cont(cpu)
+
+#define PROT_MAKE_ALU(OP, expr)                                                \
+  PROT_STENCIL(OP) {                                                           \
+    const auto lhs = rs1(cpu);                                                 \
+    const auto rhs = rs2(cpu);                                                 \
+    rd(cpu) = (expr);                                                          \
+    PROT_CONTINUE();                                                           \
+  }                                                                            \
+  PROT_STENCIL(OP##I) {                                                        \
+    const auto lhs = rs1(cpu);                                                 \
+    const auto rhs = imm();                                                    \
+    rd(cpu) = (expr);                                                          \
+    PROT_CONTINUE();                                                           \
+  }
+
+PROT_MAKE_ALU(ADD, lhs + rhs)
+PROT_MAKE_ALU(AND, lhs &rhs)
+PROT_MAKE_ALU(OR, lhs | rhs)
+PROT_MAKE_ALU(XOR, lhs ^ rhs)
+PROT_MAKE_ALU(SLL, sll(lhs, rhs))
+PROT_MAKE_ALU(SRL, srl(lhs, rhs))
+PROT_MAKE_ALU(SRA, sra(lhs, rhs))
+PROT_MAKE_ALU(SLT, isa::signedLess(lhs, rhs))
+#undef PROT_MAKE_ALU
+
+PROT_STENCIL(SUB) {
+  rd(cpu) = rs1(cpu) - rs2(cpu);
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(SLTU) {
+  rd(cpu) = rs1(cpu) < rs2(cpu);
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(SLTIU) {
+  rd(cpu) = rs1(cpu) < imm();
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(SHADD) {
+  rd(cpu) = sll(rs1(cpu), imm()) + rs2(cpu);
+  PROT_CONTINUE();
+}
+
+// LUI, LI and pc-relative AUIPC, LA (pc is known at translation time)
+PROT_STENCIL(LI) {
+  rd(cpu) = imm();
+  PROT_CONTINUE();
+}
+
+#define PROT_MAKE_LOAD(OP, T, Signed)                                          \
+  PROT_STENCIL(OP) {                                                           \
+    rd(cpu) = load<T, Signed>(cpu);                                            \
+    PROT_CONTINUE();                                                           \
+  }
+
+PROT_MAKE_LOAD(LB, isa::Byte, true)
+PROT_MAKE_LOAD(LBU, isa::Byte, false)
+PROT_MAKE_LOAD(LH, isa::Half, true)
+PROT_MAKE_LOAD(LHU, isa::Half, false)
+PROT_MAKE_LOAD(LW, isa::Word, false)
+#undef PROT_MAKE_LOAD
+
+#define PROT_MAKE_STORE(OP, T)                                                 \
+  PROT_STENCIL(OP) {                                                           \
+    store<T>(cpu);                                                             \
+    PROT_CONTINUE();                                                           \
+  }
+
+PROT_MAKE_STORE(SB, isa::Byte)
+PROT_MAKE_STORE(SH, isa::Half)
+PROT_MAKE_STORE(SW, isa::Word)
+#undef PROT_MAKE_STORE
+
+// Branch targets are patched: imm is taken target, imm2 is fallthrough
+#define PROT_MAKE_BRANCH(OP, cond)                                             \
+  PROT_STENCIL(OP) {                                                           \
+    const auto lhs = rs1(cpu);                                                 \
+    const auto rhs = rs2(cpu);                                                 \
+    cpu.pc = (cond) ? imm() : imm2();                                          \
+    PROT_CONTINUE();                                                           \
+  }
+
+PROT_MAKE_BRANCH(BEQ, lhs == rhs)
+PROT_MAKE_BRANCH(BNE, lhs != rhs)
+PROT_MAKE_BRANCH(BLT, isa::signedLess(lhs, rhs))
+PROT_MAKE_BRANCH(BGE, !isa::signedLess(lhs, rhs))
+PROT_MAKE_BRANCH(BLTU, lhs < rhs)
+PROT_MAKE_BRANCH(BGEU, lhs >= rhs)
+#undef PROT_MAKE_BRANCH
+
+// JAL and CALL: imm is target, imm2 is return address
+PROT_STENCIL(JAL) {
+  rd(cpu) = imm2();
+  cpu.pc = imm();
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(J) {
+  cpu.pc = imm();
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(JALR) {
+  const auto target = (rs1(cpu) + imm()) & ~isa::Word{1};
+  rd(cpu) = imm2();
+  cpu.pc = target;
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(JR) {
+  cpu.pc = (rs1(cpu) + imm()) & ~isa::Word{1};
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(ECALL) {
+  using Helper = void (*)(CPUState &);
+  const auto addr = (holeValue(prot_hole_fn_hi) << 32U) |
+                    static_cast<isa::Word>(holeValue(prot_hole_fn_lo));
+  // NOLINTNEXTLINE
+  reinterpret_cast<Helper>(addr)(cpu);
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(SetPC) {
+  cpu.pc = imm();
+  PROT_CONTINUE();
+}
+
+// Loads to x0 still have to access memory, so register is cleared after them
+PROT_STENCIL(ZeroX0) {
+  cpu.regs[0] = 0;
+  PROT_CONTINUE();
+}
+
+PROT_STENCIL(Exit) { cpu.icount += imm(); }
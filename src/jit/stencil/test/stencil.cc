@@ -0,0 +1,48 @@
+#include "prot/jit/stencil.hh"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+namespace {
+using namespace prot;
+
+constexpr isa::Operand kA1 = 11;
+
+isa::Instruction decode(isa::Word word) {
+  return isa::Instruction::decode(word).value();
+}
+
+TEST(StencilTest, DeadLoadKeepsX0Zero) {
+  constexpr isa::Addr kPC = 0x100;
+  constexpr isa::Addr kLoaded = 0x200;
+  constexpr isa::Addr kStored = 0x300;
+  auto mem = memory::makePlain(0x1000);
+  mem->write<isa::Word>(kLoaded, 0xdeadbeef);
+  mem->write<isa::Word>(kStored, 0x12345678);
+  CPUState cpu{mem.get()};
+  cpu.setReg(kA1, kStored);
+
+  // auipc t0, 0 & lw t0, 0x100(t0) w/ dead t0, then sw x0, 0(a1)
+  const auto lwpc = isa::Instruction::fuse(decode(0x00000297),
+                                           decode(0x1002a283));
+  ASSERT_TRUE(lwpc.has_value());
+  engine::BBInfo info;
+  info.pc = kPC;
+  info.insns = {isa::Instruction::discardResult(*lwpc), decode(0x0005a023),
+                decode(0x0040006f)};
+  info.icount = 4;
+  ASSERT_EQ(info.insns.front().opcode(), isa::Opcode::kLWPC);
+  ASSERT_EQ(info.insns.front().rd(), 0);
+
+  const auto translator = engine::makeStencil();
+  const auto code = translator->translate(info);
+  ASSERT_NE(code, nullptr);
+  cpu.setPC(kPC);
+  code(cpu);
+
+  EXPECT_EQ(cpu.getReg(0), 0);
+  EXPECT_EQ(mem->read<isa::Word>(kStored), 0);
+  EXPECT_EQ(cpu.getPC(), kPC + 12 + 4);
+}
+} // namespace
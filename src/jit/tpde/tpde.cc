@@ -2,12 +2,14 @@
 #include "prot/jit/base.hh"
 #include "prot/llvm/builder.hh"
 
+#include <array>
 #include <iostream>
 #include <ranges>
 
 #include <llvm/TargetParser/Host.h>
 
 #include <forward_list>
+#include <vector>
 
 #include <fmt/core.h>
 #include <fmt/ostream.h>
@@ -28,26 +30,52 @@ public:
         }()) {}
 
   JitFunction translate(const BBInfo &info) override {
-    auto name = std::to_string(m_moduleId++);
-    const auto &[ctx, module] = ll::translate(name, info.insns);
+    return compile(std::array{&info}).front();
+  }
+
+  std::vector<JitFunction>
+  translateBatch([[maybe_unused]] const CPUState &cpu,
+                 std::span<const BBInfo *const> batch) override {
+    return compile(batch);
+  }
+
+private:
+  // Whole batch is compiled as one module. Blocks are not chained: TPDE
+  // gives no guarantee for tail calls, so chains could overflow host stack
+  std::vector<JitFunction> compile(std::span<const BBInfo *const> batch) {
+    std::vector<ll::Block> blocks;
+    blocks.reserve(batch.size());
+    for (const auto *info : batch) {
+      blocks.push_back(ll::Block{.name = std::to_string(m_moduleId++),
+                                 .pc = info->pc,
+                                 .insns = info->insns,
+                                 .icount = info->icount});
+    }
+
+    llvm::LLVMContext ctx;
+    llvm::Module module{blocks.front().name, ctx};
+    const auto funcs = ll::translate(module, blocks, {});
 
-    auto *func = module->getFunction(name);
     m_mappers.push_front(
-        m_jit->compile_and_map(*module, [](std::string_view sv) {
+        m_jit->compile_and_map(module, [](std::string_view sv) {
           // fmt::println(std::cerr, "SYM: {}", sv);
           const auto &mapper = ll::getFuncMapper();
           return mapper.at(sv);
         }));
 
-    void *ptr = m_mappers.front().lookup_global(func);
-    if (ptr == nullptr) {
-      throw std::runtime_error{"Failed to find entry function in TPDE"};
+    std::vector<JitFunction> res;
+    res.reserve(funcs.size());
+    for (auto *func : funcs) {
+      void *ptr = m_mappers.front().lookup_global(func);
+      if (ptr == nullptr) {
+        throw std::runtime_error{"Failed to find entry function in TPDE"};
+      }
+      res.push_back(reinterpret_cast<JitFunction>(ptr));
     }
 
-    return reinterpret_cast<JitFunction>(ptr);
+    return res;
   }
 
-private:
   std::unique_ptr<tpde_llvm::LLVMCompiler> m_jit;
   std::forward_list<tpde_llvm::JITMapper> m_mappers;
   std::size_t m_moduleId{};
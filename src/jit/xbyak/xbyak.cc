@@ -5,7 +5,10 @@
 #include <xbyak/xbyak.h>
 #include <xbyak/xbyak_util.h>
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <optional>
 #include <span>
 
 #include <sys/mman.h>
@@ -14,14 +17,150 @@
 
 namespace prot::engine {
 namespace {
+// Guest registers are kept in host ones within a block. Dirty values are
+// written back to CPUState at block exit & around helper calls
+class RegCache final {
+public:
+  RegCache(Xbyak::CodeGenerator &gen, const Xbyak::Reg64 &state)
+      : m_gen(gen), m_state(state) {}
+
+  // Host register holding value of guest one
+  [[nodiscard]] Xbyak::Reg32 use(isa::Operand reg);
+  // Host register to put new value of guest one to, old value is lost
+  [[nodiscard]] Xbyak::Reg32 def(isa::Operand reg);
+  // Registers used by previous insn may be reused
+  void next() { ++m_tick; }
+
+  // Caller saved registers do not survive helper calls
+  void spillCallerSaved() { spill(false); }
+  // Helper accesses guest registers through CPUState
+  void spillAll() { spill(true); }
+  // Only regs from live mask are stored
+  void writeBack(RegMask live);
+
+private:
+  struct Slot final {
+    Slot(int idx, bool isCalleeSaved)
+        : host(idx), calleeSaved(isCalleeSaved) {}
+
+    Xbyak::Reg32 host;
+    bool calleeSaved{};
+    std::optional<isa::Operand> guest;
+    bool dirty{};
+    std::size_t lastUse{};
+  };
+
+  [[nodiscard]] Xbyak::Address getMem(isa::Operand reg) const {
+    return m_gen.dword[m_state + offsetof(CPUState, regs) +
+                       isa::kWordSize * reg];
+  }
+  [[nodiscard]] Slot *find(isa::Operand reg);
+  [[nodiscard]] Slot &alloc(isa::Operand reg);
+  void store(Slot &slot);
+  void spill(bool all);
+
+  Xbyak::CodeGenerator &m_gen;
+  Xbyak::Reg64 m_state;
+  // Callee saved ones go first, so they are taken before caller saved
+  std::array<Slot, 8> m_slots{
+      Slot{Xbyak::Operand::R12, true}, Slot{Xbyak::Operand::R13, true},
+      Slot{Xbyak::Operand::R14, true}, Slot{Xbyak::Operand::R15, true},
+      Slot{Xbyak::Operand::R8, false}, Slot{Xbyak::Operand::R9, false},
+      Slot{Xbyak::Operand::R10, false}, Slot{Xbyak::Operand::R11, false},
+  };
+  std::size_t m_tick{1};
+};
+
+auto RegCache::find(isa::Operand reg) -> Slot * {
+  const auto found = std::ranges::find(m_slots, reg, &Slot::guest);
+  return found != m_slots.end() ? &*found : nullptr;
+}
+
+auto RegCache::alloc(isa::Operand reg) -> Slot & {
+  // Free slot or least recently used one
+  auto &slot = *std::ranges::min_element(m_slots, {}, [](const Slot &slot) {
+    return slot.guest.has_value() ? slot.lastUse + 1 : 0;
+  });
+  assert(!slot.guest.has_value() || slot.lastUse != m_tick);
+
+  store(slot);
+  slot.guest = reg;
+  slot.lastUse = m_tick;
+  return slot;
+}
+
+Xbyak::Reg32 RegCache::use(isa::Operand reg) {
+  if (auto *slot = find(reg); slot != nullptr) {
+    slot->lastUse = m_tick;
+    return slot->host;
+  }
+
+  const auto &slot = alloc(reg);
+  if (reg == 0) {
+    m_gen.xor_(slot.host, slot.host);
+  } else {
+    m_gen.mov(slot.host, getMem(reg));
+  }
+  return slot.host;
+}
+
+Xbyak::Reg32 RegCache::def(isa::Operand reg) {
+  // Writes to x0 go to scratch register
+  if (reg == 0) {
+    return m_gen.edx;
+  }
+
+  auto *slot = find(reg);
+  if (slot == nullptr) {
+    slot = &alloc(reg);
+  }
+  slot->lastUse = m_tick;
+  slot->dirty = true;
+  return slot->host;
+}
+
+void RegCache::store(Slot &slot) {
+  if (slot.dirty) {
+    m_gen.mov(getMem(*slot.guest), slot.host);
+    slot.dirty = false;
+  }
+}
+
+void RegCache::writeBack(RegMask live) {
+  for (auto &slot : m_slots) {
+    if (slot.guest.has_value() && (live & regBit(*slot.guest)) == 0) {
+      slot.dirty = false;
+    }
+    store(slot);
+  }
+}
+
+void RegCache::spill(bool all) {
+  for (auto &slot : m_slots) {
+    if (all || !slot.calleeSaved) {
+      store(slot);
+      slot.guest.reset();
+    }
+  }
+}
+
 class XByakJit : public Translator, private Xbyak::CodeGenerator {
 public:
   XByakJit()
-      : Xbyak::CodeGenerator{Xbyak::DEFAULT_MAX_CODE_SIZE, Xbyak::AutoGrow} {}
+      : Xbyak::CodeGenerator{Xbyak::DEFAULT_MAX_CODE_SIZE, Xbyak::AutoGrow},
+        m_hasBMI2(Xbyak::util::Cpu{}.has(Xbyak::util::Cpu::tBMI2)) {}
 
 private:
   [[nodiscard]] JitFunction translate(const BBInfo &info) override;
 
+  template <typename Func> void callHelper(Func *helper) {
+    mov(rdi, rbx);
+    mov(rax, reinterpret_cast<std::uintptr_t>(helper));
+    call(rax);
+  }
+
+  // Variable shifts w/o fixed cl operand
+  bool m_hasBMI2{};
   std::vector<CodeHolder> m_holders;
 };
 
@@ -38,69 +177,116 @@ void syscallHelper(CPUState &state) { state.emulateSysCall(); }
 
 JitFunction XByakJit::translate(const BBInfo &info) {
   reset(); // XByak specific (CodeGenerator is about a PAGE size!!, so reuse it)
-  Xbyak::util::StackFrame frame{this, 3, 3 | Xbyak::util::UseRCX};
-
-  [[maybe_unused]] auto temp1 = frame.t[0].cvt32();
-  [[maybe_unused]] auto temp2 = frame.t[1].cvt32();
-  [[maybe_unused]] auto temp3 = frame.t[2].cvt32();
 
-  auto getReg = [&frame, this](std::size_t regId) {
-    return dword[frame.p[0] + offsetof(CPUState, regs) +
-                 isa::kWordSize * regId];
-  };
-
-  auto getPc = [&frame, this] {
-    return dword[frame.p[0] + offsetof(CPUState, pc)];
-  };
+  // State pointer lives in callee saved rbx, so helper calls keep it. Odd
+  // number of pushes keeps stack aligned for them
+  push(rbx);
+  push(r12);
+  push(r13);
+  push(r14);
+  push(r15);
+  mov(rbx, rdi);
+
+  RegCache regs{*this, rbx};
+
+  // PC is constant for translated block, so it is written once at exit.
+  // Dynamic target of the last insn is computed to eax
+  auto pc = info.pc;
+  std::optional<isa::Addr> nextPc;
+
+  for (const auto &insn : simplifyInsns(info.insns)) {
+    nextPc = pc + insn.size();
+
+    auto binOp = [&](auto op, bool commutative) {
+      const auto rs1 = regs.use(insn.rs1());
+      const auto rs2 = regs.use(insn.rs2());
+      const auto rd = regs.def(insn.rd());
+      if (rd.getIdx() == rs2.getIdx() && rd.getIdx() != rs1.getIdx()) {
+        if (commutative) {
+          op(rd, rs1);
+        } else {
+          mov(eax, rs1);
+          op(eax, rs2);
+          mov(rd, eax);
+        }
+        return;
+      }
+      if (rd.getIdx() != rs1.getIdx()) {
+        mov(rd, rs1);
+      }
+      op(rd, rs2);
+    };
 
-  for (const auto &insn : info.insns) {
-    auto getRs1 = [&](Xbyak::Reg32 reg) { mov(reg, getReg(insn.rs1())); };
-    auto getRs2 = [&](Xbyak::Reg32 reg) { mov(reg, getReg(insn.rs2())); };
+    // Comparison w/ x0 needs no zero register
+    auto compare = [&] {
+      const auto rs1 = regs.use(insn.rs1());
+      if (insn.rs2() == 0) {
+        test(rs1, rs1);
+      } else {
+        cmp(rs1, regs.use(insn.rs2()));
+      }
+    };
 
-    auto setRd = [&](Xbyak::Reg32 reg) {
-      if (insn.rd() != 0)
-        mov(getReg(insn.rd()), reg);
+    auto immOp = [&](auto op) {
+      const auto rs1 = regs.use(insn.rs1());
+      const auto rd = regs.def(insn.rd());
+      if (rd.getIdx() != rs1.getIdx()) {
+        mov(rd, rs1);
+      }
+      op(rd, insn.imm());
     };
 
     switch (insn.opcode()) {
       using enum isa::Opcode;
 #define PROT_MAKE_IMPL(OP, op)                                                 \
   case k##OP: {                                                                \
-    getRs1(temp1);                                                             \
-    op(temp1, getReg(insn.rs2()));                                             \
-    setRd(temp1);                                                              \
+    binOp([this](const auto &dst, const auto &src) { op(dst, src); }, true);   \
     break;                                                                     \
   }                                                                            \
   case k##OP##I: {                                                             \
-    getRs1(temp1);                                                             \
-    op(temp1, insn.imm());                                                     \
-    setRd(temp1);                                                              \
+    immOp([this](const auto &dst, auto imm) { op(dst, imm); });                \
     break;                                                                     \
   }
 
-      PROT_MAKE_IMPL(ADD, add)
+    case kADD: {
+      binOp([this](const auto &dst, const auto &src) { add(dst, src); }, true);
+      break;
+    }
+    case kADDI: {
+      // Copy & add are done at once
+      const auto rs1 = regs.use(insn.rs1());
+      const auto rd = regs.def(insn.rd());
+      const auto imm = static_cast<std::int32_t>(insn.imm());
+      if (rd.getIdx() == rs1.getIdx()) {
+        if (imm != 0) {
+          add(rd, imm);
+        }
+      } else if (imm == 0) {
+        mov(rd, rs1);
+      } else {
+        lea(rd, ptr[rs1.cvt64() + imm]);
+      }
+      break;
+    }
       PROT_MAKE_IMPL(AND, and_)
       PROT_MAKE_IMPL(OR, or_)
       PROT_MAKE_IMPL(XOR, xor_)
 
 #undef PROT_MAKE_IMPL
 
-    case kAUIPC: {
-      mov(temp1, getPc());
-      add(temp1, insn.imm());
-      setRd(temp1);
+    case kAUIPC:
+    case kLA: {
+      mov(regs.def(insn.rd()), pc + insn.imm());
       break;
     }
 
 #define PROT_MAKE_IMPL(Op, cc)                                                 \
   case kB##Op: {                                                               \
-    getRs1(temp1);                                                             \
-    cmp(temp1, getReg(insn.rs2()));                                            \
-    mov(temp1, isa::kWordSize);                                                \
-    mov(temp2, insn.imm());                                                    \
-    cmov##cc(temp1, temp2);                                                    \
-                                                                               \
-    add(getPc(), temp1);                                                       \
+    compare();                                                                 \
+    mov(eax, pc + isa::kWordSize);                                             \
+    mov(ecx, pc + insn.imm());                                                 \
+    cmov##cc(eax, ecx);                                                        \
+    nextPc.reset();                                                            \
     break;                                                                     \
   }
       PROT_MAKE_IMPL(EQ, z)
@@ -114,40 +300,30 @@ JitFunction XByakJit::translate(const BBInfo &info) {
     case kEBREAK:
       break;
     case kECALL: {
-      // set finished
-      mov(frame.t[0], reinterpret_cast<std::uintptr_t>(&syscallHelper));
-      push(frame.p[0]);
-      call(frame.t[0]);
-      pop(frame.p[0]);
+      regs.spillAll();
+      callHelper(&syscallHelper);
       break;
     }
     case kFENCE: {
       break;
     }
     case kJAL: {
-      mov(temp1, getPc());
-      add(temp1, isa::kWordSize);
-      setRd(temp1);
-
-      add(getPc(), insn.imm());
+      mov(regs.def(insn.rd()), pc + isa::kWordSize);
+      nextPc = pc + insn.imm();
       break;
     }
     case kJALR: {
-      mov(temp1, getPc());
-      add(temp1, isa::kWordSize);
-
-      getRs1(temp2);
-      add(temp2, insn.imm());
-      and_(temp2, ~std::uint32_t{1});
-      mov(getPc(), temp2);
-
-      setRd(temp1);
+      // rd may be the same as rs1
+      mov(eax, regs.use(insn.rs1()));
+      add(eax, insn.imm());
+      and_(eax, ~std::uint32_t{1});
+      mov(regs.def(insn.rd()), pc + isa::kWordSize);
+      nextPc.reset();
       break;
     }
-    case kLUI: {
-      if (insn.rd() != 0) {
-        mov(getReg(insn.rd()), insn.imm());
-      }
+    case kLUI:
+    case kLI: {
+      mov(regs.def(insn.rd()), insn.imm());
       break;
     }
     case kLB:
@@ -155,42 +331,43 @@ JitFunction XByakJit::translate(const BBInfo &info) {
     case kLH:
     case kLHU:
     case kLW: {
-      auto addr = frame.p[1].cvt32();
-      getRs1(addr);
-      add(addr, insn.imm()); // calc addr
-
-      const auto helper = [op = insn.opcode()] {
-        switch (op) {
-        case kLB:
-        case kLBU:
-          return reinterpret_cast<std::uintptr_t>(&loadHelper<isa::Byte>);
-        case kLH:
-        case kLHU:
-          return reinterpret_cast<std::uintptr_t>(&loadHelper<isa::Half>);
-        case kLW:
-          return reinterpret_cast<std::uintptr_t>(&loadHelper<isa::Word>);
-        default:
-          return std::uintptr_t{};
-        }
-      }();
+      mov(esi, regs.use(insn.rs1()));
+      add(esi, insn.imm()); // calc addr
+      regs.spillCallerSaved();
 
-      push(frame.p[0]);
-      mov(frame.t[0], helper);
-      call(frame.t[0]);
-      pop(frame.p[0]);
       switch (insn.opcode()) {
       case kLB:
-        cbw();
-        [[fallthrough]];
+      case kLBU:
+        callHelper(&loadHelper<isa::Byte>);
+        break;
       case kLH:
-        cwde();
+      case kLHU:
+        callHelper(&loadHelper<isa::Half>);
         break;
       default:
+        callHelper(&loadHelper<isa::Word>);
         break;
       }
 
-      setRd(eax);
-
+      // Upper bits of narrow return value are undefined
+      const auto rd = regs.def(insn.rd());
+      switch (insn.opcode()) {
+      case kLB:
+        movsx(rd, al);
+        break;
+      case kLBU:
+        movzx(rd, al);
+        break;
+      case kLH:
+        movsx(rd, ax);
+        break;
+      case kLHU:
+        movzx(rd, ax);
+        break;
+      default:
+        mov(rd, eax);
+        break;
+      }
       break;
     }
     case kPAUSE:
@@ -200,18 +377,18 @@ JitFunction XByakJit::translate(const BBInfo &info) {
     }
 #define PROT_MAKE_IMPL(Op, Op2, cc)                                            \
   case k##Op: {                                                                \
-    getRs1(temp1);                                                             \
-    cmp(temp1, getReg(insn.rs2()));                                            \
-    mov(temp1, 0);                                                             \
-    set##cc(temp1.cvt8());                                                     \
-    setRd(temp1);                                                              \
+    compare();                                                                 \
+    const auto rd = regs.def(insn.rd());                                       \
+    set##cc(al);                                                               \
+    movzx(rd, al);                                                             \
     break;                                                                     \
   }                                                                            \
   case k##Op2: {                                                               \
-    cmp(getReg(insn.rs1()), insn.imm());                                       \
-    mov(temp1, 0);                                                             \
-    set##cc(temp1.cvt8());                                                     \
-    setRd(temp1);                                                              \
+    const auto rs1 = regs.use(insn.rs1());                                     \
+    const auto rd = regs.def(insn.rd());                                       \
+    cmp(rs1, insn.imm());                                                      \
+    set##cc(al);                                                               \
+    movzx(rd, al);                                                             \
     break;                                                                     \
   }
       PROT_MAKE_IMPL(SLT, SLTI, l);
@@ -220,16 +397,22 @@ JitFunction XByakJit::translate(const BBInfo &info) {
 
 #define PROT_MAKE_IMPL(Op, op)                                                 \
   case kS##Op: {                                                               \
-    getRs1(temp1);                                                             \
-    getRs2(ecx);                                                               \
-    op(temp1, cl);                                                             \
-    setRd(temp1);                                                              \
+    const auto rs1 = regs.use(insn.rs1());                                     \
+    const auto rs2 = regs.use(insn.rs2());                                     \
+    const auto rd = regs.def(insn.rd());                                       \
+    if (m_hasBMI2) {                                                           \
+      op##x(rd, rs1, rs2);                                                     \
+      break;                                                                   \
+    }                                                                          \
+    mov(ecx, rs2);                                                             \
+    if (rd.getIdx() != rs1.getIdx()) {                                         \
+      mov(rd, rs1);                                                            \
+    }                                                                          \
+    op(rd, cl);                                                                \
     break;                                                                     \
   }                                                                            \
   case kS##Op##I: {                                                            \
-    getRs1(temp1);                                                             \
-    op(temp1, insn.imm());                                                     \
-    setRd(temp1);                                                              \
+    immOp([this](const auto &dst, auto imm) { op(dst, imm); });                \
     break;                                                                     \
   }
 
@@ -239,49 +422,80 @@ JitFunction XByakJit::translate(const BBInfo &info) {
 #undef PROT_MAKE_IMPL
 
     case kSUB: {
-      getRs1(temp1);
-      sub(temp1, getReg(insn.rs2()));
-      setRd(temp1);
+      binOp([this](const auto &dst, const auto &src) { sub(dst, src); },
+            false);
       break;
     }
     case kSB:
     case kSH:
     case kSW: {
-      auto addr = frame.p[1].cvt32();
-      getRs1(addr);
-      add(addr, insn.imm()); // calc addr
-      auto val = frame.p[2].cvt32();
-      getRs2(val);
-
-      const auto helper = [op = insn.opcode()] {
-        switch (op) {
-        case kSB:
-          return reinterpret_cast<std::uintptr_t>(&storeHelper<isa::Byte>);
-        case kSH:
-          return reinterpret_cast<std::uintptr_t>(&storeHelper<isa::Half>);
-        case kSW:
-          return reinterpret_cast<std::uintptr_t>(&storeHelper<isa::Word>);
-        default:
-          return std::uintptr_t{};
-        };
-      }();
-
-      push(frame.p[0]);
-      mov(frame.t[0], helper);
-      call(frame.t[0]);
-      pop(frame.p[0]);
+      mov(esi, regs.use(insn.rs1()));
+      add(esi, insn.imm()); // calc addr
+      mov(edx, regs.use(insn.rs2()));
+      regs.spillCallerSaved();
+
+      switch (insn.opcode()) {
+      case kSB:
+        callHelper(&storeHelper<isa::Byte>);
+        break;
+      case kSH:
+        callHelper(&storeHelper<isa::Half>);
+        break;
+      default:
+        callHelper(&storeHelper<isa::Word>);
+        break;
+      }
+      break;
+    }
+    case kLWPC: {
+      mov(esi, pc + insn.imm());
+      regs.spillCallerSaved();
+      callHelper(&loadHelper<isa::Word>);
+      mov(regs.def(insn.rd()), eax);
+      break;
+    }
+    case kCALL: {
+      mov(regs.def(insn.rd()), pc + insn.size());
+      nextPc = (pc + insn.imm()) & ~std::uint32_t{1};
+      break;
+    }
+    case kSHADD: {
+      const auto rs1 = regs.use(insn.rs1());
+      const auto rs2 = regs.use(insn.rs2());
+      const auto rd = regs.def(insn.rd());
+      if (const auto shamt = isa::slice<4, 0>(insn.imm()); shamt <= 3) {
+        lea(rd, ptr[rs2.cvt64() + rs1.cvt64() * (1 << shamt)]);
+      } else {
+        mov(eax, rs1);
+        shl(eax, shamt);
+        add(eax, rs2);
+        mov(rd, eax);
+      }
       break;
     }
     case kNumOpcodes:
       throw std::invalid_argument{"Unexpected insn id"};
     }
-    if (!isa::changesPC(insn.opcode())) {
-      add(getPc(), isa::kWordSize);
-    }
-    inc(qword[frame.p[0] + offsetof(CPUState, icount)]);
+
+    regs.next();
+    pc += insn.size();
   }
 
-  frame.close();
+  regs.writeBack(info.live_out);
+  if (nextPc.has_value()) {
+    mov(dword[rbx + offsetof(CPUState, pc)], *nextPc);
+  } else {
+    mov(dword[rbx + offsetof(CPUState, pc)], eax);
+  }
+  add(qword[rbx + offsetof(CPUState, icount)], info.icount);
+
+  pop(r15);
+  pop(r14);
+  pop(r13);
+  pop(r12);
+  pop(rbx);
+  ret();
+
   ready();
   // Copy data to holder
   return m_holders.emplace_back(std::as_bytes(std::span{getCode(), getSize()}))
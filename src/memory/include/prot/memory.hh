@@ -4,10 +4,26 @@
 #include <array>
 #include <memory>
 #include <span>
+#include <string>
 
 #include "prot/isa.hh"
 
 namespace prot {
+struct AddrRange final {
+  isa::Addr start{};
+  std::size_t size{};
+
+  [[nodiscard]] constexpr bool contains(isa::Addr addr) const {
+    return addr >= start && addr - start < size;
+  }
+};
+
+// Guest function, e.g. from ELF symbol table
+struct FuncSymbol final {
+  std::string name;
+  AddrRange range;
+};
+
 struct Memory {
 
   Memory() = default;
@@ -20,6 +36,25 @@ struct Memory {
   virtual void writeBlock(std::span<const std::byte> src, isa::Addr addr) = 0;
   virtual void readBlock(isa::Addr addr, std::span<std::byte> dest) const = 0;
 
+  // Host address of guest address 0 if whole guest memory is a single flat
+  // host mapping (guest addr maps to base + addr), nullptr otherwise
+  [[nodiscard]] virtual std::byte *getHostBase() const { return nullptr; }
+
+  // Backs range w/ single contiguous host buffer which stays in place for
+  // memory lifetime, contents are kept. Returns host address of guest
+  // address 0 for that buffer (guest addr from range maps to base + addr),
+  // nullptr if memory cannot do it
+  [[nodiscard]] virtual std::byte *pin(const AddrRange & /*range*/) {
+    return nullptr;
+  }
+
+  // Makes range read-only for the rest of memory lifetime, guest writes
+  // there fault afterwards. Returns part of range actually protected,
+  // memory may only protect whole host pages or nothing at all
+  [[nodiscard]] virtual AddrRange protect(const AddrRange & /*range*/) {
+    return {};
+  }
+
   void fillBlock(isa::Addr addr, std::byte value, std::size_t count) {
     for (std::size_t i = 0; i < count; ++i) {
       writeBlock({&value, 1}, addr + i);
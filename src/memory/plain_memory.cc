@@ -9,6 +9,7 @@
 
 extern "C" {
 #include <sys/mman.h>
+#include <unistd.h>
 }
 
 namespace prot::memory {
@@ -65,6 +66,39 @@ public:
     *reinterpret_cast<std::uint32_t *>(translateAddr(addr)) = val;
   }
 
+  [[nodiscard]] std::byte *getHostBase() const override {
+    // NOLINTNEXTLINE
+    return reinterpret_cast<std::byte *>(
+        reinterpret_cast<std::uintptr_t>(m_data.data()) - m_start);
+  }
+
+  [[nodiscard]] std::byte *pin(const AddrRange &range) override {
+    // Whole memory is already one buffer
+    if (range.start < m_start ||
+        range.start - m_start + range.size > m_data.size()) {
+      return nullptr;
+    }
+    return getHostBase();
+  }
+
+  [[nodiscard]] AddrRange protect(const AddrRange &range) override {
+    if (range.start < m_start ||
+        range.start - m_start + range.size > m_data.size()) {
+      return {};
+    }
+    // Buffer is page aligned, so are offsets of host pages
+    const auto pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const auto offset = addrToOffset(range.start);
+    const auto begin = (offset + pageSize - 1) / pageSize * pageSize;
+    const auto end = (offset + range.size) / pageSize * pageSize;
+    if (begin >= end ||
+        ::mprotect(m_data.data() + begin, end - begin, PROT_READ) != 0) {
+      return {};
+    }
+    return AddrRange{.start = static_cast<isa::Addr>(m_start + begin),
+                     .size = end - begin};
+  }
+
   void writeBlock(std::span<const std::byte> src, isa::Addr addr) override {
     // checkRange(addr, src.size());
     std::memcpy(translateAddr(addr), src.data(), src.size());
@@ -3,6 +3,11 @@
 #include <cassert>
 #include <concepts>
 #include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <memory>
 #include <ranges>
 #include <vector>
 
@@ -55,21 +60,20 @@ class PagedMem : public Memory, private PagedMemConfig {
 
 public:
   explicit PagedMem(std::size_t pageBits)
-      : PagedMemConfig{pageBits}, m_storage(numPages()) {}
+      : PagedMemConfig{pageBits}, m_pages(numPages()), m_storage(numPages()) {}
 
   void writeBlock(std::span<const std::byte> src, isa::Addr addr) override {
     pageWalk(addr, src.size(), [src, this, start = addr](const LocInfo &info) {
       assert(info.offset + info.size <= pageSize());
-      auto &page = m_storage[info.page];
+      auto *&page = m_pages[info.page];
       auto addr = getAddr(info.page, info.offset);
-      if (page.empty()) {
-        page.resize(pageSize());
+      if (page == nullptr) {
+        m_storage[info.page] = std::make_unique<std::byte[]>(pageSize());
+        page = m_storage[info.page].get();
       }
 
-      assert(page.size() == pageSize());
-
       std::ranges::copy(src.subspan(addr - start, info.size),
-                        page.data() + info.offset);
+                        page + info.offset);
     });
   }
 
@@ -77,23 +81,88 @@ public:
     pageWalk(addr, dest.size(),
              [dest, this, start = addr](const LocInfo &info) {
                assert(info.offset + info.size <= pageSize());
-               const auto &page = m_storage[info.page];
+               const auto *page = m_pages[info.page];
                auto addr = getAddr(info.page, info.offset);
-               if (page.empty()) {
+               if (page == nullptr) {
                  throw std::runtime_error{fmt::format(
                      "Trying to read range [{:#x}, {:#x}) which is located "
                      "outside of allocated memory",
                      addr, addr + info.size)};
                }
 
-               assert(page.size() == pageSize());
-
-               std::ranges::copy_n(page.data() + info.offset, info.size,
+               std::ranges::copy_n(page + info.offset, info.size,
                                    dest.data() + (addr - start));
              });
   }
 
+  // Defaults of Memory call each other, so fixed size accesses are built
+  // from block ones here
+  std::uint8_t read8(isa::Addr addr) const override {
+    return load<std::uint8_t>(addr);
+  }
+  std::uint16_t read16(isa::Addr addr) const override {
+    return load<std::uint16_t>(addr);
+  }
+  std::uint32_t read32(isa::Addr addr) const override {
+    return load<std::uint32_t>(addr);
+  }
+  void write8(isa::Addr addr, std::uint8_t val) override { store(addr, val); }
+  void write16(isa::Addr addr, std::uint16_t val) override {
+    store(addr, val);
+  }
+  void write32(isa::Addr addr, std::uint32_t val) override {
+    store(addr, val);
+  }
+
+  [[nodiscard]] std::byte *pin(const AddrRange &range) override {
+    if (range.size == 0 || range.start + range.size - 1 < range.start) {
+      return nullptr;
+    }
+    const auto firstPage = getPage(range.start);
+    const auto lastPage = getPage(range.start + range.size - 1) + 1;
+
+    // Pinned pages are never moved again, so given out pointers stay valid
+    const auto found = std::ranges::find_if(m_pinned, [&](const Pinned &buf) {
+      return buf.firstPage <= firstPage && lastPage <= buf.lastPage;
+    });
+    if (found == m_pinned.end()) {
+      const auto pages = std::views::iota(firstPage, lastPage);
+      if (std::ranges::any_of(pages,
+                              [&](auto page) { return isPinned(page); })) {
+        return nullptr;
+      }
+
+      auto &buf = m_pinned.emplace_back(Pinned{
+          .firstPage = firstPage,
+          .lastPage = lastPage,
+          .data = std::make_unique<std::byte[]>(pages.size() * pageSize())});
+      for (auto page : pages) {
+        auto *dest = buf.data.get() + (page - firstPage) * pageSize();
+        if (m_pages[page] != nullptr) {
+          std::copy_n(m_pages[page], pageSize(), dest);
+        }
+        m_pages[page] = dest;
+        m_storage[page].reset();
+      }
+    }
+
+    // NOLINTNEXTLINE
+    return reinterpret_cast<std::byte *>(
+        reinterpret_cast<std::uintptr_t>(m_pages[firstPage]) -
+        getAddr(firstPage, 0));
+  }
+
 private:
+  template <std::unsigned_integral T> T load(isa::Addr addr) const {
+    std::array<std::byte, sizeof(T)> buf;
+    readBlock(addr, buf);
+    return std::bit_cast<T>(buf);
+  }
+  template <std::unsigned_integral T> void store(isa::Addr addr, T val) {
+    const auto &buf = std::bit_cast<std::array<std::byte, sizeof(T)>>(val);
+    writeBlock(buf, addr);
+  }
+
   template <typename Self, std::regular_invocable<LocInfo> Op>
   static void pageWalk(Self &&self, isa::Addr addr, std::size_t size, Op op) {
     assert(addr + size >= addr);
@@ -129,8 +198,24 @@ private:
     pageWalk(*this, addr, size, std::move(op));
   }
 
-  using Page = std::vector<std::byte>;
-  std::vector<Page> m_storage;
+  [[nodiscard]] bool isPinned(std::size_t page) const {
+    return std::ranges::any_of(m_pinned, [page](const Pinned &buf) {
+      return page >= buf.firstPage && page < buf.lastPage;
+    });
+  }
+
+  // Buffer backing several consecutive pages
+  struct Pinned final {
+    std::size_t firstPage{};
+    std::size_t lastPage{};
+    std::unique_ptr<std::byte[]> data;
+  };
+
+  // Host address of each page, null until page is written
+  std::vector<std::byte *> m_pages;
+  // Pages allocated one by one
+  std::vector<std::unique_ptr<std::byte[]>> m_storage;
+  std::vector<Pinned> m_pinned;
 };
 } // namespace
 
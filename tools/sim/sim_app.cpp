@@ -2,6 +2,8 @@
 
 #include <chrono>
 #include <filesystem>
+#include <map>
+#include <string>
 
 #include <fmt/core.h>
 #include <fmt/ostream.h>
@@ -17,8 +19,12 @@ int main(int argc, const char *argv[]) try {
   std::filesystem::path elfPath;
   constexpr prot::isa::Addr kDefaultStack = 0x7fffffff;
   prot::isa::Addr stackTop{};
+  std::size_t stackSize{};
   std::string jitBackend{};
   prot::engine::JitEngine::Config jitConfig{};
+  prot::engine::TranslatorOptions translatorOptions{};
+  bool jitStats{false};
+  unsigned llvmOptLevel{};
 
   {
     CLI::App app{"App for JIT research from ProteusLab team"};
@@ -31,6 +37,10 @@ int main(int argc, const char *argv[]) try {
         ->default_val(kDefaultStack)
         ->default_str(fmt::format("{:#x}", kDefaultStack));
 
+    app.add_option("--stack-size", stackSize, "Size of the stack in bytes")
+        ->default_val(prot::Hart::kDefaultStackSize)
+        ->capture_default_str();
+
     auto *jit =
         app.add_option("--jit", jitBackend, "Use JIT & set backend")
             ->check(CLI::IsMember(prot::engine::JitFactory::backends()));
@@ -47,24 +57,102 @@ int main(int argc, const char *argv[]) try {
     jitOpts->add_flag("--dump-cpu", jitConfig.enableDump,
                       "Enable dump of CPU state before each TB");
 
+    jitOpts->add_flag("!--no-fusion", jitConfig.enableFusion,
+                      "Disable macro-op fusion of common RV32I idioms");
+    jitOpts->add_flag("!--no-stack-path", jitConfig.enableStackPath,
+                      "Disable direct sp-relative accesses to pinned stack");
+    jitOpts->add_flag("!--no-block-opt", jitConfig.enableBlockOpt,
+                      "Disable constant folding & dead write elimination "
+                      "inside BBs");
+    jitOpts->add_flag("!--no-liveness", jitConfig.enableLiveness,
+                      "Disable reg liveness tracking across BBs");
+    jitOpts->add_flag("!--no-idioms", jitConfig.enableIdioms,
+                      "Disable host bulk ops for memcpy/memset-like loops");
+
+    jitOpts
+        ->add_option("--jit-batch", jitConfig.batchSize,
+                     "Specify amount of hot BBs compiled together")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+    jitOpts
+        ->add_option("--jit-batch-window", jitConfig.batchWindow,
+                     "Specify amount of extra execs of a queued BB before its "
+                     "batch is compiled anyway")
+        ->capture_default_str();
+
+    jitOpts->add_flag("--jit-regions", jitConfig.enableRegions,
+                      "Compile hot loops spanning several BBs as a whole");
+
+    jitOpts->add_flag("--jit-lift", jitConfig.enableLifting,
+                      "Lift ELF functions ahead of run, each one is compiled "
+                      "on its first call (LLVM only)");
+
+    jitOpts
+        ->add_option("--jit-opt", translatorOptions.optLevel,
+                     "Set translator optimization level (0 - 3)")
+        ->check(CLI::Range(0, 3))
+        ->capture_default_str();
+
+    auto *llvmOpt =
+        jitOpts
+            ->add_option("--llvm-opt", llvmOptLevel,
+                         "Set LLVM codegen level, by default it follows "
+                         "--jit-opt")
+            ->transform(CLI::CheckedTransformer(
+                std::map<std::string, unsigned>{
+                    {"O0", 0}, {"O1", 1}, {"O2", 2}, {"O3", 3}}));
+
+    jitOpts->add_flag("--llvm-default-pipeline",
+                      translatorOptions.defaultPipeline,
+                      "Run LLVM default optimization pipeline for --jit-opt "
+                      "instead of the tuned one");
+
+    jitOpts
+        ->add_option("--jit-threads", translatorOptions.compileThreads,
+                     "Set number of threads compiling a batch (MIR only)")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+
+    jitOpts->add_flag("--jit-lazy", translatorOptions.lazyCodegen,
+                      "Generate code of a translated BB on its first "
+                      "execution (MIR only)");
+
+    jitOpts->add_flag("!--no-mem-forwarding", translatorOptions.forwardMemory,
+                      "Disable forwarding of guest stores to loads inside "
+                      "translated BBs");
+
+    jitOpts->add_flag("--jit-stats", jitStats,
+                      "Dump per-phase compile times after run");
+
     CLI11_PARSE(app, argc, argv);
+    if (jitConfig.enableLifting && jitBackend != "llvm") {
+      return app.exit(CLI::ValidationError{
+          "--jit-lift", "only llvm backend lifts functions"});
+    }
+    if (llvmOpt->count() != 0) {
+      translatorOptions.codegenLevel = llvmOptLevel;
+    }
   }
   const bool jitEnabled = !jitBackend.empty();
+  const prot::engine::JitEngine *jitEngine{};
 
   auto hart = [&] {
     prot::ElfLoader loader{elfPath};
 
     auto engine = [&]() -> std::unique_ptr<prot::ExecEngine> {
       if (jitEnabled) {
-        return std::make_unique<prot::engine::JitEngine>(
-            jitConfig, prot::engine::JitFactory::createTranslator(jitBackend));
+        auto res = std::make_unique<prot::engine::JitEngine>(
+            jitConfig, prot::engine::JitFactory::createTranslator(
+                           jitBackend, translatorOptions));
+        jitEngine = res.get();
+        return res;
       }
       return std::make_unique<prot::engine::Interpreter>();
     }();
     auto mem = prot::memory::makePlain(4ULL << 30U);
     prot::Hart hart{std::move(mem), std::move(engine)};
     hart.load(loader);
-    hart.setSP(stackTop);
+    hart.setSP(stackTop, stackSize);
 
     return hart;
   }();
@@ -78,6 +166,9 @@ int main(int argc, const char *argv[]) try {
   fmt::println("time: {}s", duration.count());
   if (jitEnabled) {
     fmt::println("threshold: {}", jitConfig.execThreshold);
+    if (jitStats) {
+      jitEngine->dumpStats(std::cout);
+    }
   }
   fmt::println("mips: {}", hart.getIcount() / (duration.count() * 1000000));
   return hart.getExitCode();